@@ -0,0 +1,431 @@
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "lib_tar.h"
+#include <unistd.h>
+#include <getopt.h>
+
+#define NB_HEADERS 100000
+#define NB_ROUNDS 20
+#define FILES_PER_DIR 64
+
+/**
+ * Benchmarks of the library, each result is printed as one JSON object per line.
+ *
+ * Usage: bench [-n entries] [-d depth] [-s max_size] [-l symlink_ratio] [-q queries] [-r seed]
+ *
+ * The queries run against a synthetic archive of the given number of entries, spread over
+ * directories nested depth levels deep, with file sizes up to max_size skewed towards small
+ * files, and a share of the entries being symlinks to a file of the same directory.
+ */
+
+struct gen_params {
+    long entries;
+    int depth;
+    long max_size;
+    double symlink_ratio;
+    long queries;
+    unsigned seed;
+};
+
+/* What the generator made: entry i is a symlink, a file or, as its first one, a directory. */
+enum { GEN_FILE, GEN_SYMLINK };
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char *bench, const char *impl, long n, double ns) {
+    printf("{\"bench\":\"%s\",\"impl\":\"%s\",\"n\":%ld,\"ns_per_op\":%.2f,\"ops_per_s\":%.0f}\n",
+           bench, impl, n, ns / n, n / (ns / 1e9));
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/* Reports the distribution of n latencies, sorting them on the way. */
+static void report_latencies(const char *bench, const char *impl, double *ns, long n) {
+    double total = 0;
+    for (long i = 0; i < n; i++)
+        total += ns[i];
+    qsort(ns, n, sizeof(double), compare_doubles);
+    printf("{\"bench\":\"%s\",\"impl\":\"%s\",\"n\":%ld,\"ns_per_op\":%.2f,\"ops_per_s\":%.0f,"
+           "\"p50_ns\":%.0f,\"p90_ns\":%.0f,\"p99_ns\":%.0f,\"max_ns\":%.0f}\n",
+           bench, impl, n, total / n, n / (total / 1e9), ns[n / 2], ns[n * 9 / 10], ns[n * 99 / 100], ns[n - 1]);
+}
+
+/* Cheap deterministic hash, so that entry i can be told apart without storing anything. */
+static unsigned long mix(unsigned long x, unsigned seed) {
+    x ^= seed * 0x9e3779b97f4a7c15UL;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdUL;
+    x ^= x >> 33;
+    return x;
+}
+
+/* The directory of entry i, nested depth levels deep. */
+static void gen_dir(long i, int depth, char *out, size_t len) {
+    long dir = i / FILES_PER_DIR;
+    int n = snprintf(out, len, "bench");
+    for (int level = depth - 1; level >= 0; level--) {
+        long part = dir;
+        for (int k = 0; k < level; k++)
+            part /= 16;
+        n += snprintf(out + n, len - n, "/d%lx", part % 16);
+    }
+    snprintf(out + n, len - n, "/%ld", dir);
+}
+
+static int gen_kind(const struct gen_params *p, long i) {
+    /* the first entry of each directory is a file, for the symlinks of the others to point to */
+    if (i % FILES_PER_DIR == 0)
+        return GEN_FILE;
+    return (mix(i, p->seed) % 1000000) < p->symlink_ratio * 1000000 ? GEN_SYMLINK : GEN_FILE;
+}
+
+static void gen_path(const struct gen_params *p, long i, char *out, size_t len) {
+    char dir[512];
+    gen_dir(i, p->depth, dir, sizeof(dir));
+    snprintf(out, len, "%s/%s%07ld", dir, gen_kind(p, i) == GEN_SYMLINK ? "link" : "file", i);
+}
+
+static long gen_size(const struct gen_params *p, long i) {
+    unsigned long h = mix(i, p->seed + 1);
+    return p->max_size == 0 ? 0 : (long) ((h % (p->max_size + 1)) >> ((h >> 40) % 16));
+}
+
+/* Writes the synthetic archive to an unlinked temporary file, returns its descriptor. */
+static int generate(const struct gen_params *p) {
+    char path[] = "/tmp/lib_tar_benchXXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        perror("mkstemp");
+        return -1;
+    }
+    unlink(path);
+    char *data = malloc(p->max_size + 1);
+    memset(data, 'b', p->max_size + 1);
+    double start = now_ns();
+    tar_writer_t *w = tar_writer_open(fd, 0);
+    int ret = w == NULL ? -1 : 0;
+    char prev[512] = "", dir[512], name[600], target[32];
+    long nb_dirs = 0;
+    for (long i = 0; i < p->entries && ret == 0; i++) {
+        gen_dir(i, p->depth, dir, sizeof(dir));
+        if (strcmp(dir, prev) != 0) {
+            /* the parents of a new directory that are new as well */
+            for (char *slash = dir; ret == 0 && (slash = strchr(slash + 1, '/')) != NULL; ) {
+                if (strncmp(dir, prev, slash - dir) == 0 && (prev[slash - dir] == '/' || prev[slash - dir] == '\0'))
+                    continue;
+                *slash = '\0';
+                ret = tar_writer_add_dir(w, dir, 0755);
+                *slash = '/';
+                nb_dirs++;
+            }
+            if (ret == 0)
+                ret = tar_writer_add_dir(w, dir, 0755);
+            nb_dirs++;
+            strcpy(prev, dir);
+        }
+        gen_path(p, i, name, sizeof(name));
+        if (ret == 0 && gen_kind(p, i) == GEN_SYMLINK) {
+            snprintf(target, sizeof(target), "file%07ld", i - i % FILES_PER_DIR);
+            ret = tar_writer_add_symlink(w, name, target);
+        } else if (ret == 0) {
+            ret = tar_writer_add_data(w, name, data, gen_size(p, i), 0644);
+        }
+    }
+    if (tar_writer_close(w) < 0 || ret < 0) {
+        perror("tar_writer");
+        close(fd);
+        fd = -1;
+    } else {
+        printf("{\"bench\":\"generate\",\"entries\":%ld,\"dirs\":%ld,\"depth\":%d,\"max_size\":%ld,"
+               "\"symlink_ratio\":%.3f,\"bytes\":%lld,\"ns\":%.0f}\n", p->entries, nb_dirs, p->depth, p->max_size,
+               p->symlink_ratio, (long long) lseek(fd, 0, SEEK_END), now_ns() - start);
+    }
+    free(data);
+    return fd;
+}
+
+/* One query on entry i, through the descriptor or the handle. */
+typedef void (*query_fn)(int fd, tar_archive_t *archive, const struct gen_params *p, long i, uint8_t *buf);
+
+static volatile long sink;
+
+static void query_exists(int fd, tar_archive_t *archive, const struct gen_params *p, long i, uint8_t *buf) {
+    char path[600];
+    gen_path(p, i, path, sizeof(path));
+    sink += archive ? exists_h(archive, path) : exists(fd, path);
+}
+
+static void query_is_file(int fd, tar_archive_t *archive, const struct gen_params *p, long i, uint8_t *buf) {
+    char path[600];
+    gen_path(p, i, path, sizeof(path));
+    sink += archive ? is_file_h(archive, path) : is_file(fd, path);
+}
+
+static void query_is_dir(int fd, tar_archive_t *archive, const struct gen_params *p, long i, uint8_t *buf) {
+    char path[600];
+    gen_dir(i, p->depth, path, sizeof(path));
+    sink += archive ? is_dir_h(archive, path) : is_dir(fd, path);
+}
+
+static void query_is_symlink(int fd, tar_archive_t *archive, const struct gen_params *p, long i, uint8_t *buf) {
+    char path[600];
+    gen_path(p, i, path, sizeof(path));
+    sink += archive ? is_symlink_h(archive, path) : is_symlink(fd, path);
+}
+
+static void query_list(int fd, tar_archive_t *archive, const struct gen_params *p, long i, uint8_t *buf) {
+    char path[600];
+    char *entries[FILES_PER_DIR];
+    size_t no_entries = FILES_PER_DIR;
+    gen_dir(i, p->depth, path, sizeof(path));
+    strcat(path, "/");
+    for (int k = 0; k < FILES_PER_DIR; k++)
+        entries[k] = (char *) buf + k * 128;
+    sink += archive ? list_h(archive, path, entries, &no_entries) : list(fd, path, entries, &no_entries);
+    sink += no_entries;
+}
+
+static void query_read_file(int fd, tar_archive_t *archive, const struct gen_params *p, long i, uint8_t *buf) {
+    char path[600];
+    size_t len = p->max_size + 1;
+    gen_path(p, i, path, sizeof(path));
+    sink += archive ? read_file_h(archive, path, 0, buf, &len) : read_file(fd, path, 0, buf, &len);
+    sink += len;
+}
+
+static void bench_queries(const struct gen_params *p) {
+    static const struct {
+        const char *name;
+        query_fn fn;
+    } queries[] = {
+        {"exists", query_exists}, {"is_file", query_is_file}, {"is_dir", query_is_dir},
+        {"is_symlink", query_is_symlink}, {"list", query_list}, {"read_file", query_read_file},
+    };
+    int fd = generate(p);
+    if (fd < 0)
+        return;
+    long bytes = lseek(fd, 0, SEEK_END);
+    double *ns = malloc(p->queries * sizeof(double));
+    size_t lenBuf = p->max_size + 1 > FILES_PER_DIR * 128 ? p->max_size + 1 : FILES_PER_DIR * 128;
+    uint8_t *buf = malloc(lenBuf);
+
+    long rounds = p->queries < 10 ? p->queries : 10;
+    for (long r = 0; r < rounds; r++) {
+        double start = now_ns();
+        if (check_archive(fd) <= 0)
+            fprintf(stderr, "check_archive failed on the generated archive\n");
+        ns[r] = now_ns() - start;
+    }
+    report_latencies("check_archive", "fd", ns, rounds);
+    printf("{\"bench\":\"check_archive\",\"impl\":\"fd\",\"bytes_per_s\":%.0f}\n", bytes / (ns[rounds / 2] / 1e9));
+
+    double start = now_ns();
+    tar_archive_t *archive = tar_open(fd);
+    report("tar_open", "handle", 1, now_ns() - start);
+
+    srand(p->seed);
+    for (int q = 0; q < sizeof(queries) / sizeof(queries[0]); q++) {
+        for (int h = 0; h < 2; h++) {
+            if (h == 1 && archive == NULL)
+                continue;
+            for (long k = 0; k < p->queries; k++) {
+                long i = ((long) rand() * RAND_MAX + rand()) % p->entries;
+                double t = now_ns();
+                queries[q].fn(fd, h ? archive : NULL, p, i, buf);
+                ns[k] = now_ns() - t;
+            }
+            report_latencies(queries[q].name, h ? "handle" : "fd", ns, p->queries);
+        }
+    }
+    tar_close(archive);
+    free(ns);
+    free(buf);
+    close(fd);
+}
+
+/* A valid ustar header for a file of the given size. */
+static void make_header(tar_header_t *header, long i, unsigned long size) {
+    memset(header, 0, sizeof(*header));
+    snprintf(header->name, sizeof(header->name), "bench/dir%03ld/file%07ld.dat", i % 1000, i);
+    memcpy(header->mode, "0000644", 8);
+    memcpy(header->uid, "0001750", 8);
+    memcpy(header->gid, "0001750", 8);
+    snprintf(header->size, sizeof(header->size), "%011lo", size);
+    memcpy(header->mtime, "14763275520", 12);
+    header->typeflag = REGTYPE;
+    memcpy(header->magic, TMAGIC, TMAGLEN);
+    memcpy(header->version, TVERSION, TVERSLEN);
+    strcpy(header->uname, "bench");
+    strcpy(header->gname, "bench");
+    snprintf(header->chksum, sizeof(header->chksum), "%06o", tar_checksum(header));
+    header->chksum[7] = ' ';
+}
+
+/* Header validation as check_archive() used to do it: signed bytes, strtol and strcmp. */
+static int check_header_reference(tar_header_t *header, long *size) {
+    long sum = 0;
+    for (int i = 0; i < 512; i++) {
+        if (i >= 148 && i < 156) {
+            sum += ' ';
+        } else {
+            char *c = (char *) header + i;
+            sum += *c;
+        }
+    }
+    if (sum == 256)
+        return 1;
+    if (strcmp(header->magic, TMAGIC) != 0)
+        return -1;
+    if (strncmp(header->version, TVERSION, 2) != 0)
+        return -2;
+    if (sum != TAR_INT(header->chksum))
+        return -3;
+    *size = TAR_INT(header->size);
+    return 0;
+}
+
+static int check_header_new(const tar_header_t *header, long *size) {
+    unsigned int sum = tar_checksum(header);
+    if (sum == 256)
+        return 1;
+    if (memcmp(header->magic, TMAGIC, TMAGLEN) != 0)
+        return -1;
+    if (memcmp(header->version, TVERSION, TVERSLEN) != 0)
+        return -2;
+    if (sum != tar_parse_octal(header->chksum, sizeof(header->chksum)))
+        return -3;
+    *size = tar_parse_octal(header->size, sizeof(header->size));
+    return 0;
+}
+
+static void bench_headers(tar_header_t *headers) {
+    static const char *kernels[] = {"scalar", "sse2", "avx2"};
+    volatile long sink = 0;
+    long size = 0;
+
+    double start = now_ns();
+    for (int r = 0; r < NB_ROUNDS; r++)
+        for (long i = 0; i < NB_HEADERS; i++)
+            sink += check_header_reference(&headers[i], &size) + size;
+    report("check_header", "reference", (long) NB_ROUNDS * NB_HEADERS, now_ns() - start);
+
+    for (int k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        if (tar_checksum_kernel(kernels[k]) != 0)
+            continue;
+        start = now_ns();
+        for (int r = 0; r < NB_ROUNDS; r++)
+            for (long i = 0; i < NB_HEADERS; i++)
+                sink += check_header_new(&headers[i], &size) + size;
+        report("check_header", kernels[k], (long) NB_ROUNDS * NB_HEADERS, now_ns() - start);
+    }
+
+    start = now_ns();
+    for (int r = 0; r < NB_ROUNDS; r++)
+        for (long i = 0; i < NB_HEADERS; i++)
+            sink += TAR_INT(headers[i].size);
+    report("parse_size", "strtol", (long) NB_ROUNDS * NB_HEADERS, now_ns() - start);
+
+    start = now_ns();
+    for (int r = 0; r < NB_ROUNDS; r++)
+        for (long i = 0; i < NB_HEADERS; i++)
+            sink += tar_parse_octal(headers[i].size, sizeof(headers[i].size));
+    report("parse_size", "swar", (long) NB_ROUNDS * NB_HEADERS, now_ns() - start);
+}
+
+static void bench_check_archive(void) {
+    char path[] = "/tmp/lib_tar_benchXXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        perror("mkstemp");
+        return;
+    }
+    unlink(path);
+    tar_header_t *empty = calloc(NB_HEADERS, sizeof(tar_header_t));
+    for (long i = 0; i < NB_HEADERS; i++)
+        make_header(&empty[i], i, 0);
+    if (write(fd, empty, NB_HEADERS * sizeof(tar_header_t)) < 0 || ftruncate(fd, (NB_HEADERS + 2) * sizeof(tar_header_t)) < 0) {
+        perror("write");
+        close(fd);
+        free(empty);
+        return;
+    }
+    free(empty);
+
+    double start = now_ns();
+    for (int r = 0; r < NB_ROUNDS / 4; r++) {
+        tar_header_t header;
+        long size = 0;
+        off_t offset = 0;
+        int nb_headers = 0;
+        while (pread(fd, &header, sizeof(header), offset) == sizeof(header) && check_header_reference(&header, &size) == 0) {
+            nb_headers++;
+            offset += sizeof(header) + (size + 511) / 512 * 512;
+        }
+        if (nb_headers != NB_HEADERS)
+            fprintf(stderr, "reference check returned a wrong count\n");
+    }
+    report("check_archive", "reference", (long) NB_ROUNDS / 4 * NB_HEADERS, now_ns() - start);
+
+    start = now_ns();
+    for (int r = 0; r < NB_ROUNDS / 4; r++)
+        if (check_archive(fd) != NB_HEADERS)
+            fprintf(stderr, "check_archive returned a wrong count\n");
+    report("check_archive", "default", (long) NB_ROUNDS / 4 * NB_HEADERS, now_ns() - start);
+
+    for (int nthreads = 2; nthreads <= 8; nthreads *= 2) {
+        char impl[32];
+        snprintf(impl, sizeof(impl), "parallel%d", nthreads);
+        start = now_ns();
+        for (int r = 0; r < NB_ROUNDS / 4; r++)
+            if (check_archive_parallel(fd, nthreads) != NB_HEADERS)
+                fprintf(stderr, "check_archive_parallel returned a wrong count\n");
+        report("check_archive", impl, (long) NB_ROUNDS / 4 * NB_HEADERS, now_ns() - start);
+    }
+    close(fd);
+}
+
+int main(int argc, char **argv) {
+    struct gen_params params = {10000, 3, 16384, 0.1, 200, 42};
+    int opt;
+    while ((opt = getopt(argc, argv, "n:d:s:l:q:r:")) != -1) {
+        switch (opt) {
+        case 'n': params.entries = atol(optarg); break;
+        case 'd': params.depth = atoi(optarg); break;
+        case 's': params.max_size = atol(optarg); break;
+        case 'l': params.symlink_ratio = atof(optarg); break;
+        case 'q': params.queries = atol(optarg); break;
+        case 'r': params.seed = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-n entries] [-d depth] [-s max_size] [-l symlink_ratio] [-q queries] [-r seed]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (params.entries < 1 || params.depth < 0 || params.depth > 16 || params.max_size < 0 || params.queries < 1) {
+        fprintf(stderr, "%s: invalid parameters\n", argv[0]);
+        return 1;
+    }
+
+    tar_header_t *headers = malloc(NB_HEADERS * sizeof(tar_header_t));
+    srand(42);
+    for (long i = 0; i < NB_HEADERS; i++)
+        make_header(&headers[i], i, rand() % (1 << 20));
+
+    bench_headers(headers);
+    tar_checksum_kernel(NULL);
+    bench_check_archive();
+    free(headers);
+    bench_queries(&params);
+    return 0;
+}
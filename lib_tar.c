@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -7,377 +8,6117 @@
 #include <string.h>
 #include "lib_tar.h"
 #include <errno.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <time.h>
+#include <fnmatch.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <linux/openat2.h>
+#include <zlib.h>
+#ifdef LIB_TAR_ZSTD
+#include <zstd.h>
+#endif
 #define BUFSIZE 100
+
+/*
+ * Statistics and tracing
+ *
+ * Built only with LIB_TAR_STATS defined: otherwise the STAT_* macros expand
+ * to nothing and tar_stats_get() reports that there is nothing to get. Each
+ * call of the descriptor API counts in a thread-local record, added to the
+ * totals of its API with atomic adds when it returns, then handed to the
+ * trace callback if one is set. A call made from within another one (a
+ * symlink followed by list() for instance) counts in the outer one.
+ */
+
+#ifdef LIB_TAR_STATS
+
+static tar_call_stats_t apiStats[TAR_API_COUNT];
+static tar_trace_fn traceFn;
+static void *traceArg;
+static __thread tar_call_stats_t callStats;
+static __thread int callDepth;
+
+static uint64_t nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void statBegin(void) {
+    if(callDepth++ == 0){
+        memset(&callStats, 0, sizeof(callStats));
+        callStats.calls = 1;
+        callStats.ns = nowNs();
+    }
+}
+
+static void statEnd(int api, const char *path) {
+    if(--callDepth > 0){
+        return;
+    }
+    callStats.ns = nowNs() - callStats.ns;
+    tar_call_stats_t *total = &apiStats[api];
+    __atomic_fetch_add(&total->calls, callStats.calls, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&total->headers, callStats.headers, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&total->reads, callStats.reads, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&total->seeks, callStats.seeks, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&total->bytes, callStats.bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&total->symlinks, callStats.symlinks, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&total->ns, callStats.ns, __ATOMIC_RELAXED);
+    tar_trace_fn fn = __atomic_load_n(&traceFn, __ATOMIC_ACQUIRE);
+    if(fn != NULL){
+        fn(traceArg, api, path, &callStats);
+    }
+}
+
+#define STAT_BEGIN() statBegin()
+#define STAT_END(api, path) statEnd(api, path)
+#define STAT_ADD(field, n) (callStats.field += (n))
+/* one read or pread that returned nbRead */
+#define STAT_READ(nbRead) (callStats.reads++, callStats.bytes += (nbRead) > 0 ? (nbRead) : 0)
+#else
+#define STAT_BEGIN() ((void) 0)
+#define STAT_END(api, path) ((void) 0)
+#define STAT_ADD(field, n) ((void) 0)
+#define STAT_READ(nbRead) ((void) 0)
+#endif
+
+/**
+ * Copies the counters of every API since the start or the last tar_stats_reset().
+ *
+ * @param stats Filled with the counters, zeroed if the library is built without LIB_TAR_STATS.
+ *
+ * @return zero, or -1 if the library is built without LIB_TAR_STATS.
+ */
+int tar_stats_get(tar_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+#ifdef LIB_TAR_STATS
+    for(int api = 0; api < TAR_API_COUNT; api++){
+        uint64_t *from = (uint64_t *) &apiStats[api];
+        uint64_t *to = (uint64_t *) &stats->api[api];
+        for(size_t i = 0; i < sizeof(tar_call_stats_t) / sizeof(uint64_t); i++){
+            to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+        }
+    }
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/**
+ * Sets every counter back to zero.
+ *
+ * @return zero, or -1 if the library is built without LIB_TAR_STATS.
+ */
+int tar_stats_reset(void) {
+#ifdef LIB_TAR_STATS
+    for(int api = 0; api < TAR_API_COUNT; api++){
+        uint64_t *counters = (uint64_t *) &apiStats[api];
+        for(size_t i = 0; i < sizeof(tar_call_stats_t) / sizeof(uint64_t); i++){
+            __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+        }
+    }
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/**
+ * Sets the function called at the end of every call of the descriptor API.
+ *
+ * @param fn Called with arg, the API, the path asked for (NULL for check_archive()) and
+ *           the counters of that call alone, from the thread that made it. NULL to stop.
+ * @param arg Passed to fn as it is.
+ *
+ * @return zero, or -1 if the library is built without LIB_TAR_STATS.
+ */
+int tar_trace_set(tar_trace_fn fn, void *arg) {
+#ifdef LIB_TAR_STATS
+    traceArg = arg;
+    __atomic_store_n(&traceFn, fn, __ATOMIC_RELEASE);
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/*
+ * Header checksum and numeric fields
+ *
+ * POSIX defines the checksum as the sum of the 512 header bytes taken as
+ * unsigned, with the 8 bytes of the chksum field counted as spaces. The sum
+ * has no dependency between bytes, so it is computed with SSE2 or AVX2 sums
+ * of absolute differences when the CPU has them, picked once at run time.
+ */
+
+#define CHKSUM_OFFSET 148
+#define CHKSUM_LEN 8
+
+/* Sum of the 8 chksum bytes as unsigned, taken off the sum of the whole block. */
+static unsigned int chksumBytes(const uint8_t *block) {
+    unsigned int sum = 0;
+    for(int i = CHKSUM_OFFSET; i < CHKSUM_OFFSET + CHKSUM_LEN; i++){
+        sum += block[i];
+    }
+    return sum;
+}
+
+static unsigned int checksumScalar(const uint8_t *block) {
+    uint64_t sum = 0;
+    for(int i = 0; i < 512; i += 8){
+        uint64_t word;
+        memcpy(&word, block + i, 8);
+        /* two bytes per 16-bit lane, the lanes cannot overflow */
+        sum += (word & 0x00FF00FF00FF00FFull) + ((word >> 8) & 0x00FF00FF00FF00FFull);
+    }
+    sum = (sum & 0xFFFF) + ((sum >> 16) & 0xFFFF) + ((sum >> 32) & 0xFFFF) + (sum >> 48);
+    return sum - chksumBytes(block) + CHKSUM_LEN * ' ';
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("sse2")))
+static unsigned int checksumSSE2(const uint8_t *block) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i sum = zero;
+    for(int i = 0; i < 512; i += 16){
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(_mm_loadu_si128((const __m128i *) (block + i)), zero));
+    }
+    unsigned int total = _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(sum, sum));
+    return total - chksumBytes(block) + CHKSUM_LEN * ' ';
+}
+
+__attribute__((target("avx2")))
+static unsigned int checksumAVX2(const uint8_t *block) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i sum = zero;
+    for(int i = 0; i < 512; i += 32){
+        sum = _mm256_add_epi64(sum, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i *) (block + i)), zero));
+    }
+    __m128i half = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    unsigned int total = _mm_cvtsi128_si32(half) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(half, half));
+    return total - chksumBytes(block) + CHKSUM_LEN * ' ';
+}
+#endif
+
+static const struct {
+    const char *name;
+    unsigned int (*sum)(const uint8_t *block);
+} checksumKernels[] = {
+#if defined(__x86_64__) || defined(__i386__)
+    {"avx2", checksumAVX2},
+    {"sse2", checksumSSE2},
+#endif
+    {"scalar", checksumScalar}
+};
+
+static unsigned int (*checksumKernel)(const uint8_t *block);
+static pthread_once_t checksumOnce = PTHREAD_ONCE_INIT;
+
+static int kernelSupported(const char *name) {
+#if defined(__x86_64__) || defined(__i386__)
+    if(strcmp(name, "avx2") == 0 || strcmp(name, "sse2") == 0){
+        __builtin_cpu_init();
+        return strcmp(name, "avx2") == 0 ? __builtin_cpu_supports("avx2") : __builtin_cpu_supports("sse2");
+    }
+#endif
+    return strcmp(name, "scalar") == 0;
+}
+
+static void pickChecksumKernel(void) {
+    for(size_t i = 0; i < sizeof(checksumKernels) / sizeof(checksumKernels[0]); i++){
+        if(kernelSupported(checksumKernels[i].name)){
+            __atomic_store_n(&checksumKernel, checksumKernels[i].sum, __ATOMIC_RELEASE);
+            return;
+        }
+    }
+}
+
+/**
+ * Computes the checksum of a header as defined by POSIX: the sum of its bytes taken
+ * as unsigned, with the chksum field counted as if it held spaces.
+ *
+ * @param header A header of the archive.
+ *
+ * @return the checksum, to be compared with the value of the chksum field.
+ */
+unsigned int tar_checksum(const tar_header_t *header) {
+    pthread_once(&checksumOnce, pickChecksumKernel);
+    return __atomic_load_n(&checksumKernel, __ATOMIC_ACQUIRE)((const uint8_t *) header);
+}
+
+/**
+ * Selects the implementation used by tar_checksum(), mainly for benchmarks and tests.
+ * By default the fastest one supported by the CPU is used.
+ *
+ * @param name One of "avx2", "sse2" or "scalar", or NULL to go back to the default.
+ *
+ * @return zero if the implementation is now in use,
+ *         -1 if it is unknown or not supported by this CPU.
+ */
+int tar_checksum_kernel(const char *name) {
+    pthread_once(&checksumOnce, pickChecksumKernel);
+    if(name == NULL){
+        pickChecksumKernel();
+        return 0;
+    }
+    for(size_t i = 0; i < sizeof(checksumKernels) / sizeof(checksumKernels[0]); i++){
+        if(strcmp(name, checksumKernels[i].name) == 0 && kernelSupported(name)){
+            __atomic_store_n(&checksumKernel, checksumKernels[i].sum, __ATOMIC_RELEASE);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Folds 8 octal digit values, the most significant in the lowest byte, into one number. */
+static uint64_t foldOctal8(uint64_t digits) {
+    digits = ((digits & 0x0007000700070007ull) << 3) | ((digits >> 8) & 0x0007000700070007ull);
+    digits = ((digits & 0x0000003F0000003Full) << 6) | ((digits >> 16) & 0x0000003F0000003Full);
+    return ((digits & 0xFFF) << 12) | ((digits >> 32) & 0xFFF);
+}
+
+/**
+ * Converts an ASCII-encoded octal number into a regular integer, like TAR_INT but
+ * bounded by the field length and eight digits at a time.
+ *
+ * Leading spaces are skipped, and the number stops at the first byte that is not an
+ * octal digit (usually the terminating null or space).
+ *
+ * @param field The first byte of the field.
+ * @param len The length of the field.
+ *
+ * @return the value of the number, zero if the field holds no digit.
+ */
+uint64_t tar_parse_octal(const char *field, size_t len) {
+    size_t i = 0;
+    uint64_t value = 0;
+    while(i < len && field[i] == ' '){
+        i++;
+    }
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while(len - i >= 8){
+        uint64_t word;
+        memcpy(&word, field + i, 8);
+        /* a byte is an octal digit when its top five bits are those of '0' */
+        uint64_t notDigit = (word & 0xF8F8F8F8F8F8F8F8ull) ^ 0x3030303030303030ull;
+        uint64_t digits = word - 0x3030303030303030ull;
+        if(notDigit != 0){
+            size_t nbDigits = __builtin_ctzll(notDigit) / 8;
+            if(nbDigits == 0){
+                return value;
+            }
+            /* push the digits to the top so that the missing ones read as leading zeros */
+            return (value << (3 * nbDigits)) | foldOctal8(digits << (8 * (8 - nbDigits)));
+        }
+        value = (value << 24) | foldOctal8(digits);
+        i += 8;
+    }
+#endif
+    for(; i < len && (field[i] & 0xF8) == 0x30; i++){
+        value = (value << 3) | (field[i] - '0');
+    }
+    return value;
+}
+
+/* The size of the data following a header. Sizes too large for the octal digits are
+ * stored in base 256, big-endian, flagged by the high bit of the first byte. */
+static uint64_t headerSize(const struct posix_header *header) {
+    const uint8_t *size = (const uint8_t *) header->size;
+    if(size[0] & 0x80){
+        if(size[0] == 0xff){
+            return 0;         /* negative, never a valid size */
+        }
+        uint64_t value = size[0] & 0x7f;
+        for(size_t i = 1; i < sizeof(header->size); i++){
+            value = (value << 8) | size[i];
+        }
+        return value;
+    }
+    return tar_parse_octal(header->size, sizeof(header->size));
+}
+
+/* Checks the magic, version and checksum of a header.
+ * Returns 1 for the null block ending the archive, 0 for a valid header,
+ * or the error check_archive() reports for it. */
+static int checkHeader(const struct posix_header *header) {
+    unsigned int sum = tar_checksum(header);
+    if(sum == CHKSUM_LEN * ' '){
+        return 1;
+    }
+    if(memcmp(header->magic, TMAGIC, TMAGLEN) != 0){
+        return -1;
+    }
+    if(memcmp(header->version, TVERSION, TVERSLEN) != 0){
+        return -2;
+    }
+    if(sum != tar_parse_octal(header->chksum, sizeof(header->chksum))){
+        return -3;
+    }
+    return 0;
+}
+
+/* Reads the header at the given offset, returns the number of bytes read. */
+static ssize_t readHeader(int tar_fd, struct posix_header *header, uint64_t offset) {
+    ssize_t nbRead = pread(tar_fd, header, sizeof(struct posix_header), offset);
+    STAT_READ(nbRead);
+    if(nbRead < (ssize_t) sizeof(struct posix_header)){
+        return nbRead < 0 ? nbRead : 0;
+    }
+    return nbRead;
+}
+
+/* The offset of the header following the one at offset, past its data blocks. */
+static uint64_t nextHeader(const struct posix_header *header, uint64_t offset) {
+    uint64_t size = headerSize(header);
+    return offset + sizeof(struct posix_header) + (size + 511) / 512 * 512;
+}
+
+/* FNV-1a, good enough to spread archive paths over hash tables */
+static uint32_t hashPath(const char *path, size_t len) {
+    uint32_t hash = 2166136261u;
+    for(size_t i = 0; i < len; i++){
+        hash ^= (unsigned char) path[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Whether the block only holds zeros outside of its chksum field. */
+static int isNullBlock(const uint8_t *block) {
+    uint64_t bits = 0;
+    for(int i = 0; i < 512; i += 8){
+        uint64_t word;
+        memcpy(&word, block + i, 8);
+        if(i + 8 <= CHKSUM_OFFSET || i >= CHKSUM_OFFSET + CHKSUM_LEN){
+            bits |= word;
+        }
+    }
+    for(int i = CHKSUM_OFFSET / 8 * 8; i < (CHKSUM_OFFSET + CHKSUM_LEN + 7) / 8 * 8; i++){
+        if(i < CHKSUM_OFFSET || i >= CHKSUM_OFFSET + CHKSUM_LEN){
+            bits |= block[i];
+        }
+    }
+    return bits == 0;
+}
+
+/*
+ * Compressed archives
+ *
+ * A gzip archive, or a zstd one when built with LIB_TAR_ZSTD, is decoded on
+ * the fly: the offsets handed out are those of the archive once decoded.
+ *
+ * A single pass, as check_archive() or list() do, only streams through the
+ * decoder. For the handle, the pass that indexes the archive also records
+ * restart points about every CHECKPOINT_SPAN bytes of output, so that reading
+ * a member later decodes from the closest point before it instead of from the
+ * start. With gzip, a point can only sit on a deflate block boundary and keeps
+ * the 32 KiB of output before it, which the blocks after it may refer to. With
+ * zstd, every frame can be decoded on its own, so the points are the starts
+ * of the frames and need no window: an archive made of a single frame (the
+ * default of the zstd tool) is decoded from its start, one written in the
+ * seekable format or with small frames is not.
+ */
+
+#define CODEC_NONE 0
+#define CODEC_GZIP 1
+#define CODEC_ZSTD 2
+#define CODEC_INPUT (256 << 10)
+#define CHECKPOINT_SPAN (1 << 20)
+#define WINDOW_SIZE 32768
+
+struct checkpoint {
+    uint64_t in;                  /* offset in the compressed input of the first byte to decode */
+    uint64_t out;                 /* offset in the archive of what it decodes to */
+    int bits;                     /* gzip: bits of the byte before in that are still to decode */
+    size_t lenWindow;
+    uint8_t *window;              /* gzip: the output right before out, or NULL */
+};
+
+struct checkpoints {
+    struct checkpoint *points;
+    size_t nbPoints;
+    size_t capPoints;
+    uint8_t ring[WINDOW_SIZE];    /* the last output, while recording */
+    uint64_t lenRing;             /* everything that went through the ring */
+};
+
+struct codec {
+    int kind;
+    int fd;                       /* the compressed input, or -1 when it is in memory */
+    int seekable;
+    const uint8_t *mem;
+    size_t lenMem;
+    uint64_t rawPos;              /* offset in the input right after what was loaded */
+    uint8_t *in;
+    const uint8_t *inNext;        /* loaded but not decoded yet */
+    size_t inAvail;
+    int raw;                      /* gzip: restarted in the middle of a member, without its header */
+    z_stream z;
+#ifdef LIB_TAR_ZSTD
+    ZSTD_DCtx *zd;
+#endif
+    uint64_t outPos;              /* offset in the archive of the next byte decoded */
+    int ended;
+    struct checkpoints *record;   /* where to record restart points, or NULL */
+};
+
+/* The codec of an archive starting with these bytes. */
+static int detectCodec(const uint8_t *magic, size_t len) {
+    if(len >= 2 && magic[0] == 0x1f && magic[1] == 0x8b){
+        return CODEC_GZIP;
+    }
+#ifdef LIB_TAR_ZSTD
+    if(len >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd){
+        return CODEC_ZSTD;
+    }
+#endif
+    return CODEC_NONE;
+}
+
+/* The codec of the archive in a seekable file. */
+static int fileCodec(int fd) {
+    uint8_t magic[4];
+    ssize_t nbRead = pread(fd, magic, sizeof(magic), 0);
+    STAT_READ(nbRead);
+    return nbRead > 0 ? detectCodec(magic, nbRead) : CODEC_NONE;
+}
+
+/* Starts decoding at offset in of the input, which is either fd or mem. */
+static int codecInit(struct codec *c, int kind, int fd, const uint8_t *mem, size_t lenMem, uint64_t in) {
+    memset(c, 0, sizeof(*c));
+    c->kind = kind;
+    c->fd = fd;
+    c->mem = mem;
+    c->lenMem = lenMem;
+    c->rawPos = in;
+    if(mem == NULL){
+        c->seekable = lseek(fd, 0, SEEK_CUR) >= 0;
+        STAT_ADD(seeks, 1);
+        c->in = malloc(CODEC_INPUT);
+        if(c->in == NULL){
+            return -1;
+        }
+    }
+    if(kind == CODEC_GZIP){
+        /* 15 + 32: the largest window, and a gzip header to parse */
+        if(inflateInit2(&c->z, 15 + 32) != Z_OK){
+            free(c->in);
+            return -1;
+        }
+        return 0;
+    }
+#ifdef LIB_TAR_ZSTD
+    if(kind == CODEC_ZSTD){
+        c->zd = ZSTD_createDCtx();
+        if(c->zd == NULL){
+            free(c->in);
+            return -1;
+        }
+        return 0;
+    }
+#endif
+    free(c->in);
+    return -1;
+}
+
+static void codecEnd(struct codec *c) {
+    if(c->kind == CODEC_GZIP){
+        inflateEnd(&c->z);
+    }
+#ifdef LIB_TAR_ZSTD
+    if(c->kind == CODEC_ZSTD){
+        ZSTD_freeDCtx(c->zd);
+    }
+#endif
+    free(c->in);
+    c->in = NULL;
+}
+
+/* Loads more input, returns how much or -1 if it could not be read. */
+static ssize_t codecFill(struct codec *c) {
+    if(c->mem != NULL){
+        size_t len = c->rawPos < c->lenMem ? c->lenMem - c->rawPos : 0;
+        c->inNext = c->mem + c->rawPos;
+        c->inAvail = len;
+        c->rawPos += len;
+        return len;
+    }
+    ssize_t nbRead;
+    do{
+        if(c->seekable){
+            nbRead = pread(c->fd, c->in, CODEC_INPUT, c->rawPos);
+        }else{
+            nbRead = read(c->fd, c->in, CODEC_INPUT);
+        }
+        STAT_READ(nbRead);
+    }while(nbRead < 0 && errno == EINTR);
+    if(nbRead < 0){
+        return -1;
+    }
+    c->inNext = c->in;
+    c->inAvail = nbRead;
+    c->rawPos += nbRead;
+    return nbRead;
+}
+
+/* Hands bytes already read from a stream over to the decoder, before it reads any. */
+static int codecPreload(struct codec *c, const uint8_t *bytes, size_t len) {
+    if(len > CODEC_INPUT){
+        uint8_t *in = realloc(c->in, len);
+        if(in == NULL){
+            return -1;
+        }
+        c->in = in;
+    }
+    memcpy(c->in, bytes, len);
+    c->inNext = c->in;
+    c->inAvail = len;
+    c->rawPos += len;
+    return 0;
+}
+
+static void ringAppend(struct checkpoints *record, const uint8_t *out, size_t len) {
+    if(len >= WINDOW_SIZE){
+        out += len - WINDOW_SIZE;
+        record->lenRing += len - WINDOW_SIZE;
+        len = WINDOW_SIZE;
+    }
+    size_t pos = record->lenRing % WINDOW_SIZE;
+    size_t first = len < WINDOW_SIZE - pos ? len : WINDOW_SIZE - pos;
+    memcpy(record->ring + pos, out, first);
+    memcpy(record->ring, out + first, len - first);
+    record->lenRing += len;
+}
+
+/* Records a restart point at the current position, with the output before it for gzip. */
+static int addCheckpoint(struct codec *c, int bits) {
+    struct checkpoints *record = c->record;
+    if(record->nbPoints > 0 && c->outPos - record->points[record->nbPoints - 1].out < CHECKPOINT_SPAN){
+        return 0;
+    }
+    if(record->nbPoints == record->capPoints){
+        size_t cap = record->capPoints ? record->capPoints * 2 : 16;
+        struct checkpoint *points = realloc(record->points, cap * sizeof(struct checkpoint));
+        if(points == NULL){
+            return -1;
+        }
+        record->points = points;
+        record->capPoints = cap;
+    }
+    struct checkpoint *point = &record->points[record->nbPoints];
+    point->in = c->rawPos - c->inAvail;
+    point->out = c->outPos;
+    point->bits = bits;
+    point->lenWindow = 0;
+    point->window = NULL;
+    if(c->kind == CODEC_GZIP && c->outPos > 0){
+        point->lenWindow = c->outPos < WINDOW_SIZE ? c->outPos : WINDOW_SIZE;
+        point->window = malloc(point->lenWindow);
+        if(point->window == NULL){
+            return -1;
+        }
+        /* unroll the ring, oldest byte first */
+        size_t pos = record->lenRing % WINDOW_SIZE;
+        size_t start = (pos + WINDOW_SIZE - point->lenWindow) % WINDOW_SIZE;
+        size_t first = point->lenWindow < WINDOW_SIZE - start ? point->lenWindow : WINDOW_SIZE - start;
+        memcpy(point->window, record->ring + start, first);
+        memcpy(point->window + first, record->ring, point->lenWindow - first);
+    }
+    record->nbPoints++;
+    return 0;
+}
+
+static void freeCheckpoints(struct checkpoints *record) {
+    if(record == NULL){
+        return;
+    }
+    for(size_t i = 0; i < record->nbPoints; i++){
+        free(record->points[i].window);
+    }
+    free(record->points);
+    free(record);
+}
+
+/* After the end of a gzip member, goes on with the next one if the input holds one. */
+static int gzipNextMember(struct codec *c) {
+    if(c->raw){
+        /* inflate did not see the header, so it leaves the trailer to skip */
+        size_t skip = 8;
+        while(skip > 0){
+            if(c->inAvail == 0 && codecFill(c) <= 0){
+                return -1;
+            }
+            size_t n = c->inAvail < skip ? c->inAvail : skip;
+            c->inNext += n;
+            c->inAvail -= n;
+            skip -= n;
+        }
+    }
+    if(c->inAvail == 0 && codecFill(c) < 0){
+        return -1;
+    }
+    if(c->inAvail == 0 || c->inNext[0] != 0x1f){
+        c->ended = 1;       /* the end of the input, or padding after the last member */
+        return 0;
+    }
+    c->raw = 0;
+    return inflateReset2(&c->z, 15 + 32) == Z_OK ? 0 : -1;
+}
+
+static ssize_t gzipStep(struct codec *c, uint8_t *out, size_t len) {
+    c->z.next_in = (Bytef *) c->inNext;
+    c->z.avail_in = c->inAvail;
+    c->z.next_out = out;
+    c->z.avail_out = len;
+    int ret = inflate(&c->z, c->record != NULL ? Z_BLOCK : Z_NO_FLUSH);
+    size_t produced = len - c->z.avail_out;
+    c->inNext = c->z.next_in;
+    c->inAvail = c->z.avail_in;
+    c->outPos += produced;
+    if(ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR){
+        return -1;
+    }
+    if(c->record != NULL){
+        ringAppend(c->record, out, produced);
+        /* bit 7: at a block boundary, bit 6: after the last block */
+        if((c->z.data_type & 128) && !(c->z.data_type & 64) && addCheckpoint(c, c->z.data_type & 7) < 0){
+            return -1;
+        }
+    }
+    if(ret == Z_STREAM_END && gzipNextMember(c) < 0){
+        return -1;
+    }
+    return produced;
+}
+
+#ifdef LIB_TAR_ZSTD
+static ssize_t zstdStep(struct codec *c, uint8_t *out, size_t len) {
+    ZSTD_inBuffer in = {c->inNext, c->inAvail, 0};
+    ZSTD_outBuffer dst = {out, len, 0};
+    if(c->record != NULL && c->record->nbPoints == 0 && addCheckpoint(c, 0) < 0){
+        return -1;
+    }
+    size_t ret = ZSTD_decompressStream(c->zd, &dst, &in);
+    if(ZSTD_isError(ret)){
+        return -1;
+    }
+    c->inNext += in.pos;
+    c->inAvail -= in.pos;
+    c->outPos += dst.pos;
+    /* zero: the frame is over and flushed, the next one starts here */
+    if(ret == 0 && c->record != NULL && addCheckpoint(c, 0) < 0){
+        return -1;
+    }
+    return dst.pos;
+}
+#endif
+
+/* Decodes up to len bytes, fewer only at the end of the input. Returns -1 if the input
+ * could not be read or is corrupt. */
+static ssize_t codecRead(struct codec *c, uint8_t *out, size_t len) {
+    size_t done = 0;
+    while(done < len && !c->ended){
+        if(c->inAvail == 0){
+            ssize_t nbRead = codecFill(c);
+            if(nbRead < 0){
+                return -1;
+            }
+            if(nbRead == 0){
+                c->ended = 1;
+                break;
+            }
+        }
+        ssize_t produced = -1;
+        if(c->kind == CODEC_GZIP){
+            produced = gzipStep(c, out + done, len - done);
+        }
+#ifdef LIB_TAR_ZSTD
+        if(c->kind == CODEC_ZSTD){
+            produced = zstdStep(c, out + done, len - done);
+        }
+#endif
+        if(produced < 0){
+            return -1;
+        }
+        done += produced;
+    }
+    return done;
+}
+
+/* Starts decoding at a restart point. */
+static int codecRestart(struct codec *c, int kind, int fd, const uint8_t *mem, size_t lenMem, const struct checkpoint *point) {
+    if(kind != CODEC_GZIP || point->out == 0){
+        if(codecInit(c, kind, fd, mem, lenMem, point->out == 0 ? 0 : point->in) < 0){
+            return -1;
+        }
+        c->outPos = point->out;
+        return 0;
+    }
+    if(codecInit(c, kind, fd, mem, lenMem, point->in - (point->bits ? 1 : 0)) < 0){
+        return -1;
+    }
+    c->raw = 1;
+    c->outPos = point->out;
+    if(inflateReset2(&c->z, -15) != Z_OK){
+        codecEnd(c);
+        return -1;
+    }
+    if(point->bits){
+        if(codecFill(c) <= 0){
+            codecEnd(c);
+            return -1;
+        }
+        inflatePrime(&c->z, point->bits, c->inNext[0] >> (8 - point->bits));
+        c->inNext++;
+        c->inAvail--;
+    }
+    if(inflateSetDictionary(&c->z, point->window, point->lenWindow) != Z_OK){
+        codecEnd(c);
+        return -1;
+    }
+    return 0;
+}
+
+/* Starts decoding from the closest restart point before offset off of the decoded
+ * archive, and decodes up to off. Returns 0, 1 if the archive ends before off, or -1
+ * on failure. The decoder is only left open on success. */
+static int checkpointSeek(const struct checkpoints *record, int kind, int fd, const uint8_t *mem, size_t lenMem,
+                          uint64_t off, struct codec *c) {
+    if(record->nbPoints == 0){
+        return -1;
+    }
+    size_t lo = 0;
+    size_t hi = record->nbPoints;
+    while(hi - lo > 1){
+        size_t mid = (lo + hi) / 2;
+        if(record->points[mid].out <= off){
+            lo = mid;
+        }else{
+            hi = mid;
+        }
+    }
+    if(codecRestart(c, kind, fd, mem, lenMem, &record->points[lo]) < 0){
+        return -1;
+    }
+    uint8_t *skipped = malloc(WINDOW_SIZE);
+    int ret = skipped == NULL ? -1 : 0;
+    while(ret == 0 && c->outPos < off){
+        uint64_t left = off - c->outPos;
+        ssize_t n = codecRead(c, skipped, left < WINDOW_SIZE ? left : WINDOW_SIZE);
+        if(n <= 0){
+            ret = n < 0 ? -1 : 1;
+        }
+    }
+    free(skipped);
+    if(ret != 0){
+        codecEnd(c);
+    }
+    return ret;
+}
+
+/* Reads len bytes at offset off of the decoded archive, starting from the closest
+ * restart point before it. Safe to call from several threads at once. */
+static ssize_t checkpointRead(const struct checkpoints *record, int kind, int fd, const uint8_t *mem, size_t lenMem,
+                              void *buf, size_t len, uint64_t off) {
+    struct codec c;
+    int ret = checkpointSeek(record, kind, fd, mem, lenMem, off, &c);
+    if(ret != 0){
+        return ret < 0 && record->nbPoints > 0 ? -1 : 0;
+    }
+    ssize_t nbRead = codecRead(&c, buf, len);
+    codecEnd(&c);
+    return nbRead;
+}
+
+/*
+ * Streaming iterator
+ *
+ * The archive is read in large blocks and the headers and data are handed out
+ * from that buffer, so walking it costs one read per block instead of one per
+ * member. A seekable file is read with pread: the file offset is left alone,
+ * and the data of a member that is skipped is not read at all once it goes
+ * past the buffer. Any other input, a pipe for instance, is read in sequence
+ * and the data skipped is read and dropped.
+ *
+ * Headers start on a multiple of 512 bytes and so does the buffer, which
+ * always holds whole headers. A compressed archive is read as a stream of
+ * what it decodes to.
+ *
+ * The headers that only describe the entry after them are folded into it:
+ * a PAX extended header ('x') may give its path, link target and size, a
+ * global one ('g') a path or link target for all the entries after it, and
+ * the GNU 'L' and 'K' headers hold names too long for the ustar fields.
+ * Otherwise the name is the ustar prefix and name fields joined by a '/'.
+ */
+
+#define ITER_BUFFER (1 << 20)
+#define SCAN_BUFFER (64 << 10)    /* for the single queries of the fd-based API */
+#define META_MAX (1 << 20)        /* larger extended headers are skipped */
+
+#define XHDTYPE  'x'              /* PAX extended header */
+#define XGLTYPE  'g'              /* PAX global extended header */
+#define GNU_LONGNAME 'L'
+#define GNU_LONGLINK 'K'
+
+/* With TAR_ITER_CHECK, goes on past headers that are only invalid because they use the
+ * GNU magic "ustar  ", remembering the error check_archive() reports for them. */
+#define ITER_GNU 0x100
+
+struct tar_iter {
+    int fd;
+    int flags;
+    int seekable;                 /* read with pread rather than read */
+    const uint8_t *mem;           /* the archive when it is already in memory, or NULL */
+    size_t lenMem;
+    uint8_t *buf;
+    size_t capBuf;                /* a multiple of 512 */
+    uint64_t bufStart;            /* offset in the archive of buf[0] */
+    size_t lenBuf;
+    uint64_t next;                /* offset of the next header */
+    uint64_t dataPos;             /* where tar_iter_read() goes on in the current member */
+    uint64_t dataEnd;
+    int state;                    /* 0 while iterating, 1 past the end, or the error met */
+    struct codec *codec;          /* the decoder of a compressed archive, or NULL */
+    uint64_t nbHeaders;           /* headers met so far, extended ones included */
+    int firstError;               /* with ITER_GNU, the error of the first GNU header, or 0 */
+    char *name;                   /* of the current entry */
+    size_t capName;
+    char *linkname;
+    size_t capLinkname;
+    char *globalPath;             /* set by a global extended header, or NULL */
+    char *globalLinkpath;
+    char *meta;                   /* data of the last extended header */
+    size_t capMeta;
+};
+
+static void iterRelease(struct tar_iter *it);
+static int fillStream(struct tar_iter *it, size_t want);
+
+static int iterInit(struct tar_iter *it, int tar_fd, size_t bufsize, int flags) {
+    memset(it, 0, sizeof(*it));
+    it->fd = tar_fd;
+    it->flags = flags;
+    it->capBuf = (bufsize + 511) / 512 * 512;
+    it->buf = malloc(it->capBuf);
+    if(it->buf == NULL){
+        return -1;
+    }
+    struct stat st;
+    it->seekable = lseek(tar_fd, 0, SEEK_CUR) >= 0;
+    STAT_ADD(seeks, 1);
+    if(fstat(tar_fd, &st) == 0 && S_ISREG(st.st_mode)){
+        posix_fadvise(tar_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    int kind;
+    if(it->seekable){
+        kind = fileCodec(tar_fd);
+    }else if(fillStream(it, 4) < 0){
+        free(it->buf);
+        return -1;
+    }else{
+        kind = detectCodec(it->buf, it->lenBuf);
+    }
+    if(kind != CODEC_NONE){
+        it->codec = malloc(sizeof(struct codec));
+        if(it->codec == NULL || codecInit(it->codec, kind, tar_fd, NULL, 0, 0) < 0){
+            free(it->codec);
+            free(it->buf);
+            return -1;
+        }
+        /* what was read to find out the codec is the start of its input */
+        if(!it->seekable && codecPreload(it->codec, it->buf, it->lenBuf) < 0){
+            iterRelease(it);
+            return -1;
+        }
+        it->lenBuf = 0;
+        it->seekable = 0;
+    }
+    return 0;
+}
+
+/* Iterates over an archive already in memory, without any buffer. */
+static void iterInitMemory(struct tar_iter *it, const uint8_t *base, size_t len, int flags) {
+    memset(it, 0, sizeof(*it));
+    it->fd = -1;
+    it->flags = flags;
+    it->mem = base;
+    it->lenMem = len;
+}
+
+static void iterRelease(struct tar_iter *it) {
+    if(it->codec != NULL){
+        codecEnd(it->codec);
+        free(it->codec);
+        it->codec = NULL;
+    }
+    free(it->buf);
+    free(it->name);
+    free(it->linkname);
+    free(it->globalPath);
+    free(it->globalLinkpath);
+    free(it->meta);
+    it->buf = NULL;
+    it->name = it->linkname = it->globalPath = it->globalLinkpath = it->meta = NULL;
+}
+
+/* Reads from a stream until the buffer holds at least want bytes, or the stream ends. */
+static int fillStream(struct tar_iter *it, size_t want) {
+    while(it->lenBuf < want){
+        ssize_t nbRead;
+        if(it->codec != NULL){
+            nbRead = codecRead(it->codec, it->buf + it->lenBuf, it->capBuf - it->lenBuf);
+            if(nbRead < 0){
+                return -1;
+            }
+        }else{
+            nbRead = read(it->fd, it->buf + it->lenBuf, it->capBuf - it->lenBuf);
+            STAT_READ(nbRead);
+        }
+        if(nbRead < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        if(nbRead == 0){
+            break;
+        }
+        it->lenBuf += nbRead;
+    }
+    return 0;
+}
+
+/* Makes up to want bytes at offset off available, want being at most the buffer size.
+ * Returns them and sets got to how many there are, fewer only at the end of the archive,
+ * or returns NULL if the archive could not be read. A stream only moves forward. */
+static const uint8_t *iterFetch(struct tar_iter *it, uint64_t off, size_t want, size_t *got) {
+    if(it->mem != NULL){
+        *got = off >= it->lenMem ? 0 : (it->lenMem - off < want ? it->lenMem - off : want);
+        return it->mem + (off >= it->lenMem ? it->lenMem : off);
+    }
+    if(off < it->bufStart || off + want > it->bufStart + it->lenBuf){
+        if(it->seekable){
+            ssize_t nbRead;
+            while((nbRead = pread(it->fd, it->buf, it->capBuf, off)) < 0 && errno == EINTR){
+            }
+            STAT_READ(nbRead);
+            if(nbRead < 0){
+                return NULL;
+            }
+            it->bufStart = off;
+            it->lenBuf = nbRead;
+        }else{
+            if(off < it->bufStart){
+                errno = ESPIPE;
+                return NULL;
+            }
+            if(off < it->bufStart + it->lenBuf){
+                it->lenBuf -= off - it->bufStart;
+                memmove(it->buf, it->buf + (off - it->bufStart), it->lenBuf);
+            }else{
+                /* drop what lies between the buffer and off */
+                uint64_t skip = off - (it->bufStart + it->lenBuf);
+                it->lenBuf = 0;
+                while(skip > 0){
+                    if(fillStream(it, 1) < 0){
+                        return NULL;
+                    }
+                    if(it->lenBuf == 0){
+                        break;
+                    }
+                    size_t dropped = it->lenBuf < skip ? it->lenBuf : skip;
+                    skip -= dropped;
+                    it->lenBuf -= dropped;
+                    memmove(it->buf, it->buf + dropped, it->lenBuf);
+                }
+            }
+            it->bufStart = off;
+            if(fillStream(it, want) < 0){
+                return NULL;
+            }
+        }
+    }
+    size_t avail = it->bufStart + it->lenBuf > off ? it->bufStart + it->lenBuf - off : 0;
+    *got = avail < want ? avail : want;
+    return it->buf + (off - it->bufStart);
+}
+
+/* Copies len bytes of str to a growing buffer, with a terminating null. */
+static int setString(char **buf, size_t *cap, const char *str, size_t len) {
+    if(len + 1 > *cap){
+        size_t newCap = *cap ? *cap : 128;
+        while(len + 1 > newCap){
+            newCap *= 2;
+        }
+        char *bigger = realloc(*buf, newCap);
+        if(bigger == NULL){
+            return -1;
+        }
+        *buf = bigger;
+        *cap = newCap;
+    }
+    memcpy(*buf, str, len);
+    (*buf)[len] = '\0';
+    return 0;
+}
+
+/* Reads the data of an extended header in it->meta. Returns 0, 1 if it was cut short
+ * by the end of the archive, or -1 if it could not be read. */
+static int readMeta(struct tar_iter *it, uint64_t off, size_t size) {
+    if(size + 1 > it->capMeta){
+        char *meta = realloc(it->meta, size + 1);
+        if(meta == NULL){
+            return -1;
+        }
+        it->meta = meta;
+        it->capMeta = size + 1;
+    }
+    for(size_t done = 0; done < size;){
+        size_t want = size - done;
+        size_t got;
+        if(it->mem == NULL && want > it->capBuf){
+            want = it->capBuf;
+        }
+        const uint8_t *data = iterFetch(it, off + done, want, &got);
+        if(data == NULL){
+            return -1;
+        }
+        if(got == 0){
+            return 1;
+        }
+        memcpy(it->meta + done, data, got);
+        done += got;
+    }
+    it->meta[size] = '\0';
+    return 0;
+}
+
+/* What the PAX records of it->meta set. Each record is "<length> <key>=<value>\n",
+ * the length counting the whole record. */
+struct pax_values {
+    const char *path;
+    size_t lenPath;
+    const char *linkpath;
+    size_t lenLinkpath;
+    int hasSize;
+    uint64_t size;
+};
+
+static void parsePax(const char *data, size_t len, struct pax_values *values) {
+    size_t pos = 0;
+    while(pos < len){
+        size_t lenRecord = 0;
+        size_t i = pos;
+        while(i < len && data[i] >= '0' && data[i] <= '9' && lenRecord < len){
+            lenRecord = lenRecord * 10 + (data[i++] - '0');
+        }
+        if(i == pos || i >= len || data[i] != ' ' || lenRecord <= i - pos || lenRecord > len - pos){
+            return;
+        }
+        const char *key = data + i + 1;
+        const char *end = data + pos + lenRecord - 1;     /* the final newline */
+        const char *equal = memchr(key, '=', end - key);
+        pos += lenRecord;
+        if(equal == NULL || *end != '\n'){
+            continue;
+        }
+        const char *value = equal + 1;
+        size_t lenKey = equal - key;
+        if(lenKey == 4 && memcmp(key, "path", 4) == 0){
+            values->path = value;
+            values->lenPath = end - value;
+        }else if(lenKey == 8 && memcmp(key, "linkpath", 8) == 0){
+            values->linkpath = value;
+            values->lenLinkpath = end - value;
+        }else if(lenKey == 4 && memcmp(key, "size", 4) == 0){
+            values->hasSize = 1;
+            values->size = 0;
+            for(const char *c = value; c < end && *c >= '0' && *c <= '9'; c++){
+                values->size = values->size * 10 + (*c - '0');
+            }
+        }
+    }
+}
+
+/* Replaces a global value, an empty one removes it. */
+static int setGlobal(char **global, const char *value, size_t len) {
+    free(*global);
+    *global = NULL;
+    if(value == NULL || len == 0){
+        return 0;
+    }
+    *global = strndup(value, len);
+    return *global == NULL ? -1 : 0;
+}
+
+/* Same as tar_iter_next(), on an iterator that may live on the stack. */
+static int iterNext(struct tar_iter *it, tar_entry_t *entry) {
+    int hasName = 0;
+    int hasLinkname = 0;
+    int hasSize = 0;
+    uint64_t size = 0;
+    for(;;){
+        if(it->state != 0){
+            return it->state == 1 ? 0 : it->state;
+        }
+        size_t got;
+        const uint8_t *block = iterFetch(it, it->next, sizeof(struct posix_header), &got);
+        if(block == NULL){
+            it->state = -4;
+            continue;
+        }
+        const struct posix_header *header = (const struct posix_header *) block;
+        int check = 0;
+        if(got < sizeof(struct posix_header)){
+            check = 1;
+        }else if(it->flags & TAR_ITER_CHECK){
+            check = checkHeader(header);
+            if(check == -1 && (it->flags & ITER_GNU) && memcmp(header->magic, "ustar  ", 8) == 0
+               && tar_checksum(header) == tar_parse_octal(header->chksum, sizeof(header->chksum))){
+                it->firstError = it->firstError ? it->firstError : check;
+                check = 0;
+            }
+        }else if(isNullBlock(block)){
+            check = 1;
+        }
+        if(check != 0){
+            it->state = check;
+            continue;
+        }
+        it->nbHeaders++;
+        STAT_ADD(headers, 1);
+        char typeflag = header->typeflag;
+        uint64_t offset = it->next;
+        if(!(it->flags & TAR_ITER_RAW)
+           && (typeflag == XHDTYPE || typeflag == XGLTYPE || typeflag == GNU_LONGNAME || typeflag == GNU_LONGLINK)){
+            uint64_t lenMeta = headerSize(header);
+            it->next = nextHeader(header, offset);
+            if(lenMeta > META_MAX){
+                continue;
+            }
+            int ret = readMeta(it, offset + sizeof(struct posix_header), lenMeta);
+            if(ret != 0){
+                it->state = ret < 0 ? -4 : 1;
+                continue;
+            }
+            int failed = 0;
+            if(typeflag == GNU_LONGNAME){
+                failed = setString(&it->name, &it->capName, it->meta, strnlen(it->meta, lenMeta));
+                hasName = 1;
+            }else if(typeflag == GNU_LONGLINK){
+                failed = setString(&it->linkname, &it->capLinkname, it->meta, strnlen(it->meta, lenMeta));
+                hasLinkname = 1;
+            }else{
+                struct pax_values values = {0};
+                parsePax(it->meta, lenMeta, &values);
+                if(typeflag == XGLTYPE){
+                    failed = (values.path != NULL && setGlobal(&it->globalPath, values.path, values.lenPath) < 0)
+                             || (values.linkpath != NULL && setGlobal(&it->globalLinkpath, values.linkpath, values.lenLinkpath) < 0);
+                }else{
+                    if(values.path != NULL){
+                        failed = setString(&it->name, &it->capName, values.path, values.lenPath);
+                        hasName = 1;
+                    }
+                    if(values.linkpath != NULL){
+                        failed = failed || setString(&it->linkname, &it->capLinkname, values.linkpath, values.lenLinkpath);
+                        hasLinkname = 1;
+                    }
+                    if(values.hasSize){
+                        hasSize = 1;
+                        size = values.size;
+                    }
+                }
+            }
+            if(failed){
+                it->state = -4;
+            }
+            continue;
+        }
+
+        if(!hasName && it->globalPath != NULL){
+            hasName = setString(&it->name, &it->capName, it->globalPath, strlen(it->globalPath)) == 0;
+        }
+        if(!hasName){
+            char joined[sizeof(header->prefix) + 1 + sizeof(header->name)];
+            size_t len = 0;
+            if(memcmp(header->magic, TMAGIC, TMAGLEN) == 0 && header->prefix[0] != '\0'){
+                len = strnlen(header->prefix, sizeof(header->prefix));
+                memcpy(joined, header->prefix, len);
+                joined[len++] = '/';
+            }
+            size_t lenName = strnlen(header->name, sizeof(header->name));
+            memcpy(joined + len, header->name, lenName);
+            if(setString(&it->name, &it->capName, joined, len + lenName) < 0){
+                it->state = -4;
+                continue;
+            }
+        }
+        if(!hasLinkname && it->globalLinkpath != NULL){
+            hasLinkname = setString(&it->linkname, &it->capLinkname, it->globalLinkpath, strlen(it->globalLinkpath)) == 0;
+        }
+        if(!hasLinkname && setString(&it->linkname, &it->capLinkname, header->linkname, strnlen(header->linkname, sizeof(header->linkname))) < 0){
+            it->state = -4;
+            continue;
+        }
+        entry->name = it->name;
+        entry->linkname = it->linkname;
+        entry->typeflag = typeflag;
+        entry->size = hasSize ? size : headerSize(header);
+        entry->header_offset = offset;
+        entry->data_offset = offset + sizeof(struct posix_header);
+        entry->header = header;
+        it->dataPos = entry->data_offset;
+        it->dataEnd = entry->data_offset + entry->size;
+        it->next = entry->data_offset + (entry->size + 511) / 512 * 512;
+        return 1;
+    }
+}
+
+/* Same as tar_iter_read(). */
+static ssize_t iterRead(struct tar_iter *it, void *buf, size_t len) {
+    size_t done = 0;
+    if(len > it->dataEnd - it->dataPos){
+        len = it->dataEnd - it->dataPos;
+    }
+    while(done < len){
+        size_t want = len - done;
+        if(it->mem == NULL && it->seekable && want >= it->capBuf
+           && (it->dataPos < it->bufStart || it->dataPos >= it->bufStart + it->lenBuf)){
+            /* too large to be worth going through the buffer */
+            ssize_t nbRead = pread(it->fd, (uint8_t *) buf + done, want, it->dataPos);
+            STAT_READ(nbRead);
+            if(nbRead < 0 && errno == EINTR){
+                continue;
+            }
+            if(nbRead <= 0){
+                return nbRead < 0 ? -1 : (ssize_t) done;
+            }
+            done += nbRead;
+            it->dataPos += nbRead;
+            continue;
+        }
+        size_t got;
+        const uint8_t *data = iterFetch(it, it->dataPos, it->mem == NULL && want > it->capBuf ? it->capBuf : want, &got);
+        if(data == NULL){
+            return -1;
+        }
+        if(got == 0){
+            break;
+        }
+        memcpy((uint8_t *) buf + done, data, got);
+        done += got;
+        it->dataPos += got;
+    }
+    return done;
+}
+
+/**
+ * Starts a single pass over the entries of an archive.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a tar archive. A seekable file
+ *               is read with positional reads and its offset is left untouched, anything
+ *               else (a pipe, a socket) is read in sequence from where it stands.
+ * @param bufsize The size of the reads, zero for 1 MiB. It is rounded up to 512 bytes.
+ * @param flags TAR_ITER_CHECK to check every header as check_archive() does,
+ *              TAR_ITER_RAW to return the extended headers as entries of their own,
+ *              or zero.
+ *
+ * @return an iterator to be released with tar_iter_close(), or NULL if out of memory.
+ */
+tar_iter_t *tar_iter_open(int tar_fd, size_t bufsize, int flags) {
+    tar_iter_t *it = malloc(sizeof(tar_iter_t));
+    if(it == NULL){
+        return NULL;
+    }
+    if(iterInit(it, tar_fd, bufsize == 0 ? ITER_BUFFER : bufsize, flags) < 0){
+        free(it);
+        return NULL;
+    }
+    return it;
+}
+
+/**
+ * Moves to the next entry of the archive.
+ *
+ * @param it An iterator returned by tar_iter_open().
+ * @param entry Filled with the entry. Its name, link target and header stay valid until
+ *              the next call on the iterator.
+ *
+ * @return 1 if there is an entry, 0 at the end of the archive,
+ *         -1, -2 or -3 for an invalid header when checking as check_archive() does,
+ *         -4 if the archive could not be read.
+ *         Once the end or an error is reached, every call returns the same.
+ */
+int tar_iter_next(tar_iter_t *it, tar_entry_t *entry) {
+    return iterNext(it, entry);
+}
+
+/**
+ * Reads the data of the current entry, from where the previous call stopped.
+ *
+ * @param it An iterator returned by tar_iter_open().
+ * @param buf A destination buffer.
+ * @param len The size of buf.
+ *
+ * @return the number of bytes written to buf, less than len only once the end of the
+ *         data is reached, zero after it, or -1 if the archive could not be read.
+ */
+ssize_t tar_iter_read(tar_iter_t *it, void *buf, size_t len) {
+    return iterRead(it, buf, len);
+}
+
+/**
+ * Releases an iterator. The file descriptor is left open.
+ *
+ * @param it An iterator returned by tar_iter_open(), NULL is accepted.
+ */
+void tar_iter_close(tar_iter_t *it) {
+    if(it == NULL){
+        return;
+    }
+    iterRelease(it);
+    free(it);
+}
+
+/*
+ * None of the functions below move the file offset of tar_fd: the archive is
+ * only accessed through pread, so they can run concurrently on the same
+ * descriptor and leave the caller's own offset untouched.
+ */
+
+/**
+ * Checks whether the archive is valid.
+ *
+ * Each non-null header of a valid archive has:
+ *  - a magic value of "ustar" and a null,
+ *  - a version value of "00" and no null,
+ *  - a correct checksum
+ *
+ * @param tar_fd A file descriptor pointing to the start of a file supposed to contain a tar archive.
+ *
+ * @return a zero or positive value if the archive is valid, representing the number of headers in the archive,
+ *         -1 if the archive contains a header with an invalid magic value,
+ *         -2 if the archive contains a header with an invalid version value,
+ *         -3 if the archive contains a header with an invalid checksum value,
+ *         -4 if the archive could not be read
+ */
+int check_archive(int tar_fd) {
+    struct tar_iter it;
+    tar_entry_t entry;
+    int nbHeaders = 0;
+    int ret;
+    STAT_BEGIN();
+    if(iterInit(&it, tar_fd, ITER_BUFFER, TAR_ITER_CHECK | TAR_ITER_RAW) < 0){
+        STAT_END(TAR_API_CHECK_ARCHIVE, NULL);
+        return -4;
+    }
+    while((ret = iterNext(&it, &entry)) > 0){
+        nbHeaders++;
+    }
+    iterRelease(&it);
+    STAT_END(TAR_API_CHECK_ARCHIVE, NULL);
+    return ret < 0 ? ret : nbHeaders;
+}
+
+#define RESUME_BUFFER (64 << 10)
+
+/* Validates and hashes the entries from it->next on, up to the offset until, into state.
+ * An entry whose data is not all there yet is left for the next time. */
+static int resumeWalk(struct tar_iter *it, uint64_t until, tar_check_state_t *state, uint8_t *buf) {
+    tar_entry_t entry;
+    int ret = 0;
+    while(it->next < until && (ret = iterNext(it, &entry)) > 0){
+        uint32_t crcHeader = crc32(0, (const Bytef *) entry.header, sizeof(struct posix_header));
+        uint32_t crc = crc32(state->crc, (const Bytef *) entry.header, sizeof(struct posix_header));
+        uint64_t done = 0;
+        while(done < entry.size){
+            ssize_t nbRead = iterRead(it, buf, entry.size - done < RESUME_BUFFER ? entry.size - done : RESUME_BUFFER);
+            if(nbRead < 0){
+                return -4;
+            }
+            if(nbRead == 0){
+                return 0;         /* still being appended */
+            }
+            crc = crc32(crc, buf, nbRead);
+            done += nbRead;
+        }
+        state->crc = crc;
+        state->nb_headers++;
+        state->last_header = entry.header_offset;
+        state->last_crc = crcHeader;
+        state->offset = it->next;
+    }
+    return it->next < until ? ret : 0;
+}
+
+/**
+ * Checks the headers appended to an archive since the last call, as check_archive() does.
+ *
+ * @param tar_fd A file descriptor pointing to a file supposed to contain a tar archive.
+ * @param state Where the last call stopped, zeroed before the first one. It is moved past
+ *              the headers found valid, and left where it is on an error. Set its
+ *              verify_prefix to re-hash the part already validated instead of its last header.
+ *
+ * @return the number of headers of the archive, as check_archive() counts them, when the
+ *         new ones are valid, the error of the first invalid one otherwise as
+ *         check_archive() returns it, -4 if the archive could not be read,
+ *         -5 if the part already validated was modified.
+ */
+int check_archive_resume(int tar_fd, tar_check_state_t *state) {
+    struct tar_iter it;
+    tar_check_state_t next = *state;
+    uint8_t *buf = malloc(RESUME_BUFFER);
+    if(buf == NULL || iterInit(&it, tar_fd, ITER_BUFFER, TAR_ITER_CHECK | TAR_ITER_RAW) < 0){
+        free(buf);
+        return -4;
+    }
+    int ret = 0;
+    if(state->nb_headers > 0 && state->verify_prefix){
+        tar_check_state_t prefix = {0};
+        ret = resumeWalk(&it, state->offset, &prefix, buf);
+        if(ret == 0 && (prefix.offset != state->offset || prefix.nb_headers != state->nb_headers || prefix.crc != state->crc)){
+            ret = -5;
+        }
+    }else if(state->nb_headers > 0){
+        size_t got;
+        const uint8_t *last = iterFetch(&it, state->last_header, sizeof(struct posix_header), &got);
+        if(last == NULL){
+            ret = -4;
+        }else if(got < sizeof(struct posix_header) || crc32(0, last, got) != state->last_crc){
+            ret = -5;
+        }
+    }
+    if(ret == 0){
+        it.next = state->offset;
+        ret = resumeWalk(&it, UINT64_MAX, &next, buf);
+    }
+    iterRelease(&it);
+    free(buf);
+    if(ret < 0){
+        return ret;
+    }
+    next.verify_prefix = state->verify_prefix;
+    *state = next;
+    return next.nb_headers;
+}
+
+static int anyType(char typeflag) {
+    return 1;
+}
+
+static int dirType(char typeflag) {
+    return typeflag == DIRTYPE;
+}
+
+static int fileType(char typeflag) {
+    return typeflag == REGTYPE || typeflag == AREGTYPE;
+}
+
+static int symlinkType(char typeflag) {
+    return typeflag == SYMTYPE;
+}
+
+/* Whether an entry at path has one of the types accepted. */
+static int hasEntry(int tar_fd, const char *path, int (*accept)(char typeflag)) {
+    struct tar_iter it;
+    tar_entry_t entry;
+    int found = 0;
+    if(iterInit(&it, tar_fd, SCAN_BUFFER, 0) < 0){
+        return 0;
+    }
+    while(!found && iterNext(&it, &entry) > 0){
+        found = strcmp(path, entry.name) == 0 && accept(entry.typeflag);
+    }
+    iterRelease(&it);
+    return found;
+}
+
+/**
+ * Checks whether an entry exists in the archive.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a tar archive file.
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive,
+ *         any other value otherwise.
+ */
+int exists(int tar_fd, char *path) {
+    STAT_BEGIN();
+    int ret = hasEntry(tar_fd, path, anyType);
+    STAT_END(TAR_API_EXISTS, path);
+    return ret;
+}
+
+/**
+ * Checks whether an entry exists in the archive and is a directory.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a tar archive file.
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive or the entry is not a directory,
+ *         any other value otherwise.
+ */
+int is_dir(int tar_fd, char *path) {
+    STAT_BEGIN();
+    int ret = hasEntry(tar_fd, path, dirType);
+    STAT_END(TAR_API_IS_DIR, path);
+    return ret;
+}
+
+/**
+ * Checks whether an entry exists in the archive and is a file.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a tar archive file.
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive or the entry is not a file,
+ *         any other value otherwise.
+ */
+int is_file(int tar_fd, char *path) {
+    STAT_BEGIN();
+    int ret = hasEntry(tar_fd, path, fileType);
+    STAT_END(TAR_API_IS_FILE, path);
+    return ret;
+}
+
+/**
+ * Checks whether an entry exists in the archive and is a symlink.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a tar archive file.
+ * @param path A path to an entry in the archive.
+ * @return zero if no entry at the given path exists in the archive or the entry is not symlink,
+ *         any other value otherwise.
+ */
+int is_symlink(int tar_fd, char *path) {
+    STAT_BEGIN();
+    int ret = hasEntry(tar_fd, path, symlinkType);
+    STAT_END(TAR_API_IS_SYMLINK, path);
+    return ret;
+}
+
+
+
+
+/*
+ * Symlinks
+ *
+ * A link target is relative to the directory holding the link, unless it
+ * starts with a '/' in which case it is relative to the top of the archive.
+ * "." and ".." components are folded, ".." at the top stays at the top.
+ * Chains of links are followed up to MAX_HOPS links, beyond which the link
+ * is considered dangling, which also stops cycles.
+ */
+
+#define MAX_HOPS 40
+#define MAX_PATH 4096
+
+/* Folds the components of path onto the directory dir (without trailing slash,
+ * "" for the top), writing the result to out. Returns its length, or -1 if too long. */
+static ssize_t foldPath(const char *dir, size_t lenDir, const char *path, char *out) {
+    size_t len = 0;
+    if(path[0] != '/'){
+        if(lenDir >= MAX_PATH){
+            return -1;
+        }
+        memcpy(out, dir, lenDir);
+        len = lenDir;
+    }
+    while(*path != '\0'){
+        while(*path == '/'){
+            path++;
+        }
+        const char *end = strchrnul(path, '/');
+        size_t lenComponent = end - path;
+        if(lenComponent == 0 || (lenComponent == 1 && path[0] == '.')){
+            /* nothing to add */
+        }else if(lenComponent == 2 && path[0] == '.' && path[1] == '.'){
+            while(len > 0 && out[len - 1] != '/'){
+                len--;
+            }
+            if(len > 0){
+                len--;
+            }
+        }else{
+            if(len + 1 + lenComponent >= MAX_PATH){
+                return -1;
+            }
+            if(len > 0){
+                out[len++] = '/';
+            }
+            memcpy(out + len, path, lenComponent);
+            len += lenComponent;
+        }
+        path = end;
+    }
+    out[len] = '\0';
+    return len;
+}
+
+/* Length of the directory part of a path, without its trailing slash: "a/b/c" and "a/b/c/" give 3. */
+static size_t dirLength(const char *path) {
+    size_t len = strlen(path);
+    while(len > 0 && path[len - 1] == '/'){
+        len--;
+    }
+    while(len > 0 && path[len - 1] != '/'){
+        len--;
+    }
+    return len > 0 ? len - 1 : 0;
+}
+
+/* The path a link named linkPath pointing to target leads to, written to out. */
+static ssize_t linkTarget(const char *linkPath, const char *target, char *out) {
+    return foldPath(linkPath, dirLength(linkPath), target, out);
+}
+
+/* Whether name is directly inside the directory path, "a/b" and "a/b/" are both in "a/". */
+static int isChild(const char *path, size_t lenPath, const char *name) {
+    size_t lenName = strlen(name);
+    if(lenName <= lenPath || strncmp(path, name, lenPath) != 0){
+        return 0;
+    }
+    const char *slash = memchr(name + lenPath, '/', lenName - lenPath);
+    return slash == NULL || slash == name + lenName - 1;
+}
+
+/* Whether two paths are the same once their trailing slashes are dropped. */
+static int samePath(const char *path, const char *name) {
+    size_t lenPath = strlen(path);
+    size_t lenName = strlen(name);
+    while(lenPath > 0 && path[lenPath - 1] == '/'){
+        lenPath--;
+    }
+    while(lenName > 0 && name[lenName - 1] == '/'){
+        lenName--;
+    }
+    return lenPath == lenName && strncmp(path, name, lenPath) == 0;
+}
+
+/* The longest symlink of the archive that is a leading directory of a path, such as
+ * "a/link" for "a/link/b" or "a/link/": the path is then looked up again through the link. */
+struct prefix_link {
+    size_t len;
+    char name[MAX_PATH];
+    char linkname[MAX_PATH];
+};
+
+static void notePrefixLink(struct prefix_link *link, const char *path, const tar_entry_t *entry) {
+    if(entry->typeflag != SYMTYPE){
+        return;
+    }
+    size_t lenName = strlen(entry->name);
+    while(lenName > 0 && entry->name[lenName - 1] == '/'){
+        lenName--;
+    }
+    if(lenName > link->len && lenName < sizeof(link->name) && strlen(entry->linkname) < sizeof(link->linkname)
+       && strncmp(path, entry->name, lenName) == 0 && path[lenName] == '/'){
+        link->len = lenName;
+        memcpy(link->name, entry->name, lenName);
+        link->name[lenName] = '\0';
+        strcpy(link->linkname, entry->linkname);
+    }
+}
+
+/* The path once its leading link is replaced by where the link leads, written to out. */
+static ssize_t followPrefixLink(const struct prefix_link *link, const char *path, char *out) {
+    char target[MAX_PATH];
+    ssize_t lenTarget = linkTarget(link->name, link->linkname, target);
+    if(lenTarget < 0){
+        return -1;
+    }
+    return foldPath(target, lenTarget, path + link->len + 1, out);
+}
+
+static int listHops(int tar_fd, char *path, char **entries, size_t *no_entries, int hops);
+
+/* Copies a listed path to the caller's array, which holds a ustar name: longer paths are cut. */
+static void copyListed(char *dest, const char *name) {
+    size_t len = strnlen(name, sizeof(((struct posix_header *) 0)->name));
+    memcpy(dest, name, len);
+    dest[len] = '\0';
+}
+
+/**
+ * Lists the entries at a given path in the archive.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a tar archive file.
+ * @param path A path to an entry in the archive. If the entry is a symlink, it must be resolved to its linked-to entry.
+ * @param entries An array of char arrays, each one is long enough to contain a tar entry
+ *                (100 bytes and a null: longer paths are cut, list_next() returns them whole)
+ * @param no_entries An in-out argument.
+ *                   The caller set it to the number of entry in entries.
+ *                   The callee set it to the number of entry listed.
+ *
+ * @return zero if no directory at the given path exists in the archive,
+ *         any other value otherwise.
+ */
+
+
+
+int list(int tar_fd, char *path, char **entries, size_t *no_entries) {
+    STAT_BEGIN();
+    int ret = listHops(tar_fd, path, entries, no_entries, 0);
+    STAT_END(TAR_API_LIST, path);
+    return ret;
+}
+
+static int listHops(int tar_fd, char *path, char **entries, size_t *no_entries, int hops) {
+
+    struct tar_iter it;
+    tar_entry_t entry;
+    size_t lenPath = strlen(path);
+    size_t index = 0;
+    int isDir = 0;
+    char linkname[MAX_PATH+1] = {0};
+    char pathToFind[MAX_PATH+1];
+    struct prefix_link prefix = {0};
+    STAT_ADD(symlinks, hops > 0);
+    if (iterInit(&it, tar_fd, SCAN_BUFFER, 0) < 0) {
+        *no_entries=0;
+        return 0;
+    }
+    while(iterNext(&it, &entry)>0){
+
+        //en suivant un lien, "a/b" et "a/b/" designent la meme entree
+        if (strcmp(path, entry.name) == 0 || (hops > 0 && samePath(path, entry.name))) {
+            if (entry.typeflag==DIRTYPE) {
+                isDir = 1;
+            } else if (entry.typeflag==SYMTYPE && linkname[0] == '\0') {
+                strncpy(linkname,entry.linkname,MAX_PATH);
+            }
+        } else if (isChild(path, lenPath, entry.name) && index < *no_entries) {
+            //le fichier est un repertoire de plus que le path
+            copyListed(entries[index],entry.name);
+            index++;
+        }
+        notePrefixLink(&prefix, path, &entry);
+    }
+    iterRelease(&it);
+
+    if (!isDir && linkname[0] == '\0' && prefix.len > 0 && hops < MAX_HOPS) {
+        ssize_t lenTarget = followPrefixLink(&prefix, path, pathToFind);
+        if (lenTarget > 0) {
+            strcpy(pathToFind + lenTarget, "/");
+            return listHops(tar_fd,pathToFind,entries,no_entries,hops+1);
+        }
+    }
+    if (!isDir && linkname[0] != '\0' && hops < MAX_HOPS) {
+        ssize_t lenTarget = linkTarget(path, linkname, pathToFind);
+        if (lenTarget > 0) {
+            //les repertoires sont archives avec un / final
+            strcpy(pathToFind + lenTarget, "/");
+            return listHops(tar_fd,pathToFind,entries,no_entries,hops+1);
+        }
+    }
+    //le chemin peut contenir des . ou ..
+    ssize_t lenFolded;
+    if (!isDir && linkname[0] == '\0' && hops < MAX_HOPS && (lenFolded = foldPath("",0,path,pathToFind)) > 0) {
+        strcpy(pathToFind + lenFolded, "/");
+        if (strcmp(path,pathToFind) != 0) {
+            return listHops(tar_fd,pathToFind,entries,no_entries,hops+1);
+        }
+    }
+    if (!isDir) {
+        *no_entries=0;
+        return 0;
+    }
+    *no_entries=index;
+    return 1;
+}
+
+/**
+ * Reads a file at a given path in the archive.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a tar archive file.
+ * @param path A path to an entry in the archive to read from.  If the entry is a symlink, it must be resolved to its linked-to entry.
+ *             A hard link reads the data of the file it links to.
+ * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
+ * @param dest A destination buffer to read the given file into.
+ * @param len An in-out argument.
+ *            The caller set it to the size of dest.
+ *            The callee set it to the number of bytes written to dest.
+ *
+ * @return -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         -2 if the offset is outside the file total length,
+ *         zero if the file was read in its entirety into the destination buffer,
+ *         a positive value if the file was partially read, representing the remaining bytes left to be read.
+ *
+ */
+static ssize_t readFileHops(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len, int hops);
+
+ssize_t read_file(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len) {
+    STAT_BEGIN();
+    ssize_t ret = readFileHops(tar_fd, path, offset, dest, len, 0);
+    STAT_END(TAR_API_READ_FILE, path);
+    return ret;
+}
+
+static ssize_t readFileHops(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len, int hops) {
+
+    struct tar_iter it;
+    tar_entry_t entry;
+    struct prefix_link prefix = {0};
+    char target[MAX_PATH];
+    int found = 0;
+    STAT_ADD(symlinks, hops > 0);
+    if (iterInit(&it, tar_fd, SCAN_BUFFER, 0) < 0) {
+        return -1;
+    }
+    while(!found && iterNext(&it, &entry)>0){
+        if (strcmp(path,entry.name)==0 && (entry.typeflag==REGTYPE || entry.typeflag==AREGTYPE || entry.typeflag==SYMTYPE || entry.typeflag==LNKTYPE)) {
+            found = 1;
+        } else {
+            notePrefixLink(&prefix, path, &entry);
+        }
+    }
+    if (found && entry.typeflag==SYMTYPE) {
+        //le lien est suivi une fois l'iterateur libere
+        ssize_t lenTarget = hops < MAX_HOPS ? linkTarget(path,entry.linkname,target) : -1;
+        iterRelease(&it);
+        if (lenTarget <= 0) {
+            return -1;
+        }
+        return readFileHops(tar_fd,target,offset,dest,len,hops+1);
+    }
+    if (found && entry.typeflag==LNKTYPE) {
+        //un lien dur nomme sa cible depuis la racine de l'archive
+        int ok = hops < MAX_HOPS && strlen(entry.linkname) < MAX_PATH;
+        if (ok) {
+            strcpy(target,entry.linkname);
+        }
+        iterRelease(&it);
+        return ok ? readFileHops(tar_fd,target,offset,dest,len,hops+1) : -1;
+    }
+    if (found) {
+        uint64_t size = entry.size;
+        if(size<offset){
+            iterRelease(&it);
+            return -2;
+        }
+        size_t nbByteToRead;
+        if(*len < (size-offset)){
+            nbByteToRead = *len;
+        } else{
+            nbByteToRead = size-offset;
+        }
+        //les donnees passent par l'iterateur, qui sait lire une archive compressee
+        it.dataPos = entry.data_offset+offset;
+        ssize_t byteRead = iterRead(&it,dest,nbByteToRead);
+        iterRelease(&it);
+        if(byteRead < 0){
+            return -1;
+        }
+        *len = byteRead;
+        return (ssize_t) (size-offset) - byteRead;
+    }
+    iterRelease(&it);
+    if (prefix.len > 0 && hops < MAX_HOPS && followPrefixLink(&prefix,path,target) > 0) {
+        return readFileHops(tar_fd,target,offset,dest,len,hops+1);
+    }
+    //le chemin peut contenir des . ou ..
+    if (hops < MAX_HOPS && foldPath("",0,path,target) > 0 && strcmp(path,target) != 0) {
+        return readFileHops(tar_fd,target,offset,dest,len,hops+1);
+    }
+    return -1;
+}
+
+
+/*
+ * Parallel validation
+ *
+ * A first pass hops from header to header through large reads and only
+ * records where the headers are. The checks then run on contiguous batches
+ * of headers handed out to a pool of threads. A thread that finds a bad
+ * header lowers the shared index of the first bad header, so the others can
+ * stop as soon as their batch starts after it, and the earliest bad header
+ * is the one reported whatever the scheduling.
+ */
+
+#define SCAN_WINDOW (1 << 20)
+#define CHECK_BATCH 1024
+
+/* Collects the offsets of the headers up to the null block ending the archive.
+ * Returns the number of headers, or -1 on failure. */
+static ssize_t findHeaders(int tar_fd, uint64_t **offsets) {
+    struct tar_iter it;
+    tar_entry_t entry;
+    size_t nbOffsets = 0;
+    size_t capOffsets = 1024;
+    uint64_t *found = malloc(capOffsets * sizeof(uint64_t));
+    int ret;
+    if(found == NULL || iterInit(&it, tar_fd, SCAN_WINDOW, TAR_ITER_RAW) < 0){
+        free(found);
+        return -1;
+    }
+    while((ret = iterNext(&it, &entry)) > 0){
+        if(nbOffsets == capOffsets){
+            uint64_t *bigger = realloc(found, capOffsets * 2 * sizeof(uint64_t));
+            if(bigger == NULL){
+                ret = -1;
+                break;
+            }
+            found = bigger;
+            capOffsets *= 2;
+        }
+        found[nbOffsets++] = entry.header_offset;
+    }
+    iterRelease(&it);
+    if(ret < 0){
+        free(found);
+        return -1;
+    }
+    *offsets = found;
+    return nbOffsets;
+}
+
+struct parallel_check {
+    int fd;
+    const uint64_t *offsets;
+    size_t nbOffsets;
+    size_t nextBatch;             /* first header of the next batch to hand out */
+    size_t firstBad;              /* index of the earliest bad header found so far */
+    int firstBadCheck;            /* what check_archive reports for it */
+    int failed;                   /* a read failed */
+    pthread_mutex_t lock;
+};
+
+/* Checks batches of headers until there is none left before the first bad one.
+ * A batch whose headers are close enough is read at once. */
+static void *checkHeaders(void *arg) {
+    struct parallel_check *check = arg;
+    uint8_t *window = malloc(SCAN_WINDOW);
+    struct posix_header header;
+    for(;;){
+        size_t start = __atomic_fetch_add(&check->nextBatch, CHECK_BATCH, __ATOMIC_RELAXED);
+        if(start >= check->nbOffsets || start > __atomic_load_n(&check->firstBad, __ATOMIC_RELAXED)){
+            break;
+        }
+        size_t end = start + CHECK_BATCH < check->nbOffsets ? start + CHECK_BATCH : check->nbOffsets;
+        uint64_t span = check->offsets[end - 1] + 512 - check->offsets[start];
+        int inWindow = window != NULL && span <= SCAN_WINDOW
+                       && pread(check->fd, window, span, check->offsets[start]) == (ssize_t) span;
+        for(size_t i = start; i < end; i++){
+            const struct posix_header *current = &header;
+            int ret;
+            if(inWindow){
+                current = (const struct posix_header *) (window + (check->offsets[i] - check->offsets[start]));
+            }else if(readHeader(check->fd, &header, check->offsets[i]) <= 0){
+                __atomic_store_n(&check->failed, 1, __ATOMIC_RELAXED);
+                break;
+            }
+            if((ret = checkHeader(current)) < 0){
+                pthread_mutex_lock(&check->lock);
+                if(i < check->firstBad){
+                    check->firstBadCheck = ret;
+                    __atomic_store_n(&check->firstBad, i, __ATOMIC_RELAXED);
+                }
+                pthread_mutex_unlock(&check->lock);
+                break;
+            }
+        }
+    }
+    free(window);
+    return NULL;
+}
+
+/**
+ * Checks whether the archive is valid, like check_archive(), spreading the header
+ * checks over several threads.
+ *
+ * @param tar_fd A file descriptor pointing to a file supposed to contain a tar archive.
+ * @param nthreads The number of threads to use, zero or less to use one per online CPU.
+ *                 A compressed archive is checked by check_archive().
+ *
+ * @return the same value as check_archive(): the number of headers of a valid archive,
+ *         or the error of the first invalid header of the archive.
+ *         -4 if the archive could not be read.
+ */
+int check_archive_parallel(int tar_fd, int nthreads) {
+    if(fileCodec(tar_fd) != CODEC_NONE){
+        return check_archive(tar_fd);   /* decoding is sequential anyway */
+    }
+    uint64_t *offsets;
+    ssize_t nbOffsets = findHeaders(tar_fd, &offsets);
+    if(nbOffsets < 0){
+        return -4;
+    }
+    if(nthreads <= 0){
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if(nthreads > (nbOffsets + CHECK_BATCH - 1) / CHECK_BATCH){
+        nthreads = (nbOffsets + CHECK_BATCH - 1) / CHECK_BATCH;
+    }
+    struct parallel_check check = {
+        .fd = tar_fd,
+        .offsets = offsets,
+        .nbOffsets = nbOffsets,
+        .firstBad = SIZE_MAX,
+    };
+    pthread_mutex_init(&check.lock, NULL);
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    int nbStarted = 0;
+    while(threads != NULL && nbStarted < nthreads - 1 && pthread_create(&threads[nbStarted], NULL, checkHeaders, &check) == 0){
+        nbStarted++;
+    }
+    checkHeaders(&check);
+    for(int i = 0; i < nbStarted; i++){
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    free(offsets);
+    pthread_mutex_destroy(&check.lock);
+    if(check.firstBad != SIZE_MAX){
+        return check.firstBadCheck;
+    }
+    if(check.failed){
+        return -4;
+    }
+    return nbOffsets;
+}
+
+/*
+ * Batched lookups
+ *
+ * The paths looked for go in a hash table of their own, then the headers are
+ * streamed once through large reads and each one is looked up in that table.
+ * The walk stops as soon as every path was found.
+ */
+
+/**
+ * Looks up many paths in a single pass over the archive.
+ *
+ * @param tar_fd A file descriptor pointing to a tar archive file.
+ * @param paths The paths to look up. The same path may appear more than once.
+ * @param n The number of paths.
+ * @param results Filled with what is known about each path, results[i] for paths[i].
+ *                When a path appears several times in the archive, the first entry counts.
+ *
+ * @return the number of paths that exist in the archive, or -1 if the archive could not be read.
+ */
+ssize_t tar_stat_batch(int tar_fd, char **paths, size_t n, tar_stat_t *results) {
+    size_t nbSlots = 16;
+    while(nbSlots < n * 2){
+        nbSlots *= 2;
+    }
+    size_t mask = nbSlots - 1;
+    size_t *slots = malloc(nbSlots * sizeof(size_t));   /* query index + 1, or 0 */
+    size_t *nextSame = malloc((n + 1) * sizeof(size_t)); /* the next query of the same path */
+    uint32_t *hashes = malloc((n + 1) * sizeof(uint32_t));
+    struct tar_iter it;
+    if(slots == NULL || nextSame == NULL || hashes == NULL || iterInit(&it, tar_fd, SCAN_WINDOW, 0) < 0){
+        free(slots);
+        free(nextSame);
+        free(hashes);
+        return -1;
+    }
+    memset(slots, 0, nbSlots * sizeof(size_t));
+    size_t nbDistinct = 0;
+    for(size_t q = 0; q < n; q++){
+        memset(&results[q], 0, sizeof(tar_stat_t));
+        hashes[q] = hashPath(paths[q], strlen(paths[q]));
+        nextSame[q] = 0;
+        size_t i = hashes[q] & mask;
+        while(slots[i] != 0 && (hashes[slots[i] - 1] != hashes[q] || strcmp(paths[slots[i] - 1], paths[q]) != 0)){
+            i = (i + 1) & mask;
+        }
+        if(slots[i] == 0){
+            nbDistinct++;
+        }else{
+            nextSame[q] = slots[i];
+        }
+        slots[i] = q + 1;
+    }
+
+    tar_entry_t entry;
+    ssize_t nbFound = 0;
+    size_t nbDistinctFound = 0;
+    int ret = 1;
+    while(nbDistinctFound < nbDistinct && (ret = iterNext(&it, &entry)) > 0){
+        uint32_t hash = hashPath(entry.name, strlen(entry.name));
+        size_t i = hash & mask;
+        while(slots[i] != 0 && (hashes[slots[i] - 1] != hash || strcmp(paths[slots[i] - 1], entry.name) != 0)){
+            i = (i + 1) & mask;
+        }
+        if(slots[i] != 0 && !results[slots[i] - 1].exists){
+            nbDistinctFound++;
+            for(size_t q = slots[i]; q != 0; q = nextSame[q - 1]){
+                results[q - 1].exists = 1;
+                results[q - 1].typeflag = entry.typeflag;
+                results[q - 1].size = entry.size;
+                results[q - 1].data_offset = entry.data_offset;
+                nbFound++;
+            }
+        }
+    }
+    if(ret < 0){
+        nbFound = -1;
+    }
+    iterRelease(&it);
+    free(slots);
+    free(nextSame);
+    free(hashes);
+    return nbFound;
+}
+
+/*
+ * Archive handle
+ *
+ * tar_open() walks the headers once and records, for every entry, where its
+ * header and data live together with its type, size and link target. The
+ * entries are kept in a flat array, the names and link targets in a single
+ * string pool, and an open-addressing hash table maps a full path to its
+ * entry. The *_h queries answer from these tables without touching the file.
+ *
+ * The entries also form a tree: each one links to its parent directory, and
+ * the entries of a directory are chained from its first child in archive
+ * order, so a directory is listed in time proportional to its size. Entries
+ * whose parent directory has no header of its own are left out of the tree.
+ */
+
+#define INDEX_EMPTY 0
+#define INDEX_NONE UINT32_MAX
+#define INDEX_ROOT (UINT32_MAX - 1)
+
+struct index_entry {
+    uint64_t header_offset;   /* offset of the header block */
+    uint64_t data_offset;     /* offset of the first data block */
+    uint64_t size;            /* size of the data */
+    uint64_t name;            /* offset of the name in the string pool */
+    uint64_t linkname;        /* offset of the link target in the string pool */
+    uint32_t hash;            /* hash of the name */
+    uint32_t parent;          /* index of the directory holding the entry, or INDEX_ROOT */
+    uint32_t first_child;     /* for a directory, index of its first entry, or INDEX_NONE */
+    uint32_t next_sibling;    /* index of the next entry of the same directory, or INDEX_NONE */
+    char typeflag;
+};
+
+enum {
+    TAR_BASE_NONE,                /* no mapping, the data is read with pread */
+    TAR_BASE_MMAP,                /* the file is mapped */
+    TAR_BASE_HEAP                 /* the stream was read in memory */
+};
+
+struct tar_archive {
+    int fd;
+    const uint8_t *base;          /* the whole archive, or NULL */
+    size_t lenBase;
+    int owner;                    /* how base was obtained */
+    uint8_t **copies;             /* per entry, data read for tar_map_file() without a mapping */
+    pthread_mutex_t lockCopies;
+    int check;                    /* what check_archive returns on this archive */
+    struct index_entry *entries;
+    size_t nbEntries;
+    size_t capEntries;
+    char *strings;
+    size_t lenStrings;
+    size_t capStrings;
+    uint32_t *slots;              /* entry index + 1, or INDEX_EMPTY */
+    size_t nbSlots;               /* always a power of two */
+    uint32_t rootChild;           /* first entry at the top of the tree, or INDEX_NONE */
+    uint32_t *resolved;           /* per entry, index + 1 of the entry a symlink leads to, or INDEX_EMPTY */
+    uint32_t *sorted;             /* entry indexes in path order, built on demand */
+    void *sidecar;                /* the mapped sidecar index holding the tables above, or NULL */
+    size_t lenSidecar;
+    int codec;                    /* how the archive file is compressed */
+    struct checkpoints *checkpoints; /* where to restart decoding it, when it is not in memory */
+    struct block_cache *cache;    /* set by tar_cache_set(), or NULL */
+    struct async_reads *async;    /* set by the first tar_read_submit(), or NULL */
+};
+
+static const char *entryName(const tar_archive_t *archive, const struct index_entry *entry) {
+    return archive->strings + entry->name;
+}
+
+static const char *entryLinkname(const tar_archive_t *archive, const struct index_entry *entry) {
+    return archive->strings + entry->linkname;
+}
+
+static int addString(tar_archive_t *archive, const char *str, size_t len, uint64_t *offset) {
+    if(archive->lenStrings + len + 1 > archive->capStrings){
+        size_t cap = archive->capStrings ? archive->capStrings : 4096;
+        while(archive->lenStrings + len + 1 > cap){
+            cap *= 2;
+        }
+        char *strings = realloc(archive->strings, cap);
+        if(strings == NULL){
+            return -1;
+        }
+        archive->strings = strings;
+        archive->capStrings = cap;
+    }
+    *offset = archive->lenStrings;
+    memcpy(archive->strings + archive->lenStrings, str, len);
+    archive->strings[archive->lenStrings + len] = '\0';
+    archive->lenStrings += len + 1;
+    return 0;
+}
+
+static const struct index_entry *findEntryN(const tar_archive_t *archive, const char *path, size_t len) {
+    if(archive->nbSlots == 0){
+        return NULL;
+    }
+    uint32_t hash = hashPath(path, len);
+    size_t mask = archive->nbSlots - 1;
+    for(size_t i = hash & mask; archive->slots[i] != INDEX_EMPTY; i = (i + 1) & mask){
+        const struct index_entry *entry = &archive->entries[archive->slots[i] - 1];
+        const char *name = entryName(archive, entry);
+        if(entry->hash == hash && strncmp(name, path, len) == 0 && name[len] == '\0'){
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static const struct index_entry *findEntry(const tar_archive_t *archive, const char *path) {
+    return findEntryN(archive, path, strlen(path));
+}
+
+/* Allocates what is filled as the archive is queried. */
+static int allocateCaches(tar_archive_t *archive) {
+    archive->resolved = calloc(archive->nbEntries + 1, sizeof(uint32_t));
+    return archive->resolved == NULL ? -1 : 0;
+}
+
+/* Links every entry to its parent directory, once the hash table is built. */
+static int buildTree(tar_archive_t *archive) {
+    uint32_t *lastChild = malloc((archive->nbEntries + 1) * sizeof(uint32_t));
+    if(lastChild == NULL){
+        return -1;
+    }
+    uint32_t *rootLast = &lastChild[archive->nbEntries];
+    archive->rootChild = INDEX_NONE;
+    *rootLast = INDEX_NONE;
+    for(size_t e = 0; e < archive->nbEntries; e++){
+        archive->entries[e].first_child = INDEX_NONE;
+        archive->entries[e].next_sibling = INDEX_NONE;
+        archive->entries[e].parent = INDEX_NONE;
+        lastChild[e] = INDEX_NONE;
+    }
+    for(size_t e = 0; e < archive->nbEntries; e++){
+        struct index_entry *entry = &archive->entries[e];
+        const char *name = entryName(archive, entry);
+        if(findEntry(archive, name) != entry){
+            continue;         /* a later entry of the same name */
+        }
+        size_t len = strlen(name);
+        while(len > 0 && name[len - 1] == '/'){
+            len--;
+        }
+        while(len > 0 && name[len - 1] != '/'){
+            len--;
+        }
+        uint32_t *first;
+        uint32_t *last;
+        if(len == 0){
+            entry->parent = INDEX_ROOT;
+            first = &archive->rootChild;
+            last = rootLast;
+        }else{
+            const struct index_entry *parent = findEntryN(archive, name, len);
+            if(parent == NULL){
+                parent = findEntryN(archive, name, len - 1);
+            }
+            if(parent == NULL || parent->typeflag != DIRTYPE){
+                continue;
+            }
+            entry->parent = parent - archive->entries;
+            first = &archive->entries[entry->parent].first_child;
+            last = &lastChild[entry->parent];
+        }
+        if(*last == INDEX_NONE){
+            *first = e;
+        }else{
+            archive->entries[*last].next_sibling = e;
+        }
+        *last = e;
+    }
+    free(lastChild);
+    return 0;
+}
+
+/* Builds the hash table once all entries are known. The first entry of a
+ * given name wins, as it does for the fd-based functions. */
+static int buildSlots(tar_archive_t *archive) {
+    size_t nbSlots = 16;
+    while(nbSlots < archive->nbEntries * 2){
+        nbSlots *= 2;
+    }
+    archive->slots = calloc(nbSlots, sizeof(uint32_t));
+    if(archive->slots == NULL){
+        return -1;
+    }
+    archive->nbSlots = nbSlots;
+    size_t mask = nbSlots - 1;
+    for(size_t e = 0; e < archive->nbEntries; e++){
+        struct index_entry *entry = &archive->entries[e];
+        size_t i = entry->hash & mask;
+        int duplicate = 0;
+        while(archive->slots[i] != INDEX_EMPTY){
+            const struct index_entry *other = &archive->entries[archive->slots[i] - 1];
+            if(other->hash == entry->hash && strcmp(entryName(archive, other), entryName(archive, entry)) == 0){
+                duplicate = 1;
+                break;
+            }
+            i = (i + 1) & mask;
+        }
+        if(!duplicate){
+            archive->slots[i] = e + 1;
+        }
+    }
+    return 0;
+}
+
+static int addEntry(tar_archive_t *archive, const tar_entry_t *found) {
+    if(archive->nbEntries == archive->capEntries){
+        size_t cap = archive->capEntries ? archive->capEntries * 2 : 64;
+        struct index_entry *entries = realloc(archive->entries, cap * sizeof(struct index_entry));
+        if(entries == NULL){
+            return -1;
+        }
+        archive->entries = entries;
+        archive->capEntries = cap;
+    }
+    struct index_entry *entry = &archive->entries[archive->nbEntries];
+    size_t lenName = strlen(found->name);
+    if(addString(archive, found->name, lenName, &entry->name) < 0
+       || addString(archive, found->linkname, strlen(found->linkname), &entry->linkname) < 0){
+        return -1;
+    }
+    entry->header_offset = found->header_offset;
+    entry->data_offset = found->data_offset;
+    entry->size = found->size;
+    entry->hash = hashPath(found->name, lenName);
+    entry->typeflag = found->typeflag;
+    archive->nbEntries++;
+    return 0;
+}
+
+/* Reads len bytes at offset off of the archive, from the mapping when there is one. */
+static ssize_t readAt(const tar_archive_t *archive, void *buf, size_t len, uint64_t off) {
+    if(archive->checkpoints != NULL){
+        return checkpointRead(archive->checkpoints, archive->codec, archive->fd, NULL, 0, buf, len, off);
+    }
+    if(archive->base == NULL){
+        return pread(archive->fd, buf, len, off);
+    }
+    if(off >= archive->lenBase){
+        return 0;
+    }
+    if(len > archive->lenBase - off){
+        len = archive->lenBase - off;
+    }
+    memcpy(buf, archive->base + off, len);
+    return len;
+}
+
+static void freeCache(struct block_cache *cache);
+static void freeAsync(struct async_reads *async);
+
+static int indexArchive(tar_archive_t *archive) {
+    struct tar_iter it;
+    tar_entry_t entry;
+    int ret;
+    if(archive->base != NULL){
+        iterInitMemory(&it, archive->base, archive->lenBase, TAR_ITER_CHECK | ITER_GNU);
+    }else if(iterInit(&it, archive->fd, ITER_BUFFER, TAR_ITER_CHECK | ITER_GNU) < 0){
+        return -1;
+    }else if(it.codec != NULL){
+        archive->codec = it.codec->kind;
+        archive->checkpoints = calloc(1, sizeof(struct checkpoints));
+        if(archive->checkpoints == NULL){
+            iterRelease(&it);
+            return -1;
+        }
+        it.codec->record = archive->checkpoints;
+    }
+    while((ret = iterNext(&it, &entry)) > 0){
+        if(addEntry(archive, &entry) < 0){
+            break;
+        }
+    }
+    iterRelease(&it);
+    if(ret > 0 || ret == -4 || buildSlots(archive) < 0 || buildTree(archive) < 0 || allocateCaches(archive) < 0){
+        return -1;
+    }
+    archive->check = ret < 0 ? ret : it.firstError != 0 ? it.firstError : (int) it.nbHeaders;
+    return 0;
+}
+
+/**
+ * Opens an archive and indexes all of its entries.
+ *
+ * @param tar_fd A file descriptor pointing to a tar archive file. It is only accessed
+ *               through positional reads and must stay open until tar_close().
+ *
+ * @return a handle on the archive, or NULL if the archive could not be read.
+ *         An invalid archive still gets a handle holding the entries before the first
+ *         invalid header, check_archive_h() reports why it is invalid. Headers in the
+ *         GNU format, which check_archive() rejects for their magic, are indexed anyway.
+ *
+ * A compressed archive is decoded once, keeping restart points about every MiB of
+ * output, so reading a member later only decodes from the closest point before it.
+ */
+tar_archive_t *tar_open(int tar_fd) {
+    tar_archive_t *archive = calloc(1, sizeof(tar_archive_t));
+    if(archive == NULL){
+        return NULL;
+    }
+    archive->fd = tar_fd;
+    pthread_mutex_init(&archive->lockCopies, NULL);
+    if(indexArchive(archive) < 0){
+        tar_close(archive);
+        return NULL;
+    }
+    return archive;
+}
+
+/* Reads a whole stream in memory, for inputs that can be neither mapped nor read at an offset. */
+static int slurp(tar_archive_t *archive) {
+    size_t cap = 1 << 20;
+    uint8_t *buf = malloc(cap);
+    size_t len = 0;
+    ssize_t nbRead;
+    if(buf == NULL){
+        return -1;
+    }
+    while((nbRead = read(archive->fd, buf + len, cap - len)) != 0){
+        if(nbRead < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            free(buf);
+            return -1;
+        }
+        len += nbRead;
+        if(len == cap){
+            uint8_t *bigger = realloc(buf, cap * 2);
+            if(bigger == NULL){
+                free(buf);
+                return -1;
+            }
+            buf = bigger;
+            cap *= 2;
+        }
+    }
+    archive->base = buf;
+    archive->lenBase = len;
+    archive->owner = TAR_BASE_HEAP;
+    return 0;
+}
+
+/* Decodes a whole compressed archive in memory, read from the file or from mem. */
+static int decodeAll(tar_archive_t *archive, int kind, const uint8_t *mem, size_t lenMem) {
+    struct codec c;
+    size_t cap = 1 << 20;
+    size_t len = 0;
+    uint8_t *buf = malloc(cap);
+    if(buf == NULL || codecInit(&c, kind, archive->fd, mem, lenMem, 0) < 0){
+        free(buf);
+        return -1;
+    }
+    for(;;){
+        ssize_t nbRead = codecRead(&c, buf + len, cap - len);
+        if(nbRead < 0){
+            codecEnd(&c);
+            free(buf);
+            return -1;
+        }
+        len += nbRead;
+        if(len < cap){
+            break;
+        }
+        uint8_t *bigger = realloc(buf, cap * 2);
+        if(bigger == NULL){
+            codecEnd(&c);
+            free(buf);
+            return -1;
+        }
+        buf = bigger;
+        cap *= 2;
+    }
+    codecEnd(&c);
+    archive->base = buf;
+    archive->lenBase = len;
+    archive->owner = TAR_BASE_HEAP;
+    archive->codec = kind;
+    return 0;
+}
+
+/**
+ * Opens an archive like tar_open(), with the whole archive mapped in memory so that
+ * tar_map_file() can hand out pointers to the member data without copying it.
+ *
+ * When the file cannot be mapped, the handle falls back to positional reads, and when
+ * the descriptor is not seekable either (a pipe for instance) the stream is read
+ * in memory once. A compressed archive is decoded in memory once.
+ *
+ * @param tar_fd A file descriptor pointing to a tar archive file.
+ *
+ * @return a handle on the archive, or NULL if the archive could not be read.
+ */
+tar_archive_t *tar_open_mmap(int tar_fd) {
+    tar_archive_t *archive = calloc(1, sizeof(tar_archive_t));
+    if(archive == NULL){
+        return NULL;
+    }
+    archive->fd = tar_fd;
+    pthread_mutex_init(&archive->lockCopies, NULL);
+    struct stat st;
+    int kind = CODEC_NONE;
+    if(fstat(tar_fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0){
+        kind = fileCodec(tar_fd);
+        if(kind != CODEC_NONE){
+            if(decodeAll(archive, kind, NULL, 0) < 0){
+                tar_close(archive);
+                return NULL;
+            }
+        }else{
+            void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, tar_fd, 0);
+            if(base != MAP_FAILED){
+                archive->base = base;
+                archive->lenBase = st.st_size;
+                archive->owner = TAR_BASE_MMAP;
+            }
+        }
+    }
+    if(archive->base == NULL && lseek(tar_fd, 0, SEEK_CUR) < 0 && errno == ESPIPE && slurp(archive) < 0){
+        tar_close(archive);
+        return NULL;
+    }
+    if(archive->owner == TAR_BASE_HEAP && archive->codec == CODEC_NONE
+       && (kind = detectCodec(archive->base, archive->lenBase)) != CODEC_NONE){
+        const uint8_t *raw = archive->base;
+        size_t lenRaw = archive->lenBase;
+        int ret = decodeAll(archive, kind, raw, lenRaw);
+        free((void *) raw);
+        if(ret < 0){
+            archive->base = NULL;
+            tar_close(archive);
+            return NULL;
+        }
+    }
+    if(indexArchive(archive) < 0){
+        tar_close(archive);
+        return NULL;
+    }
+    return archive;
+}
+
+/**
+ * Releases a handle returned by tar_open() or tar_open_mmap(). The file descriptor is left open.
+ * Reads queued with tar_read_submit() are waited for, and their completions dropped.
+ *
+ * @param archive A handle on an archive, NULL is accepted.
+ */
+void tar_close(tar_archive_t *archive) {
+    if(archive == NULL){
+        return;
+    }
+    freeAsync(archive->async);
+    if(archive->owner == TAR_BASE_MMAP){
+        munmap((void *) archive->base, archive->lenBase);
+    }else if(archive->owner == TAR_BASE_HEAP){
+        free((void *) archive->base);
+    }
+    if(archive->copies != NULL){
+        for(size_t e = 0; e < archive->nbEntries; e++){
+            free(archive->copies[e]);
+        }
+        free(archive->copies);
+    }
+    pthread_mutex_destroy(&archive->lockCopies);
+    freeCheckpoints(archive->checkpoints);
+    freeCache(archive->cache);
+    free(archive->resolved);
+    if(archive->sidecar != NULL){
+        munmap(archive->sidecar, archive->lenSidecar);
+    }else{
+        free(archive->entries);
+        free(archive->strings);
+        free(archive->slots);
+        free(archive->sorted);
+    }
+    free(archive);
+}
+
+/**
+ * Same as check_archive(), answered from the index.
+ */
+int check_archive_h(tar_archive_t *archive) {
+    return archive->check;
+}
+
+/**
+ * Same as exists(), answered from the index.
+ */
+int exists_h(tar_archive_t *archive, char *path) {
+    return findEntry(archive, path) != NULL;
+}
+
+/**
+ * Same as is_dir(), answered from the index.
+ */
+int is_dir_h(tar_archive_t *archive, char *path) {
+    const struct index_entry *entry = findEntry(archive, path);
+    return entry != NULL && entry->typeflag == DIRTYPE;
+}
+
+/**
+ * Same as is_file(), answered from the index.
+ */
+int is_file_h(tar_archive_t *archive, char *path) {
+    const struct index_entry *entry = findEntry(archive, path);
+    return entry != NULL && (entry->typeflag == REGTYPE || entry->typeflag == AREGTYPE);
+}
+
+/**
+ * Same as is_symlink(), answered from the index.
+ */
+int is_symlink_h(tar_archive_t *archive, char *path) {
+    const struct index_entry *entry = findEntry(archive, path);
+    return entry != NULL && entry->typeflag == SYMTYPE;
+}
+
+/* The entry at path, whether or not its name ends with a slash. */
+static const struct index_entry *findEntryAnyDir(const tar_archive_t *archive, char *path, size_t len) {
+    const struct index_entry *entry = findEntryN(archive, path, len);
+    if(entry == NULL && len + 1 < MAX_PATH){
+        path[len] = '/';
+        entry = findEntryN(archive, path, len + 1);
+    }
+    return entry;
+}
+
+static const struct index_entry *resolveEntry(const tar_archive_t *archive, const struct index_entry *entry, int hops);
+
+/* Walks the components of target from the directory dir, following the links met on
+ * the way, and returns the entry it leads to or NULL. */
+static const struct index_entry *walkPath(const tar_archive_t *archive, const char *dir, size_t lenDir, const char *target, int hops) {
+    char path[MAX_PATH + 1];
+    char folded[MAX_PATH];
+    if(foldPath(dir, lenDir, target, folded) < 0){
+        return NULL;
+    }
+    size_t len = 0;
+    const char *component = folded;
+    const struct index_entry *entry = NULL;
+    while(*component != '\0'){
+        const char *end = strchrnul(component, '/');
+        if(len + 1 + (end - component) >= MAX_PATH){
+            return NULL;
+        }
+        if(len > 0){
+            path[len++] = '/';
+        }
+        memcpy(path + len, component, end - component);
+        len += end - component;
+        entry = findEntryAnyDir(archive, path, len);
+        if(entry != NULL && entry->typeflag == SYMTYPE){
+            entry = resolveEntry(archive, entry, hops);
+            if(entry == NULL){
+                return NULL;
+            }
+            /* carry on from where the link leads */
+            const char *name = entryName(archive, entry);
+            len = strlen(name);
+            while(len > 0 && name[len - 1] == '/'){
+                len--;
+            }
+            memcpy(path, name, len);
+        }
+        component = *end == '/' ? end + 1 : end;
+    }
+    return entry;
+}
+
+/* The entry at path, or, when there is none, the entry path leads to through the links
+ * among its leading directories. */
+static const struct index_entry *lookupPath(const tar_archive_t *archive, const char *path) {
+    const struct index_entry *entry = findEntry(archive, path);
+    if(entry == NULL && strchr(path, '/') != NULL){
+        entry = walkPath(archive, "", 0, path, 0);
+    }
+    return entry;
+}
+
+/* The entry a symlink finally leads to, or the entry itself if it is not a symlink.
+ * The result is remembered in the handle, so each link is only walked once. */
+static const struct index_entry *resolveEntry(const tar_archive_t *archive, const struct index_entry *entry, int hops) {
+    if(entry == NULL || entry->typeflag != SYMTYPE){
+        return entry;
+    }
+    size_t index = entry - archive->entries;
+    uint32_t resolved = __atomic_load_n(&archive->resolved[index], __ATOMIC_RELAXED);
+    if(resolved != INDEX_EMPTY){
+        return &archive->entries[resolved - 1];
+    }
+    if(hops >= MAX_HOPS){
+        return NULL;
+    }
+    const char *name = entryName(archive, entry);
+    const struct index_entry *target = walkPath(archive, name, dirLength(name), entryLinkname(archive, entry), hops + 1);
+    if(target != NULL){
+        __atomic_store_n(&archive->resolved[index], (uint32_t) (target - archive->entries) + 1, __ATOMIC_RELAXED);
+    }
+    return target;
+}
+
+/**
+ * Starts listing the entries at a given path in the archive.
+ *
+ * @param archive A handle on an archive.
+ * @param path A path to a directory in the archive, or "" for the top of the archive.
+ *             If the entry is a symlink, it is resolved to its linked-to entry as list() does.
+ * @param cursor Set up to return the entries of the directory with list_next().
+ *
+ * @return zero if no directory at the given path exists in the archive,
+ *         any other value otherwise.
+ */
+int list_begin(tar_archive_t *archive, char *path, tar_list_cursor_t *cursor) {
+    cursor->archive = archive;
+    cursor->next = INDEX_NONE;
+    if(path[0] == '\0'){
+        cursor->next = archive->rootChild;
+        return 1;
+    }
+    const struct index_entry *dir = resolveEntry(archive, lookupPath(archive, path), 0);
+    if(dir == NULL || dir->typeflag != DIRTYPE){
+        return 0;
+    }
+    cursor->next = dir->first_child;
+    return 1;
+}
+
+/**
+ * Returns the next entry of a directory listed with list_begin().
+ *
+ * @param cursor A cursor set up by list_begin().
+ *
+ * @return the full path of the next entry, or NULL once all of them were returned.
+ *         The path belongs to the archive and stays valid until tar_close().
+ */
+const char *list_next(tar_list_cursor_t *cursor) {
+    if(cursor->next == INDEX_NONE){
+        return NULL;
+    }
+    const struct index_entry *entry = &cursor->archive->entries[cursor->next];
+    cursor->next = entry->next_sibling;
+    return entryName(cursor->archive, entry);
+}
+
+/**
+ * Returns the next entries of a directory listed with list_begin(), a page at a time.
+ *
+ * @param cursor A cursor set up by list_begin().
+ * @param names Filled with the full paths of the next entries, as list_next() returns them.
+ * @param max The number of paths names can hold.
+ *
+ * @return the number of paths written to names, zero once all of them were returned.
+ */
+size_t list_next_page(tar_list_cursor_t *cursor, const char **names, size_t max) {
+    size_t count = 0;
+    while(count < max && (names[count] = list_next(cursor)) != NULL){
+        count++;
+    }
+    return count;
+}
+
+/**
+ * Same as list(), answered from the index.
+ */
+int list_h(tar_archive_t *archive, char *path, char **entries, size_t *no_entries) {
+    tar_list_cursor_t cursor;
+    if(!list_begin(archive, path, &cursor)){
+        *no_entries = 0;
+        return 0;
+    }
+    size_t index = 0;
+    const char *name;
+    while(index < *no_entries && (name = list_next(&cursor)) != NULL){
+        copyListed(entries[index], name);
+        index++;
+    }
+    *no_entries = index;
+    return 1;
+}
+
+/*
+ * Block cache
+ *
+ * An optional cache, per handle, of the data of the members read through
+ * read_file_h(), in blocks of CACHE_BLOCK bytes of a member. A block is keyed
+ * by the entry that holds the data and its index in it, so the hard links
+ * to a file, which findFile() resolves to that file, share its blocks. The
+ * blocks sit in a chained hash table and on a list from the most to the
+ * least recently used, the last ones being dropped to stay within the
+ * budget. A missing block is read without holding the lock, so that a miss
+ * does not stall the hits of other threads. A handle holding the whole
+ * archive in memory has no use for the cache.
+ */
+
+#define CACHE_BLOCK (64 << 10)
+
+struct cache_block {
+    uint32_t entry;
+    uint64_t index;
+    size_t len;
+    struct cache_block *prev;     /* more recently used */
+    struct cache_block *next;     /* less recently used */
+    struct cache_block *chain;    /* next in the same hash bucket */
+    uint8_t data[];
+};
+
+struct block_cache {
+    pthread_mutex_t lock;
+    size_t budget;
+    size_t bytes;
+    struct cache_block **buckets;
+    size_t nbBuckets;             /* a power of two */
+    struct cache_block *first;
+    struct cache_block *last;
+    tar_cache_stats_t stats;
+};
+
+static void freeCache(struct block_cache *cache) {
+    if(cache == NULL){
+        return;
+    }
+    for(struct cache_block *block = cache->first, *next; block != NULL; block = next){
+        next = block->next;
+        free(block);
+    }
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->buckets);
+    free(cache);
+}
+
+static size_t cacheBucket(const struct block_cache *cache, uint32_t entry, uint64_t index) {
+    uint64_t key = (uint64_t) entry << 40 ^ index;
+    return (key * 0x9e3779b97f4a7c15ULL >> 32) & (cache->nbBuckets - 1);
+}
+
+static void cacheUnlink(struct block_cache *cache, struct cache_block *block) {
+    if(block->prev != NULL){
+        block->prev->next = block->next;
+    }else{
+        cache->first = block->next;
+    }
+    if(block->next != NULL){
+        block->next->prev = block->prev;
+    }else{
+        cache->last = block->prev;
+    }
+}
+
+static void cachePushFront(struct block_cache *cache, struct cache_block *block) {
+    block->prev = NULL;
+    block->next = cache->first;
+    if(cache->first != NULL){
+        cache->first->prev = block;
+    }else{
+        cache->last = block;
+    }
+    cache->first = block;
+}
+
+/* The block if it is cached, moved to the front. Called with the lock held. */
+static struct cache_block *cacheFind(struct block_cache *cache, uint32_t entry, uint64_t index) {
+    struct cache_block *block = cache->buckets[cacheBucket(cache, entry, index)];
+    while(block != NULL && (block->entry != entry || block->index != index)){
+        block = block->chain;
+    }
+    if(block != NULL && block != cache->first){
+        cacheUnlink(cache, block);
+        cachePushFront(cache, block);
+    }
+    return block;
+}
+
+static void cacheEvict(struct block_cache *cache) {
+    struct cache_block *victim = cache->last;
+    struct cache_block **link = &cache->buckets[cacheBucket(cache, victim->entry, victim->index)];
+    while(*link != victim){
+        link = &(*link)->chain;
+    }
+    *link = victim->chain;
+    cacheUnlink(cache, victim);
+    cache->bytes -= victim->len;
+    cache->stats.evictions++;
+    free(victim);
+}
+
+/* Reads the member data [off, off + len) of entry through the cache. */
+static ssize_t cachedRead(tar_archive_t *archive, const struct index_entry *entry, uint8_t *dest, size_t len, uint64_t off) {
+    struct block_cache *cache = archive->cache;
+    uint32_t id = entry - archive->entries;
+    size_t done = 0;
+    while(done < len){
+        uint64_t index = (off + done) / CACHE_BLOCK;
+        uint64_t start = index * CACHE_BLOCK;
+        size_t lenBlock = entry->size - start < CACHE_BLOCK ? entry->size - start : CACHE_BLOCK;
+        size_t skip = off + done - start;
+        size_t chunk = lenBlock - skip < len - done ? lenBlock - skip : len - done;
+
+        pthread_mutex_lock(&cache->lock);
+        struct cache_block *block = cacheFind(cache, id, index);
+        if(block != NULL){
+            cache->stats.hits++;
+            memcpy(dest + done, block->data + skip, chunk);
+            pthread_mutex_unlock(&cache->lock);
+            done += chunk;
+            continue;
+        }
+        cache->stats.misses++;
+        pthread_mutex_unlock(&cache->lock);
+
+        if(lenBlock > cache->budget || (block = malloc(sizeof(struct cache_block) + lenBlock)) == NULL){
+            /* cannot be kept, read what is asked for only */
+            ssize_t nbRead = readAt(archive, dest + done, chunk, entry->data_offset + off + done);
+            if(nbRead <= 0){
+                return nbRead < 0 && done == 0 ? -1 : (ssize_t) done;
+            }
+            done += nbRead;
+            continue;
+        }
+        size_t got = 0;
+        ssize_t nbRead = 0;
+        while(got < lenBlock){
+            nbRead = readAt(archive, block->data + got, lenBlock - got, entry->data_offset + start + got);
+            if(nbRead <= 0){
+                break;
+            }
+            got += nbRead;
+        }
+        if(got < lenBlock){
+            /* the archive is cut short or unreadable: keep nothing */
+            size_t available = got > skip ? got - skip : 0;
+            chunk = chunk < available ? chunk : available;
+            memcpy(dest + done, block->data + skip, chunk);
+            free(block);
+            return nbRead < 0 && done + chunk == 0 ? -1 : (ssize_t) (done + chunk);
+        }
+        memcpy(dest + done, block->data + skip, chunk);
+        done += chunk;
+        block->entry = id;
+        block->index = index;
+        block->len = lenBlock;
+
+        pthread_mutex_lock(&cache->lock);
+        if(cacheFind(cache, id, index) != NULL){
+            /* another thread read it meanwhile */
+            pthread_mutex_unlock(&cache->lock);
+            free(block);
+            continue;
+        }
+        while(cache->bytes + lenBlock > cache->budget){
+            cacheEvict(cache);
+        }
+        size_t bucket = cacheBucket(cache, id, index);
+        block->chain = cache->buckets[bucket];
+        cache->buckets[bucket] = block;
+        cachePushFront(cache, block);
+        cache->bytes += lenBlock;
+        pthread_mutex_unlock(&cache->lock);
+    }
+    return done;
+}
+
+/**
+ * Caches the data read by read_file_h() on a handle, within a budget.
+ *
+ * @param archive A handle on an archive, not used by other threads during the call.
+ * @param max_bytes The most member data to keep, zero to drop the cache.
+ *
+ * @return zero, or -1 if out of memory.
+ */
+int tar_cache_set(tar_archive_t *archive, size_t max_bytes) {
+    freeCache(archive->cache);
+    archive->cache = NULL;
+    if(max_bytes == 0 || archive->base != NULL){
+        return 0;
+    }
+    struct block_cache *cache = calloc(1, sizeof(struct block_cache));
+    if(cache == NULL){
+        return -1;
+    }
+    /* about two buckets per full block, a cache of small members has more blocks */
+    cache->nbBuckets = 64;
+    while(cache->nbBuckets < max_bytes / CACHE_BLOCK * 2 && cache->nbBuckets < (1 << 20)){
+        cache->nbBuckets *= 2;
+    }
+    cache->buckets = calloc(cache->nbBuckets, sizeof(struct cache_block *));
+    if(cache->buckets == NULL){
+        free(cache);
+        return -1;
+    }
+    cache->budget = max_bytes;
+    pthread_mutex_init(&cache->lock, NULL);
+    archive->cache = cache;
+    return 0;
+}
+
+/**
+ * Gives the hit and miss counts of the cache of a handle.
+ *
+ * @param archive A handle on an archive.
+ * @param stats Filled with the counts since tar_cache_set(), zeroed if there is no cache.
+ */
+void tar_cache_stats(tar_archive_t *archive, tar_cache_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    struct block_cache *cache = archive->cache;
+    if(cache != NULL){
+        pthread_mutex_lock(&cache->lock);
+        *stats = cache->stats;
+        stats->bytes = cache->bytes;
+        pthread_mutex_unlock(&cache->lock);
+    }
+}
+
+/* The file at path, symlinks and hard links resolved, or NULL. */
+static const struct index_entry *findFile(const tar_archive_t *archive, const char *path) {
+    const struct index_entry *entry = resolveEntry(archive, lookupPath(archive, path), 0);
+    if(entry != NULL && entry->typeflag == LNKTYPE){
+        /* the target of a hard link is named from the top of the archive */
+        entry = findEntry(archive, entryLinkname(archive, entry));
+    }
+    if(entry == NULL || (entry->typeflag != REGTYPE && entry->typeflag != AREGTYPE)){
+        return NULL;
+    }
+    return entry;
+}
+
+static ssize_t readEntry(tar_archive_t *archive, const struct index_entry *entry, size_t offset, uint8_t *dest, size_t *len);
+static int mapEntry(tar_archive_t *archive, const struct index_entry *entry, const uint8_t **data, size_t *len);
+
+/**
+ * Same as read_file(), the entry is found through the index and its data is read
+ * with a single positional read, or copied from the mapping.
+ */
+ssize_t read_file_h(tar_archive_t *archive, char *path, size_t offset, uint8_t *dest, size_t *len) {
+    const struct index_entry *entry = findFile(archive, path);
+    if(entry == NULL){
+        return -1;
+    }
+    return readEntry(archive, entry, offset, dest, len);
+}
+
+/* Reads the data of a file entry as read_file_h() does once it is found. */
+static ssize_t readEntry(tar_archive_t *archive, const struct index_entry *entry, size_t offset, uint8_t *dest, size_t *len) {
+    if(entry->size < offset){
+        return -2;
+    }
+    size_t nbByteToRead = entry->size - offset;
+    if(*len < nbByteToRead){
+        nbByteToRead = *len;
+    }
+    ssize_t byteRead;
+    if(archive->cache != NULL){
+        byteRead = cachedRead(archive, entry, dest, nbByteToRead, offset);
+    }else{
+        byteRead = readAt(archive, dest, nbByteToRead, entry->data_offset + offset);
+    }
+    if(byteRead < 0){
+        return -1;
+    }
+    *len = byteRead;
+    return (ssize_t) (entry->size - offset) - byteRead;
+}
+
+/**
+ * Gives access to the data of a file in the archive without copying it.
+ *
+ * @param archive A handle returned by tar_open_mmap() or tar_open().
+ * @param path A path to an entry in the archive. If the entry is a symlink, it is resolved
+ *             to its linked-to entry as read_file() does.
+ * @param data Set to the first byte of the file data. The data stays valid until tar_close().
+ * @param len Set to the size of the file data.
+ *
+ * @return zero on success,
+ *         -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         -2 if the data could not be read.
+ *
+ * With a mapped archive the pointer goes straight into the mapping. Otherwise the data is
+ * read once with pread and kept with the handle.
+ */
+int tar_map_file(tar_archive_t *archive, char *path, const uint8_t **data, size_t *len) {
+    const struct index_entry *entry = findFile(archive, path);
+    if(entry == NULL){
+        return -1;
+    }
+    return mapEntry(archive, entry, data, len);
+}
+
+/* Gives the data of a file entry as tar_map_file() does once it is found. */
+static int mapEntry(tar_archive_t *archive, const struct index_entry *entry, const uint8_t **data, size_t *len) {
+    if(archive->base != NULL){
+        size_t available = 0;
+        if(entry->data_offset < archive->lenBase){
+            available = archive->lenBase - entry->data_offset;
+        }
+        *data = archive->base + entry->data_offset;
+        *len = entry->size < available ? entry->size : available;
+        return 0;
+    }
+    size_t index = entry - archive->entries;
+    int ret = 0;
+    pthread_mutex_lock(&archive->lockCopies);
+    if(archive->copies == NULL){
+        archive->copies = calloc(archive->nbEntries, sizeof(uint8_t *));
+    }
+    if(archive->copies == NULL){
+        ret = -2;
+    }else if(archive->copies[index] == NULL){
+        uint8_t *copy = malloc(entry->size ? entry->size : 1);
+        size_t done = 0;
+        while(copy != NULL && done < entry->size){
+            ssize_t nbRead = readAt(archive, copy + done, entry->size - done, entry->data_offset + done);
+            if(nbRead <= 0){
+                free(copy);
+                copy = NULL;
+            }else{
+                done += nbRead;
+            }
+        }
+        archive->copies[index] = copy;
+        ret = copy == NULL ? -2 : 0;
+    }
+    if(ret == 0){
+        *data = archive->copies[index];
+        *len = entry->size;
+    }
+    pthread_mutex_unlock(&archive->lockCopies);
+    return ret;
+}
+
+/**
+ * Gives the number of entries in the index of a handle.
+ *
+ * @param archive A handle on an archive.
+ *
+ * @return the number of entries, to be read with tar_entry_at().
+ */
+size_t tar_entry_count(tar_archive_t *archive) {
+    return archive->nbEntries;
+}
+
+/**
+ * Gives an entry of the index of a handle, in the order of the archive.
+ *
+ * @param archive A handle on an archive.
+ * @param index The position of the entry, below tar_entry_count().
+ * @param entry Filled with the entry. Its name and link target stay valid until tar_close(),
+ *              and its header is NULL.
+ *
+ * @return 1 if there is an entry at that index, 0 otherwise.
+ */
+int tar_entry_at(tar_archive_t *archive, size_t index, tar_entry_t *entry) {
+    if(index >= archive->nbEntries){
+        return 0;
+    }
+    const struct index_entry *found = &archive->entries[index];
+    entry->name = entryName(archive, found);
+    entry->linkname = entryLinkname(archive, found);
+    entry->typeflag = found->typeflag;
+    entry->size = found->size;
+    entry->header_offset = found->header_offset;
+    entry->data_offset = found->data_offset;
+    entry->header = NULL;
+    return 1;
+}
+
+/**
+ * Same as tar_map_file(), for the entry at an index of the handle rather than a path.
+ *
+ * @param archive A handle on an archive.
+ * @param index The position of the entry, below tar_entry_count().
+ * @param data Set to the first byte of the file data. The data stays valid until tar_close().
+ * @param len Set to the size of the file data.
+ *
+ * @return zero on success,
+ *         -1 if there is no entry at that index or it is not a regular file,
+ *         -2 if the data could not be read.
+ */
+int tar_map_entry(tar_archive_t *archive, size_t index, const uint8_t **data, size_t *len) {
+    if(index >= archive->nbEntries){
+        return -1;
+    }
+    const struct index_entry *entry = &archive->entries[index];
+    if(entry->typeflag != REGTYPE && entry->typeflag != AREGTYPE){
+        return -1;
+    }
+    return mapEntry(archive, entry, data, len);
+}
+
+/**
+ * Tells whether a handle holds the whole archive in memory.
+ *
+ * @param archive A handle on an archive.
+ *
+ * @return 1 if tar_map_file() and tar_map_entry() point into the archive held in memory,
+ *         0 if they read and keep a copy of each member.
+ */
+int tar_in_memory(tar_archive_t *archive) {
+    return archive->base != NULL;
+}
+
+/**
+ * Tells where the data of a file lies in the archive file, for another process to read it.
+ *
+ * @param archive A handle on an archive.
+ * @param path A path to an entry in the archive, resolved as read_file() does.
+ * @param data_offset Set to the offset of the file data in the archive file.
+ * @param size Set to the size of the file data.
+ *
+ * @return zero on success,
+ *         -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         -2 if the archive is compressed or was read from a pipe, its data not being
+ *         in the archive file as is.
+ */
+int tar_locate(tar_archive_t *archive, char *path, uint64_t *data_offset, uint64_t *size) {
+    const struct index_entry *entry = findFile(archive, path);
+    if(entry == NULL){
+        return -1;
+    }
+    *size = entry->size;
+    if(archive->codec != CODEC_NONE || archive->owner == TAR_BASE_HEAP){
+        return -2;
+    }
+    *data_offset = entry->data_offset;
+    return 0;
+}
+
+/*
+ * Sending members
+ *
+ * tar_send_file() looks the member up once and hands the whole transfer to
+ * the kernel: copy_file_range() towards a regular file, splice() towards a
+ * pipe and sendfile() towards anything else, a socket for instance. When the
+ * kernel refuses one way (another file system, an old kernel, a descriptor
+ * it does not support), the next one is tried, down to a loop through a
+ * buffer. An archive held in memory is written straight from there, and a
+ * compressed one is decoded from the closest restart point.
+ */
+
+#define SEND_CHUNK (1 << 30)
+#define SEND_BUFFER (128 << 10)
+
+enum {
+    SEND_COPY_RANGE,
+    SEND_SPLICE,
+    SEND_SENDFILE,
+    SEND_READ                     /* pread and write through a buffer */
+};
+
+/* Whether a failure only means this way of copying is not available here. */
+static int sendUnsupported(int err) {
+    return err == EINVAL || err == ENOSYS || err == EXDEV || err == EOPNOTSUPP || err == EBADF || err == ESPIPE;
+}
+
+/* Writes the whole buffer. */
+static int writeFull(int fd, const uint8_t *buf, size_t len) {
+    while(len > 0){
+        ssize_t nbWritten = write(fd, buf, len);
+        if(nbWritten < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        buf += nbWritten;
+        len -= nbWritten;
+    }
+    return 0;
+}
+
+/* Sends count bytes at offset off of the archive file, returns how many were sent. */
+static ssize_t sendRange(int tar_fd, int out_fd, uint64_t off, uint64_t count) {
+    struct stat st;
+    int method = SEND_SENDFILE;
+    if(fstat(out_fd, &st) == 0){
+        if(S_ISREG(st.st_mode)){
+            method = SEND_COPY_RANGE;
+        }else if(S_ISFIFO(st.st_mode)){
+            method = SEND_SPLICE;
+        }
+    }
+    uint8_t *buf = NULL;
+    uint64_t done = 0;
+    while(done < count){
+        size_t chunk = count - done < SEND_CHUNK ? count - done : SEND_CHUNK;
+        loff_t inOff = off + done;
+        off_t fileOff = off + done;
+        ssize_t nbSent;
+        switch(method){
+        case SEND_COPY_RANGE:
+            nbSent = copy_file_range(tar_fd, &inOff, out_fd, NULL, chunk, 0);
+            break;
+        case SEND_SPLICE:
+            nbSent = splice(tar_fd, &inOff, out_fd, NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+            break;
+        case SEND_SENDFILE:
+            nbSent = sendfile(out_fd, tar_fd, &fileOff, chunk);
+            break;
+        default:
+            if(buf == NULL && (buf = malloc(SEND_BUFFER)) == NULL){
+                return done > 0 ? (ssize_t) done : -1;
+            }
+            nbSent = pread(tar_fd, buf, chunk < SEND_BUFFER ? chunk : SEND_BUFFER, off + done);
+            if(nbSent > 0 && writeFull(out_fd, buf, nbSent) < 0){
+                nbSent = -1;
+            }
+            break;
+        }
+        if(nbSent < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            if(method != SEND_READ && done == 0 && sendUnsupported(errno)){
+                /* splice falls back to sendfile, the others straight to the buffer */
+                method = method == SEND_SPLICE ? SEND_SENDFILE : SEND_READ;
+                continue;
+            }
+            free(buf);
+            return done > 0 ? (ssize_t) done : -1;
+        }
+        if(nbSent == 0){
+            break;                /* the archive is cut short */
+        }
+        done += nbSent;
+    }
+    free(buf);
+    return done;
+}
+
+/* Sends count bytes at offset off of a compressed archive, decoded from the closest restart point. */
+static ssize_t sendDecoded(const tar_archive_t *archive, int out_fd, uint64_t off, uint64_t count) {
+    struct codec c;
+    int ret = checkpointSeek(archive->checkpoints, archive->codec, archive->fd, NULL, 0, off, &c);
+    if(ret != 0){
+        return ret < 0 ? -1 : 0;
+    }
+    uint8_t *buf = malloc(SEND_BUFFER);
+    uint64_t done = 0;
+    while(buf != NULL && done < count){
+        ssize_t nbRead = codecRead(&c, buf, count - done < SEND_BUFFER ? count - done : SEND_BUFFER);
+        if(nbRead <= 0 || writeFull(out_fd, buf, nbRead) < 0){
+            break;
+        }
+        done += nbRead;
+    }
+    free(buf);
+    codecEnd(&c);
+    return done;
+}
+
+/**
+ * Writes the data of a file in the archive to a file descriptor, without going through
+ * a user buffer when the kernel can copy it by itself.
+ *
+ * @param archive A handle on an archive.
+ * @param path A path to an entry in the archive. If the entry is a symlink, it is resolved
+ *             to its linked-to entry as read_file() does.
+ * @param out_fd Where to write: a file, a pipe or a socket, in blocking mode. The data is
+ *               written at its current offset, which moves past it.
+ * @param offset An offset in the file from which to start, zero indicates the start of the file.
+ * @param count The number of bytes to send, cut to what the file holds past offset.
+ *
+ * @return the number of bytes written to out_fd, fewer than asked only if the archive
+ *         is cut short or writing failed part of the way,
+ *         -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         -2 if the offset is outside the file total length,
+ *         -3 if nothing could be written, with errno set.
+ */
+ssize_t tar_send_file(tar_archive_t *archive, char *path, int out_fd, uint64_t offset, uint64_t count) {
+    const struct index_entry *entry = findFile(archive, path);
+    if(entry == NULL){
+        return -1;
+    }
+    if(offset > entry->size){
+        return -2;
+    }
+    if(count > entry->size - offset){
+        count = entry->size - offset;
+    }
+    if(count == 0){
+        return 0;
+    }
+    uint64_t off = entry->data_offset + offset;
+    ssize_t nbSent;
+    if(archive->owner == TAR_BASE_HEAP){
+        /* the data only exists in memory */
+        uint64_t available = off < archive->lenBase ? archive->lenBase - off : 0;
+        nbSent = count < available ? count : available;
+        if(writeFull(out_fd, archive->base + off, nbSent) < 0){
+            nbSent = -1;
+        }
+    }else if(archive->checkpoints != NULL){
+        nbSent = sendDecoded(archive, out_fd, off, count);
+    }else{
+        nbSent = sendRange(archive->fd, out_fd, off, count);
+    }
+    return nbSent < 0 ? -3 : nbSent;
+}
+
+/*
+ * Asynchronous reads
+ *
+ * tar_read_submit() looks the member up in the index at once and queues a
+ * positional read of its data; the reads are handed to the kernel in
+ * batches, when the caller polls or waits for completions. With io_uring
+ * (set up through its system calls, the first time a handle reads this
+ * way) a read is a READV in the submission ring and its completion comes
+ * back in the completion ring, the request travelling as its user_data.
+ * When io_uring is not there, or the library is built with
+ * LIB_TAR_NO_IO_URING, the reads go to a small pool of threads calling
+ * pread. A member that needs no read of the archive file (held in memory,
+ * cached or compressed) is read by readEntry() on submission, and so is a
+ * path that does not lead to a file, its completion carrying the error.
+ */
+
+#define ASYNC_ENTRIES 256
+#define ASYNC_WORKERS 4
+
+struct async_read {
+    void *user_data;
+    ssize_t ret;
+    size_t len;
+    uint64_t remaining;           /* file data past the offset */
+    struct iovec iov;             /* where to read, for the ring */
+    uint64_t off;                 /* and from which archive offset */
+    struct async_read *next;
+};
+
+struct async_reads {
+    pthread_mutex_t lock;         /* guards the lists, for the pool */
+    pthread_cond_t work;          /* a read is pending, or stop */
+    pthread_cond_t done;          /* a read is done */
+    struct async_read *pending;   /* queued, not yet handed to the kernel or a worker */
+    struct async_read *pendingTail;
+    struct async_read *finished;  /* done, not yet returned to the caller */
+    struct async_read *finishedTail;
+    size_t inFlight;              /* handed to the kernel or a worker, not finished */
+    int ring;                     /* io_uring descriptor, or -1 for the pool */
+    void *sqRing;
+    size_t lenSqRing;
+    void *cqRing;                 /* the same mapping as sqRing with IORING_FEAT_SINGLE_MMAP */
+    size_t lenCqRing;
+    struct io_uring_sqe *sqes;
+    size_t lenSqes;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray, sqEntries;
+    unsigned *cqHead, *cqTail, *cqMask, cqEntries;
+    struct io_uring_cqe *cqes;
+    int fd;
+    int stop;
+    pthread_t workers[ASYNC_WORKERS];
+    int nbWorkers;
+};
+
+static void asyncFinish(struct async_reads *async, struct async_read *req, ssize_t res) {
+    if(res < 0){
+        req->ret = -1;
+        req->len = 0;
+    }else{
+        req->ret = (ssize_t) (req->remaining - res);
+        req->len = res;
+    }
+    req->next = NULL;
+    if(async->finishedTail == NULL){
+        async->finished = req;
+    }else{
+        async->finishedTail->next = req;
+    }
+    async->finishedTail = req;
+}
+
+static void *asyncWorker(void *arg) {
+    struct async_reads *async = arg;
+    pthread_mutex_lock(&async->lock);
+    for(;;){
+        while(async->pending == NULL && !async->stop){
+            pthread_cond_wait(&async->work, &async->lock);
+        }
+        struct async_read *req = async->pending;
+        if(req == NULL){
+            break;
+        }
+        async->pending = req->next;
+        if(async->pending == NULL){
+            async->pendingTail = NULL;
+        }
+        pthread_mutex_unlock(&async->lock);
+        ssize_t res;
+        do{
+            res = pread(async->fd, req->iov.iov_base, req->iov.iov_len, req->off);
+        }while(res < 0 && errno == EINTR);
+        pthread_mutex_lock(&async->lock);
+        asyncFinish(async, req, res);
+        async->inFlight--;
+        pthread_cond_signal(&async->done);
+    }
+    pthread_mutex_unlock(&async->lock);
+    return NULL;
+}
+
+static int ringSetup(struct async_reads *async) {
+#ifdef LIB_TAR_NO_IO_URING
+    return -1;
+#else
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int ring = syscall(__NR_io_uring_setup, ASYNC_ENTRIES, &params);
+    if(ring < 0){
+        return -1;
+    }
+    async->lenSqRing = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    async->lenCqRing = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP){
+        if(async->lenCqRing > async->lenSqRing){
+            async->lenSqRing = async->lenCqRing;
+        }
+        async->lenCqRing = 0;
+    }
+    async->sqRing = mmap(NULL, async->lenSqRing, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+    if(async->sqRing == MAP_FAILED){
+        close(ring);
+        return -1;
+    }
+    async->cqRing = async->sqRing;
+    if(async->lenCqRing != 0){
+        async->cqRing = mmap(NULL, async->lenCqRing, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+        if(async->cqRing == MAP_FAILED){
+            munmap(async->sqRing, async->lenSqRing);
+            close(ring);
+            return -1;
+        }
+    }
+    async->lenSqes = params.sq_entries * sizeof(struct io_uring_sqe);
+    async->sqes = mmap(NULL, async->lenSqes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+    if(async->sqes == MAP_FAILED){
+        if(async->lenCqRing != 0){
+            munmap(async->cqRing, async->lenCqRing);
+        }
+        munmap(async->sqRing, async->lenSqRing);
+        close(ring);
+        return -1;
+    }
+    uint8_t *sq = async->sqRing, *cq = async->cqRing;
+    async->sqHead = (unsigned *) (sq + params.sq_off.head);
+    async->sqTail = (unsigned *) (sq + params.sq_off.tail);
+    async->sqMask = (unsigned *) (sq + params.sq_off.ring_mask);
+    async->sqArray = (unsigned *) (sq + params.sq_off.array);
+    async->sqEntries = params.sq_entries;
+    async->cqHead = (unsigned *) (cq + params.cq_off.head);
+    async->cqTail = (unsigned *) (cq + params.cq_off.tail);
+    async->cqMask = (unsigned *) (cq + params.cq_off.ring_mask);
+    async->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    async->cqEntries = params.cq_entries;
+    async->ring = ring;
+    return 0;
+#endif
+}
+
+static struct async_reads *asyncInit(const tar_archive_t *archive) {
+    struct async_reads *async = calloc(1, sizeof(struct async_reads));
+    if(async == NULL){
+        return NULL;
+    }
+    async->fd = archive->fd;
+    async->ring = -1;
+    pthread_mutex_init(&async->lock, NULL);
+    pthread_cond_init(&async->work, NULL);
+    pthread_cond_init(&async->done, NULL);
+    ringSetup(async);
+    return async;
+}
+
+/* Moves the completions found in the ring to the finished list. */
+static void ringReap(struct async_reads *async) {
+    unsigned head = *async->cqHead;
+    unsigned tail = __atomic_load_n(async->cqTail, __ATOMIC_ACQUIRE);
+    while(head != tail){
+        struct io_uring_cqe *cqe = &async->cqes[head & *async->cqMask];
+        asyncFinish(async, (struct async_read *) (uintptr_t) cqe->user_data, cqe->res);
+        async->inFlight--;
+        head++;
+    }
+    __atomic_store_n(async->cqHead, head, __ATOMIC_RELEASE);
+}
+
+/* Hands the pending reads to the kernel, at most as many as the completion ring can
+ * hold, and waits for min of them to complete. Returns -1 with errno set on failure. */
+static int ringEnter(struct async_reads *async, unsigned min) {
+    unsigned tail = *async->sqTail;
+    unsigned toSubmit = 0;
+    unsigned head = __atomic_load_n(async->sqHead, __ATOMIC_ACQUIRE);
+    while(async->pending != NULL && tail - head < async->sqEntries && async->inFlight < async->cqEntries){
+        struct async_read *req = async->pending;
+        async->pending = req->next;
+        unsigned index = tail & *async->sqMask;
+        struct io_uring_sqe *sqe = &async->sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READV;
+        sqe->fd = async->fd;
+        sqe->addr = (uintptr_t) &req->iov;
+        sqe->len = 1;
+        sqe->off = req->off;
+        sqe->user_data = (uintptr_t) req;
+        async->sqArray[index] = index;
+        tail++;
+        toSubmit++;
+        async->inFlight++;
+    }
+    if(async->pending == NULL){
+        async->pendingTail = NULL;
+    }
+    __atomic_store_n(async->sqTail, tail, __ATOMIC_RELEASE);
+    if(min > async->inFlight){
+        min = async->inFlight;
+    }
+    while(toSubmit > 0 || min > 0){
+        int ret = syscall(__NR_io_uring_enter, async->ring, toSubmit, min, min > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if(ret < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        if(ret == 0 && toSubmit > 0){
+            errno = EBUSY;
+            return -1;
+        }
+        toSubmit -= ret;
+        min = 0;
+    }
+    return 0;
+}
+
+/* Fills completions from the finished list, after waiting for one if wait is set and
+ * nothing is finished yet. */
+static int asyncCollect(struct async_reads *async, tar_read_completion_t *completions, int max, int wait) {
+    pthread_mutex_lock(&async->lock);
+    if(async->ring >= 0){
+        if(ringEnter(async, wait && async->finished == NULL) < 0){
+            pthread_mutex_unlock(&async->lock);
+            return -1;
+        }
+        ringReap(async);
+    }else if(wait){
+        while(async->finished == NULL && async->inFlight > 0){
+            pthread_cond_wait(&async->done, &async->lock);
+        }
+    }
+    int nb = 0;
+    while(nb < max && async->finished != NULL){
+        struct async_read *req = async->finished;
+        async->finished = req->next;
+        completions[nb].user_data = req->user_data;
+        completions[nb].ret = req->ret;
+        completions[nb].len = req->len;
+        free(req);
+        nb++;
+    }
+    if(async->finished == NULL){
+        async->finishedTail = NULL;
+    }
+    pthread_mutex_unlock(&async->lock);
+    return nb;
+}
+
+static void freeAsync(struct async_reads *async) {
+    if(async == NULL){
+        return;
+    }
+    if(async->ring >= 0){
+        /* the kernel may still be writing to the buffers of the reads in flight */
+        while(async->pending != NULL || async->inFlight > 0){
+            if(ringEnter(async, 1) < 0){
+                break;
+            }
+            ringReap(async);
+        }
+        munmap(async->sqes, async->lenSqes);
+        if(async->lenCqRing != 0){
+            munmap(async->cqRing, async->lenCqRing);
+        }
+        munmap(async->sqRing, async->lenSqRing);
+        close(async->ring);
+    }else{
+        pthread_mutex_lock(&async->lock);
+        async->stop = 1;
+        pthread_cond_broadcast(&async->work);
+        pthread_mutex_unlock(&async->lock);
+        for(int w = 0; w < async->nbWorkers; w++){
+            pthread_join(async->workers[w], NULL);
+        }
+    }
+    while(async->pending != NULL){
+        struct async_read *req = async->pending;
+        async->pending = req->next;
+        free(req);
+    }
+    while(async->finished != NULL){
+        struct async_read *req = async->finished;
+        async->finished = req->next;
+        free(req);
+    }
+    pthread_cond_destroy(&async->done);
+    pthread_cond_destroy(&async->work);
+    pthread_mutex_destroy(&async->lock);
+    free(async);
+}
+
+/**
+ * Queues a read of a file in the archive, to be reported by tar_read_poll() or tar_read_wait().
+ *
+ * @param archive A handle on an archive.
+ * @param path A path to an entry in the archive, resolved as read_file() does.
+ * @param offset An offset in the file from which to start reading.
+ * @param buf A buffer left untouched by the caller until the read is reported.
+ * @param len The size of buf.
+ * @param user_data Handed back with the completion.
+ *
+ * @return zero if the read is queued, or -1 with errno set.
+ */
+int tar_read_submit(tar_archive_t *archive, char *path, size_t offset, uint8_t *buf, size_t len, void *user_data) {
+    if(archive->async == NULL){
+        archive->async = asyncInit(archive);
+        if(archive->async == NULL){
+            return -1;
+        }
+    }
+    struct async_reads *async = archive->async;
+    struct async_read *req = malloc(sizeof(struct async_read));
+    if(req == NULL){
+        return -1;
+    }
+    req->user_data = user_data;
+    const struct index_entry *entry = findFile(archive, path);
+    if(entry == NULL || entry->size < offset || archive->base != NULL || archive->cache != NULL
+       || archive->checkpoints != NULL){
+        /* answered now, as read_file_h() would */
+        req->len = len;
+        req->ret = entry == NULL ? -1 : readEntry(archive, entry, offset, buf, &req->len);
+        if(req->ret < 0){
+            req->len = 0;
+        }
+        req->next = NULL;
+        pthread_mutex_lock(&async->lock);
+        if(async->finishedTail == NULL){
+            async->finished = req;
+        }else{
+            async->finishedTail->next = req;
+        }
+        async->finishedTail = req;
+        pthread_cond_signal(&async->done);
+        pthread_mutex_unlock(&async->lock);
+        return 0;
+    }
+    req->remaining = entry->size - offset;
+    req->iov.iov_base = buf;
+    req->iov.iov_len = len < req->remaining ? len : req->remaining;
+    if(req->iov.iov_len > SEND_CHUNK){
+        /* a completion only holds an int */
+        req->iov.iov_len = SEND_CHUNK;
+    }
+    req->off = entry->data_offset + offset;
+    req->next = NULL;
+    pthread_mutex_lock(&async->lock);
+    if(async->pendingTail == NULL){
+        async->pending = req;
+    }else{
+        async->pendingTail->next = req;
+    }
+    async->pendingTail = req;
+    int ret = 0;
+    if(async->ring >= 0){
+        if(async->inFlight >= async->cqEntries){
+            /* the completion ring is full of reads in flight: make room */
+            ret = ringEnter(async, 1);
+            ringReap(async);
+        }
+        if(ret < 0 && async->pendingTail == req){
+            /* not handed to the kernel: take it back, the caller keeps its buffer */
+            struct async_read *prev = NULL;
+            for(struct async_read *r = async->pending; r != req; r = r->next){
+                prev = r;
+            }
+            if(prev == NULL){
+                async->pending = NULL;
+            }else{
+                prev->next = NULL;
+            }
+            async->pendingTail = prev;
+            free(req);
+        }else{
+            ret = 0;              /* queued all the same, it completes as the others do */
+        }
+    }else{
+        async->inFlight++;
+        if(async->nbWorkers < ASYNC_WORKERS && async->nbWorkers < (int) async->inFlight
+           && pthread_create(&async->workers[async->nbWorkers], NULL, asyncWorker, async) == 0){
+            async->nbWorkers++;
+        }
+        if(async->nbWorkers == 0){
+            /* no worker to hand it to */
+            async->pending = NULL;
+            async->pendingTail = NULL;
+            async->inFlight--;
+            free(req);
+            ret = -1;
+        }else{
+            pthread_cond_signal(&async->work);
+        }
+    }
+    pthread_mutex_unlock(&async->lock);
+    return ret;
+}
+
+/**
+ * Returns the reads that are done, without waiting.
+ *
+ * @param archive A handle on an archive.
+ * @param completions Filled with the reads that are done.
+ * @param max The size of completions.
+ *
+ * @return the number of completions filled, or -1 with errno set.
+ */
+int tar_read_poll(tar_archive_t *archive, tar_read_completion_t *completions, int max) {
+    if(archive->async == NULL){
+        return 0;
+    }
+    return asyncCollect(archive->async, completions, max, 0);
+}
+
+/**
+ * Returns the reads that are done, waiting for one if none is.
+ *
+ * @param archive A handle on an archive.
+ * @param completions Filled with the reads that are done.
+ * @param max The size of completions.
+ *
+ * @return the number of completions filled, zero only if no read is queued,
+ *         or -1 with errno set.
+ */
+int tar_read_wait(tar_archive_t *archive, tar_read_completion_t *completions, int max) {
+    if(archive->async == NULL){
+        return 0;
+    }
+    return asyncCollect(archive->async, completions, max, 1);
+}
+
+/*
+ * Extraction
+ *
+ * tar_extract() works in three passes over the index. The directories are
+ * made first, in archive order. The regular files are then shared out
+ * between threads, each taking from the front of its own queue and, once
+ * it is empty, from the back of the others, and their data is handed to
+ * the kernel as tar_send_file() does. The links are made last, so that no
+ * file is ever written through one of them.
+ *
+ * Every path is cleaned before use: leading slashes and "." components are
+ * dropped, and a path with a ".." component is refused. Directories are
+ * walked one component at a time without following symlinks, so a link
+ * already present under the destination cannot lead a write out of it
+ * either. A symlink whose target is absolute or climbs above the
+ * destination is refused as well. That check reads the target as text, so
+ * once all the links are made each new symlink is also resolved from the
+ * top with RESOLVE_BENEATH, and removed if it leads out through the others,
+ * as "out -> d/up/.." does next to "d/up -> ..".
+ */
+
+#define EXTRACT_DIR_MODE 0755
+
+/* Cleans an archive path into out. Returns its length, zero for the top itself,
+ * or -1 if it has a ".." component or is too long. */
+static ssize_t safePath(const char *path, char *out) {
+    size_t len = 0;
+    while(*path != '\0'){
+        while(*path == '/'){
+            path++;
+        }
+        const char *end = strchrnul(path, '/');
+        size_t lenComponent = end - path;
+        if(lenComponent == 2 && path[0] == '.' && path[1] == '.'){
+            return -1;
+        }
+        if(lenComponent > 0 && !(lenComponent == 1 && path[0] == '.')){
+            if(len + 1 + lenComponent >= MAX_PATH){
+                return -1;
+            }
+            if(len > 0){
+                out[len++] = '/';
+            }
+            memcpy(out + len, path, lenComponent);
+            len += lenComponent;
+        }
+        path = end;
+    }
+    out[len] = '\0';
+    return len;
+}
+
+/* Whether a symlink at path pointing to target would lead out of the top. */
+static int linkEscapes(const char *path, const char *target) {
+    if(target[0] == '/'){
+        return 1;
+    }
+    long depth = 0;
+    for(const char *c = path; *c != '\0'; c++){
+        depth += *c == '/';
+    }
+    while(*target != '\0'){
+        const char *end = strchrnul(target, '/');
+        size_t lenComponent = end - target;
+        if(lenComponent == 2 && target[0] == '.' && target[1] == '.'){
+            if(--depth < 0){
+                return 1;
+            }
+        }else if(lenComponent > 0 && !(lenComponent == 1 && target[0] == '.')){
+            depth++;
+        }
+        target = *end == '/' ? end + 1 : end;
+    }
+    return 0;
+}
+
+/* Whether the symlink at a clean path, as made, leads out of the top once resolved through
+ * whatever else is under it. When openat2() cannot tell, because it is missing or refused
+ * (EPERM under some seccomp filters) or fails any other way, a target with a ".." component
+ * is taken as leading out. */
+static int linkLeaves(int rootfd, const char *path, const char *target) {
+    struct open_how how = {.flags = O_PATH | O_CLOEXEC, .resolve = RESOLVE_BENEATH};
+    int fd = syscall(SYS_openat2, rootfd, path, &how, sizeof(how));
+    if(fd >= 0){
+        close(fd);
+        return 0;
+    }
+    if(errno == EXDEV){
+        return 1;
+    }
+    if(errno == ENOENT || errno == ELOOP || errno == ENOTDIR){
+        return 0;             /* a dangling or looping link stays where it is */
+    }
+    for(const char *c = target; (c = strstr(c, "..")) != NULL; c += 2){
+        if((c == target || c[-1] == '/') && (c[2] == '\0' || c[2] == '/')){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Opens the directory made of the first len bytes of a clean path, one component at a time
+ * and without following symlinks, making the missing ones if create is set (the last one
+ * with the given mode). Returns an O_PATH descriptor, or -1. */
+static int openDirs(int rootfd, const char *path, size_t len, int create, mode_t mode) {
+    int fd = fcntl(rootfd, F_DUPFD_CLOEXEC, 0);
+    char component[MAX_PATH];
+    size_t start = 0;
+    while(fd >= 0 && start < len){
+        size_t end = start;
+        while(end < len && path[end] != '/'){
+            end++;
+        }
+        memcpy(component, path + start, end - start);
+        component[end - start] = '\0';
+        if(create && mkdirat(fd, component, end == len ? mode : EXTRACT_DIR_MODE) < 0 && errno != EEXIST){
+            close(fd);
+            return -1;
+        }
+        int next = openat(fd, component, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        close(fd);
+        fd = next;
+        start = end + 1;
+    }
+    return fd;
+}
+
+/* The mode and modification time in the header of an entry. */
+static int entryMeta(const tar_archive_t *archive, const struct index_entry *entry, mode_t *mode, struct timespec *mtime) {
+    tar_header_t header;
+    if(readAt(archive, &header, sizeof(header), entry->header_offset) != sizeof(header)){
+        return -1;
+    }
+    *mode = tar_parse_octal(header.mode, sizeof(header.mode)) & 0777;
+    mtime->tv_sec = tar_parse_octal(header.mtime, sizeof(header.mtime));
+    mtime->tv_nsec = 0;
+    return 0;
+}
+
+struct extract_queue {
+    pthread_mutex_t lock;
+    size_t head;                  /* taken by the owner */
+    size_t tail;                  /* stolen by the others */
+};
+
+struct parallel_extract {
+    tar_archive_t *archive;
+    int rootfd;
+    const uint32_t *files;        /* entry indexes, cut into one range per queue */
+    struct extract_queue *queues;
+    int nbQueues;
+    int nextQueue;
+    int nbFailed;
+};
+
+/* Takes a file from the front of queue q, or from the back when stealing. */
+static int takeFile(struct extract_queue *queue, int steal, size_t *file) {
+    int taken = 0;
+    pthread_mutex_lock(&queue->lock);
+    if(queue->head < queue->tail){
+        *file = steal ? --queue->tail : queue->head++;
+        taken = 1;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return taken;
+}
+
+/* Writes one regular file, in the directory dirfd. */
+static int extractFile(tar_archive_t *archive, const struct index_entry *entry, int dirfd, const char *leaf) {
+    mode_t mode;
+    struct timespec times[2];
+    if(entryMeta(archive, entry, &mode, &times[1]) < 0){
+        return -1;
+    }
+    times[0] = times[1];
+    int fd = openat(dirfd, leaf, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, mode);
+    if(fd < 0){
+        return -1;
+    }
+    ssize_t nbSent = 0;
+    if(entry->size > 0){
+        if(archive->base != NULL){
+            nbSent = entry->data_offset + entry->size <= archive->lenBase
+                     && writeFull(fd, archive->base + entry->data_offset, entry->size) == 0 ? (ssize_t) entry->size : -1;
+        }else if(archive->checkpoints != NULL){
+            nbSent = sendDecoded(archive, fd, entry->data_offset, entry->size);
+        }else{
+            nbSent = sendRange(archive->fd, fd, entry->data_offset, entry->size);
+        }
+    }
+    int ret = nbSent == (ssize_t) entry->size ? 0 : -1;
+    futimens(fd, times);
+    if(close(fd) < 0){
+        ret = -1;
+    }
+    return ret;
+}
+
+static void *extractFiles(void *arg) {
+    struct parallel_extract *extract = arg;
+    tar_archive_t *archive = extract->archive;
+    int own = __atomic_fetch_add(&extract->nextQueue, 1, __ATOMIC_RELAXED) % extract->nbQueues;
+    char path[MAX_PATH];
+    char dir[MAX_PATH] = "";
+    int dirfd = -1;
+    for(;;){
+        size_t file;
+        int taken = takeFile(&extract->queues[own], 0, &file);
+        for(int k = 1; !taken && k < extract->nbQueues; k++){
+            taken = takeFile(&extract->queues[(own + k) % extract->nbQueues], 1, &file);
+        }
+        if(!taken){
+            break;
+        }
+        const struct index_entry *entry = &archive->entries[extract->files[file]];
+        ssize_t len = safePath(entryName(archive, entry), path);
+        size_t lenDir = len > 0 ? dirLength(path) : 0;
+        /* files come in archive order, mostly a directory after the other */
+        if(len > 0 && (dirfd < 0 || strlen(dir) != lenDir || memcmp(dir, path, lenDir) != 0)){
+            if(dirfd >= 0){
+                close(dirfd);
+            }
+            dirfd = openDirs(extract->rootfd, path, lenDir, 1, EXTRACT_DIR_MODE);
+            memcpy(dir, path, lenDir);
+            dir[lenDir] = '\0';
+        }
+        if(len <= 0 || dirfd < 0 || extractFile(archive, entry, dirfd, path + (lenDir > 0 ? lenDir + 1 : 0)) < 0){
+            __atomic_fetch_add(&extract->nbFailed, 1, __ATOMIC_RELAXED);
+        }
+    }
+    if(dirfd >= 0){
+        close(dirfd);
+    }
+    return NULL;
+}
+
+/* Makes a symlink or a hard link, replacing what is at its path. */
+static int extractLink(tar_archive_t *archive, const struct index_entry *entry, int rootfd) {
+    char path[MAX_PATH];
+    char target[MAX_PATH];
+    ssize_t len = safePath(entryName(archive, entry), path);
+    const char *linkname = entryLinkname(archive, entry);
+    if(len <= 0){
+        return -1;
+    }
+    if(entry->typeflag == SYMTYPE && linkEscapes(path, linkname)){
+        return -1;
+    }
+    size_t lenDir = dirLength(path);
+    int dirfd = openDirs(rootfd, path, lenDir, 1, EXTRACT_DIR_MODE);
+    if(dirfd < 0){
+        return -1;
+    }
+    const char *leaf = path + (lenDir > 0 ? lenDir + 1 : 0);
+    int ret = -1;
+    unlinkat(dirfd, leaf, 0);
+    if(entry->typeflag == SYMTYPE){
+        ret = symlinkat(linkname, dirfd, leaf);
+    }else{
+        /* the target of a hard link is named from the top of the archive */
+        ssize_t lenTarget = safePath(linkname, target);
+        size_t lenTargetDir = lenTarget > 0 ? dirLength(target) : 0;
+        int targetfd = lenTarget > 0 ? openDirs(rootfd, target, lenTargetDir, 0, 0) : -1;
+        if(targetfd >= 0){
+            ret = linkat(targetfd, target + (lenTargetDir > 0 ? lenTargetDir + 1 : 0), dirfd, leaf, 0);
+            close(targetfd);
+        }
+    }
+    close(dirfd);
+    return ret;
+}
+
+/**
+ * Extracts the entries of an archive under a directory.
+ *
+ * @param archive A handle on an archive.
+ * @param dest_dir The directory to extract to, which must exist.
+ * @param nthreads The number of threads writing the files, zero or less for one per online CPU.
+ *
+ * @return the number of entries that could not be extracted, those refused for their path
+ *         or link target included, zero if all of them were, or -1 if dest_dir cannot be
+ *         opened or memory is short. Entries other than files, directories and links are
+ *         skipped, and a path present several times is extracted as the index resolves it.
+ */
+int tar_extract(tar_archive_t *archive, const char *dest_dir, int nthreads) {
+    int rootfd = open(dest_dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if(rootfd < 0){
+        return -1;
+    }
+    uint32_t *files = malloc((archive->nbEntries ? archive->nbEntries : 1) * sizeof(uint32_t));
+    if(files == NULL){
+        close(rootfd);
+        return -1;
+    }
+    char path[MAX_PATH];
+    size_t nbFiles = 0;
+    int nbFailed = 0;
+    for(size_t e = 0; e < archive->nbEntries; e++){
+        const struct index_entry *entry = &archive->entries[e];
+        const char *name = entryName(archive, entry);
+        if(findEntry(archive, name) != entry){
+            continue;             /* overwritten later in the archive */
+        }
+        if(entry->typeflag == REGTYPE || entry->typeflag == AREGTYPE){
+            files[nbFiles++] = e;
+        }else if(entry->typeflag == DIRTYPE){
+            mode_t mode;
+            struct timespec mtime;
+            ssize_t len = safePath(name, path);
+            int fd = -1;
+            if(len == 0){
+                continue;
+            }
+            if(len < 0 || entryMeta(archive, entry, &mode, &mtime) < 0
+               || (fd = openDirs(rootfd, path, len, 1, mode | 0700)) < 0){
+                nbFailed++;
+            }else{
+                close(fd);
+            }
+        }
+    }
+
+    if(nthreads <= 0){
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if((size_t) nthreads > nbFiles){
+        nthreads = nbFiles > 0 ? nbFiles : 1;
+    }
+    struct parallel_extract extract = {
+        .archive = archive,
+        .rootfd = rootfd,
+        .files = files,
+        .nbQueues = nthreads,
+    };
+    extract.queues = calloc(nthreads, sizeof(struct extract_queue));
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    if(extract.queues == NULL || threads == NULL){
+        free(extract.queues);
+        free(threads);
+        free(files);
+        close(rootfd);
+        return -1;
+    }
+    for(int q = 0; q < nthreads; q++){
+        pthread_mutex_init(&extract.queues[q].lock, NULL);
+        extract.queues[q].head = nbFiles * q / nthreads;
+        extract.queues[q].tail = nbFiles * (q + 1) / nthreads;
+    }
+    int nbStarted = 0;
+    while(nbStarted < nthreads - 1 && pthread_create(&threads[nbStarted], NULL, extractFiles, &extract) == 0){
+        nbStarted++;
+    }
+    extractFiles(&extract);
+    for(int i = 0; i < nbStarted; i++){
+        pthread_join(threads[i], NULL);
+    }
+    for(int q = 0; q < nthreads; q++){
+        pthread_mutex_destroy(&extract.queues[q].lock);
+    }
+    free(extract.queues);
+    free(threads);
+    nbFailed += extract.nbFailed;
+
+    /* hard links before symlinks, which could otherwise stand in the way of their targets */
+    size_t nbSymlinks = 0;
+    for(int pass = 0; pass < 2; pass++){
+        for(size_t e = 0; e < archive->nbEntries; e++){
+            const struct index_entry *entry = &archive->entries[e];
+            if(entry->typeflag != (pass == 0 ? LNKTYPE : SYMTYPE) || findEntry(archive, entryName(archive, entry)) != entry){
+                continue;
+            }
+            if(extractLink(archive, entry, rootfd) < 0){
+                nbFailed++;
+            }else if(pass == 1){
+                files[nbSymlinks++] = e;        /* the files are all written, reuse their list */
+            }
+        }
+    }
+    /* only now can a chain of symlinks be followed */
+    for(size_t i = 0; i < nbSymlinks; i++){
+        const struct index_entry *entry = &archive->entries[files[i]];
+        safePath(entryName(archive, entry), path);
+        if(linkLeaves(rootfd, path, entryLinkname(archive, entry))){
+            size_t lenDir = dirLength(path);
+            int dirfd = openDirs(rootfd, path, lenDir, 0, 0);
+            if(dirfd >= 0){
+                unlinkat(dirfd, path + (lenDir > 0 ? lenDir + 1 : 0), 0);
+                close(dirfd);
+            }
+            nbFailed++;
+        }
+    }
+    free(files);
+    close(rootfd);
+    return nbFailed;
+}
+
+/*
+ * Manifests
+ *
+ * tar_manifest() hashes the data of every regular file of a handle. The
+ * files are handed out one at a time, the largest first, to threads taking
+ * the next one with an atomic add, and each one is streamed once: straight
+ * from memory when the handle holds the archive there, through reads of
+ * MANIFEST_CHUNK bytes otherwise. The digests are kept per file and given
+ * to the callback in the order of the archive, from the calling thread,
+ * once all of them are known.
+ *
+ * CRC32C is computed with the crc32 instruction of SSE 4.2 when the CPU has
+ * it, and with slice-by-8 tables otherwise. XXH64 follows the xxHash
+ * specification, seed zero.
+ *
+ * A manifest file starts with a line naming the algorithm, then holds one
+ * line per file, "digest size offset path": the digest in hex, the path
+ * last with its backslashes and newlines escaped as \\ and \n.
+ */
+
+#define MANIFEST_CHUNK (256 << 10)
+#define MANIFEST_MAGIC "lib_tar manifest "
+#define CRC32C_POLY 0x82F63B78
+
+static uint32_t crc32cTables[8][256];
+static uint32_t (*crc32cKernel)(uint32_t crc, const uint8_t *data, size_t len);
+static pthread_once_t crc32cOnce = PTHREAD_ONCE_INIT;
+
+static uint32_t crc32cSlice8(uint32_t crc, const uint8_t *data, size_t len) {
+    while(len >= 8){
+        uint32_t low = crc ^ (data[0] | data[1] << 8 | data[2] << 16 | (uint32_t) data[3] << 24);
+        crc = crc32cTables[7][low & 0xFF] ^ crc32cTables[6][(low >> 8) & 0xFF]
+            ^ crc32cTables[5][(low >> 16) & 0xFF] ^ crc32cTables[4][low >> 24]
+            ^ crc32cTables[3][data[4]] ^ crc32cTables[2][data[5]]
+            ^ crc32cTables[1][data[6]] ^ crc32cTables[0][data[7]];
+        data += 8;
+        len -= 8;
+    }
+    while(len > 0){
+        crc = crc32cTables[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+        len--;
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32cSSE42(uint32_t crc, const uint8_t *data, size_t len) {
+    uint64_t crc64 = crc;
+    while(len >= 8){
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        len -= 8;
+    }
+    crc = crc64;
+    while(len > 0){
+        crc = _mm_crc32_u8(crc, *data++);
+        len--;
+    }
+    return crc;
+}
+#endif
+
+static void pickCrc32cKernel(void) {
+    for(uint32_t i = 0; i < 256; i++){
+        uint32_t crc = i;
+        for(int k = 0; k < 8; k++){
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc32cTables[0][i] = crc;
+    }
+    for(uint32_t i = 0; i < 256; i++){
+        for(int t = 1; t < 8; t++){
+            uint32_t prev = crc32cTables[t - 1][i];
+            crc32cTables[t][i] = (prev >> 8) ^ crc32cTables[0][prev & 0xFF];
+        }
+    }
+    crc32cKernel = crc32cSlice8;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse4.2")){
+        crc32cKernel = crc32cSSE42;
+    }
+#endif
+}
+
+#define XXH_PRIME1 11400714785074694791ull
+#define XXH_PRIME2 14029467366897019727ull
+#define XXH_PRIME3 1609587929392839161ull
+#define XXH_PRIME4 9650029242287828579ull
+#define XXH_PRIME5 2870177450012600261ull
+
+static uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t readLE64(const uint8_t *p) {
+    uint64_t v = 0;
+    for(int i = 7; i >= 0; i--){
+        v = v << 8 | p[i];
+    }
+    return v;
+}
+
+static uint32_t readLE32(const uint8_t *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static uint64_t xxhRound(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME2;
+    return rotl64(acc, 31) * XXH_PRIME1;
+}
+
+static uint64_t xxhMerge(uint64_t acc, uint64_t value) {
+    acc ^= xxhRound(0, value);
+    return acc * XXH_PRIME1 + XXH_PRIME4;
+}
+
+struct hash_state {
+    int algo;
+    uint32_t crc;
+    uint64_t acc[4];
+    uint8_t stripe[32];           /* input not yet folded in the accumulators */
+    size_t lenStripe;
+    uint64_t total;
+};
+
+static void hashInit(struct hash_state *h, int algo) {
+    h->algo = algo;
+    h->crc = 0xFFFFFFFF;
+    h->acc[0] = XXH_PRIME1 + XXH_PRIME2;
+    h->acc[1] = XXH_PRIME2;
+    h->acc[2] = 0;
+    h->acc[3] = -XXH_PRIME1;
+    h->lenStripe = 0;
+    h->total = 0;
+}
+
+static void xxhStripe(uint64_t *acc, const uint8_t *p) {
+    for(int i = 0; i < 4; i++){
+        acc[i] = xxhRound(acc[i], readLE64(p + 8 * i));
+    }
+}
+
+static void hashUpdate(struct hash_state *h, const uint8_t *data, size_t len) {
+    if(h->algo == TAR_HASH_CRC32C){
+        h->crc = crc32cKernel(h->crc, data, len);
+        return;
+    }
+    h->total += len;
+    if(h->lenStripe > 0){
+        size_t fill = 32 - h->lenStripe < len ? 32 - h->lenStripe : len;
+        memcpy(h->stripe + h->lenStripe, data, fill);
+        h->lenStripe += fill;
+        data += fill;
+        len -= fill;
+        if(h->lenStripe < 32){
+            return;
+        }
+        xxhStripe(h->acc, h->stripe);
+        h->lenStripe = 0;
+    }
+    while(len >= 32){
+        xxhStripe(h->acc, data);
+        data += 32;
+        len -= 32;
+    }
+    memcpy(h->stripe, data, len);
+    h->lenStripe = len;
+}
+
+static uint64_t hashFinal(const struct hash_state *h) {
+    if(h->algo == TAR_HASH_CRC32C){
+        return h->crc ^ 0xFFFFFFFF;
+    }
+    uint64_t hash;
+    if(h->total >= 32){
+        hash = rotl64(h->acc[0], 1) + rotl64(h->acc[1], 7) + rotl64(h->acc[2], 12) + rotl64(h->acc[3], 18);
+        for(int i = 0; i < 4; i++){
+            hash = xxhMerge(hash, h->acc[i]);
+        }
+    }else{
+        hash = XXH_PRIME5;
+    }
+    hash += h->total;
+    const uint8_t *p = h->stripe;
+    size_t len = h->lenStripe;
+    while(len >= 8){
+        hash ^= xxhRound(0, readLE64(p));
+        hash = rotl64(hash, 27) * XXH_PRIME1 + XXH_PRIME4;
+        p += 8;
+        len -= 8;
+    }
+    if(len >= 4){
+        hash ^= readLE32(p) * XXH_PRIME1;
+        hash = rotl64(hash, 23) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+        len -= 4;
+    }
+    while(len > 0){
+        hash ^= *p++ * XXH_PRIME5;
+        hash = rotl64(hash, 11) * XXH_PRIME1;
+        len--;
+    }
+    hash ^= hash >> 33;
+    hash *= XXH_PRIME2;
+    hash ^= hash >> 29;
+    hash *= XXH_PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+struct parallel_hash {
+    tar_archive_t *archive;
+    int algo;
+    const uint32_t *files;        /* entry indexes, in the order of the archive */
+    const uint32_t *order;        /* positions in files, the largest file first */
+    size_t nbFiles;
+    size_t next;                  /* the next position in order, taken with an atomic add */
+    uint64_t *digests;            /* per position in files */
+    int failed;
+};
+
+static int compareSizes(const void *a, const void *b, void *arg) {
+    const struct parallel_hash *hash = arg;
+    uint64_t sizeA = hash->archive->entries[hash->files[*(const uint32_t *) a]].size;
+    uint64_t sizeB = hash->archive->entries[hash->files[*(const uint32_t *) b]].size;
+    return sizeA < sizeB ? 1 : sizeA > sizeB ? -1 : 0;
+}
+
+static void *hashFiles(void *arg) {
+    struct parallel_hash *hash = arg;
+    tar_archive_t *archive = hash->archive;
+    uint8_t *buf = NULL;
+    for(;;){
+        size_t next = __atomic_fetch_add(&hash->next, 1, __ATOMIC_RELAXED);
+        if(next >= hash->nbFiles){
+            break;
+        }
+        uint32_t pos = hash->order[next];
+        const struct index_entry *entry = &archive->entries[hash->files[pos]];
+        struct hash_state state;
+        hashInit(&state, hash->algo);
+        if(archive->base != NULL && archive->checkpoints == NULL){
+            if(entry->data_offset > archive->lenBase || entry->size > archive->lenBase - entry->data_offset){
+                __atomic_store_n(&hash->failed, 1, __ATOMIC_RELAXED);
+                continue;
+            }
+            hashUpdate(&state, archive->base + entry->data_offset, entry->size);
+        }else{
+            if(buf == NULL && (buf = malloc(MANIFEST_CHUNK)) == NULL){
+                __atomic_store_n(&hash->failed, 1, __ATOMIC_RELAXED);
+                break;
+            }
+            uint64_t done = 0;
+            while(done < entry->size){
+                size_t len = entry->size - done < MANIFEST_CHUNK ? entry->size - done : MANIFEST_CHUNK;
+                ssize_t nbRead = readAt(archive, buf, len, entry->data_offset + done);
+                if(nbRead <= 0){
+                    __atomic_store_n(&hash->failed, 1, __ATOMIC_RELAXED);
+                    break;
+                }
+                hashUpdate(&state, buf, nbRead);
+                done += nbRead;
+            }
+        }
+        hash->digests[pos] = hashFinal(&state);
+    }
+    free(buf);
+    return NULL;
+}
+
+/* Hashes every regular file of a handle. On success, *files holds their entry indexes in
+ * the order of the archive and *digests their digests, both to be freed by the caller.
+ * Returns the number of files, -1 if out of memory, -2 if a file could not be read. */
+static ssize_t hashArchive(tar_archive_t *archive, int algo, int nthreads, uint32_t **files, uint64_t **digests) {
+    pthread_once(&crc32cOnce, pickCrc32cKernel);
+    struct parallel_hash hash = {
+        .archive = archive,
+        .algo = algo,
+    };
+    uint32_t *list = malloc((archive->nbEntries + 1) * sizeof(uint32_t));
+    uint32_t *order = malloc((archive->nbEntries + 1) * sizeof(uint32_t));
+    hash.digests = malloc((archive->nbEntries + 1) * sizeof(uint64_t));
+    if(list == NULL || order == NULL || hash.digests == NULL){
+        free(list);
+        free(order);
+        free(hash.digests);
+        return -1;
+    }
+    for(size_t e = 0; e < archive->nbEntries; e++){
+        char type = archive->entries[e].typeflag;
+        if(type == REGTYPE || type == AREGTYPE){
+            order[hash.nbFiles] = hash.nbFiles;
+            list[hash.nbFiles++] = e;
+        }
+    }
+    hash.files = list;
+    hash.order = order;
+    qsort_r(order, hash.nbFiles, sizeof(uint32_t), compareSizes, &hash);
+    if(nthreads <= 0){
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if((size_t) nthreads > hash.nbFiles){
+        nthreads = hash.nbFiles > 0 ? hash.nbFiles : 1;
+    }
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    int nbStarted = 0;
+    while(threads != NULL && nbStarted < nthreads - 1 && pthread_create(&threads[nbStarted], NULL, hashFiles, &hash) == 0){
+        nbStarted++;
+    }
+    hashFiles(&hash);
+    for(int i = 0; i < nbStarted; i++){
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    free(order);
+    if(hash.failed){
+        free(list);
+        free(hash.digests);
+        return -2;
+    }
+    *files = list;
+    *digests = hash.digests;
+    return hash.nbFiles;
+}
+
+static const char *hashName(int algo) {
+    return algo == TAR_HASH_CRC32C ? "crc32c" : algo == TAR_HASH_XXH64 ? "xxh64" : NULL;
+}
+
+/**
+ * Hashes the data of every regular file of an archive.
+ *
+ * @param archive A handle on an archive.
+ * @param algo TAR_HASH_CRC32C or TAR_HASH_XXH64.
+ * @param nthreads The number of threads hashing the files, zero or less for one per online CPU.
+ * @param fn Called with each file and its digest, in the order of the archive, and arg.
+ *           Returning non-zero stops the calls.
+ * @param arg Passed to fn as it is.
+ *
+ * @return the number of files passed to fn, -1 if algo is unknown or memory is short,
+ *         -2 if a file could not be read.
+ */
+ssize_t tar_manifest(tar_archive_t *archive, int algo, int nthreads, tar_manifest_fn fn, void *arg) {
+    if(hashName(algo) == NULL){
+        return -1;
+    }
+    uint32_t *files;
+    uint64_t *digests;
+    ssize_t nbFiles = hashArchive(archive, algo, nthreads, &files, &digests);
+    if(nbFiles < 0){
+        return nbFiles;
+    }
+    ssize_t nbCalled = 0;
+    while(nbCalled < nbFiles){
+        const struct index_entry *entry = &archive->entries[files[nbCalled]];
+        tar_manifest_entry_t found = {
+            .path = entryName(archive, entry),
+            .size = entry->size,
+            .offset = entry->data_offset,
+            .digest = digests[nbCalled],
+        };
+        nbCalled++;
+        if(fn(&found, arg) != 0){
+            break;
+        }
+    }
+    free(files);
+    free(digests);
+    return nbCalled;
+}
+
+static int writeManifestLine(const tar_manifest_entry_t *entry, void *arg) {
+    FILE *out = arg;
+    fprintf(out, "%016llx %llu %llu ", (unsigned long long) entry->digest,
+            (unsigned long long) entry->size, (unsigned long long) entry->offset);
+    for(const char *c = entry->path; *c != '\0'; c++){
+        if(*c == '\\'){
+            fputs("\\\\", out);
+        }else if(*c == '\n'){
+            fputs("\\n", out);
+        }else{
+            putc(*c, out);
+        }
+    }
+    putc('\n', out);
+    return ferror(out);
+}
+
+/**
+ * Writes the manifest of an archive, as tar_manifest() computes it, to a file descriptor.
+ *
+ * @param archive A handle on an archive.
+ * @param algo TAR_HASH_CRC32C or TAR_HASH_XXH64.
+ * @param nthreads The number of threads hashing the files, zero or less for one per online CPU.
+ * @param out_fd Where to write the manifest, from its current offset.
+ *
+ * @return the number of files in the manifest, -1 if algo is unknown or memory is short,
+ *         -2 if a file could not be read, -3 if the manifest could not be written.
+ */
+ssize_t tar_manifest_write(tar_archive_t *archive, int algo, int nthreads, int out_fd) {
+    if(hashName(algo) == NULL){
+        return -1;
+    }
+    int fd = dup(out_fd);
+    FILE *out = fd < 0 ? NULL : fdopen(fd, "w");
+    if(out == NULL){
+        if(fd >= 0){
+            close(fd);
+        }
+        return -3;
+    }
+    fprintf(out, MANIFEST_MAGIC "%s\n", hashName(algo));
+    ssize_t nbFiles = tar_manifest(archive, algo, nthreads, writeManifestLine, out);
+    if(ferror(out) && nbFiles >= 0){
+        nbFiles = -3;
+    }
+    if(fclose(out) != 0 && nbFiles >= 0){
+        nbFiles = -3;
+    }
+    return nbFiles;
+}
+
+struct manifest_line {
+    const char *path;
+    uint64_t size;
+    uint64_t offset;
+    uint64_t digest;
+};
+
+static int compareLines(const void *a, const void *b) {
+    const struct manifest_line *lineA = a, *lineB = b;
+    int diff = strcmp(lineA->path, lineB->path);
+    if(diff != 0){
+        return diff;
+    }
+    /* the copies of a path follow each other in the archive */
+    return lineA->offset < lineB->offset ? -1 : lineA->offset > lineB->offset;
+}
+
+/* Reads a whole manifest and splits it into lines, the paths unescaped in place. Returns
+ * the number of lines and sets *algo, or -1 if the manifest is malformed or memory short. */
+static ssize_t parseManifest(int fd, char **text, struct manifest_line **lines, int *algo) {
+    size_t len = 0, cap = 1 << 16;
+    char *buf = malloc(cap);
+    ssize_t nbRead = 0;
+    while(buf != NULL && (nbRead = read(fd, buf + len, cap - 1 - len)) > 0){
+        len += nbRead;
+        if(len == cap - 1){
+            char *bigger = realloc(buf, cap * 2);
+            if(bigger == NULL){
+                free(buf);
+            }
+            buf = bigger;
+            cap *= 2;
+        }
+    }
+    if(buf == NULL || nbRead < 0){
+        free(buf);
+        return -1;
+    }
+    buf[len] = '\0';
+    size_t nbLines = 0;
+    for(size_t i = 0; i < len; i++){
+        nbLines += buf[i] == '\n';
+    }
+    *lines = malloc((nbLines + 1) * sizeof(struct manifest_line));
+    char *line = buf;
+    char *end = strchr(line, '\n');
+    *algo = 0;
+    if(*lines != NULL && end != NULL && strncmp(line, MANIFEST_MAGIC, strlen(MANIFEST_MAGIC)) == 0){
+        *end = '\0';
+        const char *name = line + strlen(MANIFEST_MAGIC);
+        *algo = strcmp(name, "crc32c") == 0 ? TAR_HASH_CRC32C : strcmp(name, "xxh64") == 0 ? TAR_HASH_XXH64 : 0;
+    }
+    if(*algo == 0){
+        free(*lines);
+        free(buf);
+        return -1;
+    }
+    ssize_t nb = 0;
+    int malformed = 0;
+    for(line = end + 1; *line != '\0' && !malformed; line = end + 1){
+        end = strchr(line, '\n');
+        if(end == NULL){
+            malformed = 1;
+            break;
+        }
+        *end = '\0';
+        struct manifest_line *parsed = &(*lines)[nb];
+        char *field;
+        errno = 0;
+        parsed->digest = strtoull(line, &field, 16);
+        parsed->size = strtoull(field, &field, 10);
+        parsed->offset = strtoull(field, &field, 10);
+        if(errno != 0 || field == line || *field != ' '){
+            malformed = 1;
+            break;
+        }
+        /* unescape the path where it lies */
+        char *out = field + 1;
+        parsed->path = out;
+        for(char *in = field + 1; *in != '\0'; in++){
+            if(*in == '\\' && (in[1] == '\\' || in[1] == 'n')){
+                in++;
+                *out++ = *in == 'n' ? '\n' : '\\';
+            }else{
+                *out++ = *in;
+            }
+        }
+        *out = '\0';
+        nb++;
+    }
+    if(malformed){
+        free(*lines);
+        free(buf);
+        return -1;
+    }
+    *text = buf;
+    return nb;
+}
+
+/**
+ * Checks an archive against a manifest written by tar_manifest_write().
+ *
+ * @param archive A handle on an archive.
+ * @param manifest_fd The manifest, read from its current offset to its end.
+ * @param nthreads The number of threads hashing the files, zero or less for one per online CPU.
+ * @param fn Called with the path of each difference and its kind, TAR_VERIFY_CHANGED,
+ *           TAR_VERIFY_MISSING or TAR_VERIFY_ADDED, and arg, or NULL.
+ * @param arg Passed to fn as it is.
+ *
+ * @return the number of differences, zero if the archive matches the manifest,
+ *         -1 if the manifest is malformed or memory is short, -2 if a file could not be read.
+ */
+ssize_t tar_manifest_verify(tar_archive_t *archive, int manifest_fd, int nthreads, tar_verify_fn fn, void *arg) {
+    char *text;
+    struct manifest_line *expected;
+    int algo;
+    ssize_t nbExpected = parseManifest(manifest_fd, &text, &expected, &algo);
+    if(nbExpected < 0){
+        return -1;
+    }
+    uint32_t *files;
+    uint64_t *digests;
+    ssize_t nbFiles = hashArchive(archive, algo, nthreads, &files, &digests);
+    struct manifest_line *found = nbFiles < 0 ? NULL : malloc((nbFiles + 1) * sizeof(struct manifest_line));
+    if(found == NULL){
+        if(nbFiles >= 0){
+            free(files);
+            free(digests);
+        }
+        free(expected);
+        free(text);
+        return nbFiles < 0 ? nbFiles : -1;
+    }
+    for(ssize_t f = 0; f < nbFiles; f++){
+        const struct index_entry *entry = &archive->entries[files[f]];
+        found[f] = (struct manifest_line) {
+            .path = entryName(archive, entry),
+            .size = entry->size,
+            .offset = entry->data_offset,
+            .digest = digests[f],
+        };
+    }
+    free(files);
+    free(digests);
+    qsort(expected, nbExpected, sizeof(struct manifest_line), compareLines);
+    qsort(found, nbFiles, sizeof(struct manifest_line), compareLines);
+    /* both sorted by path, the copies of a path paired in the order of the archive */
+    ssize_t nbDiffs = 0, e = 0, f = 0;
+    while(e < nbExpected || f < nbFiles){
+        int diff = e == nbExpected ? 1 : f == nbFiles ? -1 : strcmp(expected[e].path, found[f].path);
+        const char *path;
+        int what = 0;
+        if(diff < 0){
+            path = expected[e++].path;
+            what = TAR_VERIFY_MISSING;
+        }else if(diff > 0){
+            path = found[f++].path;
+            what = TAR_VERIFY_ADDED;
+        }else{
+            path = found[f].path;
+            if(expected[e].size != found[f].size || expected[e].digest != found[f].digest){
+                what = TAR_VERIFY_CHANGED;
+            }
+            e++;
+            f++;
+        }
+        if(what != 0){
+            nbDiffs++;
+            if(fn != NULL){
+                fn(path, what, arg);
+            }
+        }
+    }
+    free(found);
+    free(expected);
+    free(text);
+    return nbDiffs;
+}
+
+/*
+ * Union of layers
+ *
+ * A stack of archives seen as one tree, the way container images stack
+ * their layers: a path in a layer hides the same path in the layers below,
+ * a ".wh.NAME" entry removes NAME and what lies under it from the layers
+ * below, and a ".wh..wh..opq" entry makes its directory opaque, hiding what
+ * the layers below hold in it. Each layer is indexed by tar_open(), then
+ * the layers are merged from the top down into one table: a path is kept
+ * unless an upper layer already claimed it, whited it out, made one of its
+ * directories opaque, or holds something other than a directory at one of
+ * its directories. A query then costs one lookup in that table.
+ *
+ * Paths are kept without their trailing slash, so "dir" and "dir/" name the
+ * same directory.
+ */
+
+#define WHITEOUT_PREFIX ".wh."
+#define WHITEOUT_OPAQUE ".wh..wh..opq"
+
+enum {
+    UNION_ENTRY,                  /* an entry of one of the layers */
+    UNION_WHITEOUT,               /* a path removed from the layers below */
+    UNION_OPAQUE                  /* a directory hiding what the layers below hold in it */
+};
+
+struct union_node {
+    uint64_t path;                /* offset in the string pool of the union */
+    uint32_t len;
+    uint32_t hash;
+    int kind;
+    int layer;
+    uint32_t entry;               /* index in the layer, for UNION_ENTRY */
+    uint32_t first_child;         /* for a directory, the first node in it, or INDEX_NONE */
+    uint32_t next_sibling;
+};
+
+struct tar_union {
+    tar_archive_t **layers;       /* from the bottom up */
+    int nbLayers;
+    struct union_node *nodes;
+    size_t nbNodes;
+    size_t capNodes;
+    uint32_t *slots;              /* node index + 1, or INDEX_EMPTY */
+    size_t nbSlots;               /* a power of two */
+    char *strings;
+    size_t lenStrings;
+    size_t capStrings;
+    uint32_t rootChild;
+};
+
+/* The hash of a path in a given namespace: the opaque markers live apart from the paths. */
+static uint32_t unionHash(const char *path, size_t len, int kind) {
+    return hashPath(path, len) ^ (kind == UNION_OPAQUE ? 0x9e3779b9u : 0);
+}
+
+static const char *nodePath(const struct tar_union *u, const struct union_node *node) {
+    return u->strings + node->path;
+}
+
+static struct union_node *unionFind(const struct tar_union *u, const char *path, size_t len, int opaque) {
+    uint32_t hash = unionHash(path, len, opaque ? UNION_OPAQUE : UNION_ENTRY);
+    size_t mask = u->nbSlots - 1;
+    for(size_t i = hash & mask; u->slots[i] != INDEX_EMPTY; i = (i + 1) & mask){
+        struct union_node *node = &u->nodes[u->slots[i] - 1];
+        if(node->hash == hash && node->len == len && (node->kind == UNION_OPAQUE) == opaque
+           && memcmp(nodePath(u, node), path, len) == 0){
+            return node;
+        }
+    }
+    return NULL;
+}
+
+static int unionGrowSlots(struct tar_union *u) {
+    size_t nbSlots = u->nbSlots ? u->nbSlots * 2 : 1024;
+    uint32_t *slots = calloc(nbSlots, sizeof(uint32_t));
+    if(slots == NULL){
+        return -1;
+    }
+    for(size_t n = 0; n < u->nbNodes; n++){
+        size_t i = u->nodes[n].hash & (nbSlots - 1);
+        while(slots[i] != INDEX_EMPTY){
+            i = (i + 1) & (nbSlots - 1);
+        }
+        slots[i] = n + 1;
+    }
+    free(u->slots);
+    u->slots = slots;
+    u->nbSlots = nbSlots;
+    return 0;
+}
+
+static int unionAdd(struct tar_union *u, const char *path, size_t len, int kind, int layer, uint32_t entry) {
+    if((u->nbNodes + 1) * 2 > u->nbSlots && unionGrowSlots(u) < 0){
+        return -1;
+    }
+    if(u->nbNodes == u->capNodes){
+        size_t cap = u->capNodes ? u->capNodes * 2 : 256;
+        struct union_node *nodes = realloc(u->nodes, cap * sizeof(struct union_node));
+        if(nodes == NULL){
+            return -1;
+        }
+        u->nodes = nodes;
+        u->capNodes = cap;
+    }
+    if(u->lenStrings + len + 1 > u->capStrings){
+        size_t cap = u->capStrings ? u->capStrings * 2 : 4096;
+        while(cap < u->lenStrings + len + 1){
+            cap *= 2;
+        }
+        char *strings = realloc(u->strings, cap);
+        if(strings == NULL){
+            return -1;
+        }
+        u->strings = strings;
+        u->capStrings = cap;
+    }
+    struct union_node *node = &u->nodes[u->nbNodes];
+    node->path = u->lenStrings;
+    memcpy(u->strings + u->lenStrings, path, len);
+    u->strings[u->lenStrings + len] = '\0';
+    u->lenStrings += len + 1;
+    node->len = len;
+    node->hash = unionHash(path, len, kind);
+    node->kind = kind;
+    node->layer = layer;
+    node->entry = entry;
+    node->first_child = INDEX_NONE;
+    node->next_sibling = INDEX_NONE;
+    size_t i = node->hash & (u->nbSlots - 1);
+    while(u->slots[i] != INDEX_EMPTY){
+        i = (i + 1) & (u->nbSlots - 1);
+    }
+    u->slots[i] = ++u->nbNodes;
+    return 0;
+}
+
+static const struct index_entry *nodeEntry(const struct tar_union *u, const struct union_node *node) {
+    return &u->layers[node->layer]->entries[node->entry];
+}
+
+/* Whether a path of the given layer is hidden by a layer above through one of its directories. */
+static int hiddenAbove(const struct tar_union *u, const char *path, size_t len, int layer) {
+    for(size_t end = 0; end < len; end++){
+        if(path[end] != '/'){
+            continue;
+        }
+        const struct union_node *node = unionFind(u, path, end, 0);
+        if(node != NULL && node->layer > layer
+           && (node->kind == UNION_WHITEOUT || nodeEntry(u, node)->typeflag != DIRTYPE)){
+            return 1;
+        }
+        node = unionFind(u, path, end, 1);
+        if(node != NULL && node->layer > layer){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Merges the entries of one layer below those already merged. */
+static int unionMergeLayer(struct tar_union *u, int layer) {
+    tar_archive_t *archive = u->layers[layer];
+    char path[MAX_PATH];
+    for(size_t e = 0; e < archive->nbEntries; e++){
+        const struct index_entry *entry = &archive->entries[e];
+        const char *name = entryName(archive, entry);
+        if(findEntry(archive, name) != entry){
+            continue;             /* a later entry of the same name */
+        }
+        size_t len = strlen(name);
+        while(len > 0 && name[len - 1] == '/'){
+            len--;
+        }
+        if(len == 0 || len >= MAX_PATH){
+            continue;
+        }
+        size_t lenDir = len;
+        while(lenDir > 0 && name[lenDir - 1] != '/'){
+            lenDir--;
+        }
+        const char *base = name + lenDir;
+        size_t lenBase = len - lenDir;
+        int kind = UNION_ENTRY;
+        memcpy(path, name, len);
+        if(lenBase == strlen(WHITEOUT_OPAQUE) && memcmp(base, WHITEOUT_OPAQUE, lenBase) == 0){
+            kind = UNION_OPAQUE;
+            len = lenDir > 0 ? lenDir - 1 : 0;
+        }else if(lenBase > strlen(WHITEOUT_PREFIX) && memcmp(base, WHITEOUT_PREFIX, strlen(WHITEOUT_PREFIX)) == 0){
+            kind = UNION_WHITEOUT;
+            memmove(path + lenDir, base + strlen(WHITEOUT_PREFIX), lenBase - strlen(WHITEOUT_PREFIX));
+            len -= strlen(WHITEOUT_PREFIX);
+        }
+        if(len == 0 || hiddenAbove(u, path, len, layer) || unionFind(u, path, len, kind == UNION_OPAQUE) != NULL){
+            continue;             /* claimed or hidden by a layer above, or already merged */
+        }
+        if(unionAdd(u, path, len, kind, layer, e) < 0){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Links every entry to the directory holding it, for list_u(). */
+static void unionBuildTree(struct tar_union *u) {
+    uint32_t *lastChild = NULL;
+    uint32_t rootLast = INDEX_NONE;
+    u->rootChild = INDEX_NONE;
+    lastChild = malloc((u->nbNodes ? u->nbNodes : 1) * sizeof(uint32_t));
+    for(size_t n = 0; n < u->nbNodes; n++){
+        if(lastChild != NULL){
+            lastChild[n] = INDEX_NONE;
+        }
+    }
+    for(size_t n = 0; n < u->nbNodes && lastChild != NULL; n++){
+        struct union_node *node = &u->nodes[n];
+        if(node->kind != UNION_ENTRY){
+            continue;
+        }
+        const char *path = nodePath(u, node);
+        size_t lenDir = node->len;
+        while(lenDir > 0 && path[lenDir - 1] != '/'){
+            lenDir--;
+        }
+        uint32_t *first;
+        uint32_t *last;
+        if(lenDir == 0){
+            first = &u->rootChild;
+            last = &rootLast;
+        }else{
+            struct union_node *parent = unionFind(u, path, lenDir - 1, 0);
+            if(parent == NULL || parent->kind != UNION_ENTRY || nodeEntry(u, parent)->typeflag != DIRTYPE){
+                continue;
+            }
+            first = &parent->first_child;
+            last = &lastChild[parent - u->nodes];
+        }
+        if(*last == INDEX_NONE){
+            *first = n;
+        }else{
+            u->nodes[*last].next_sibling = n;
+        }
+        *last = n;
+    }
+    free(lastChild);
+}
+
+/**
+ * Opens a stack of archives as one tree.
+ *
+ * @param fds File descriptors pointing to tar archives, from the bottom layer up. Each is
+ *            indexed as tar_open() does and must stay open until tar_union_close().
+ * @param n The number of layers.
+ *
+ * @return the union, or NULL if one of the layers could not be read or memory is short.
+ */
+tar_union_t *tar_union_open(int *fds, int n) {
+    tar_union_t *u = calloc(1, sizeof(tar_union_t));
+    if(u == NULL || (u->layers = calloc(n > 0 ? n : 1, sizeof(tar_archive_t *))) == NULL || unionGrowSlots(u) < 0){
+        tar_union_close(u);
+        return NULL;
+    }
+    for(u->nbLayers = 0; u->nbLayers < n; u->nbLayers++){
+        u->layers[u->nbLayers] = tar_open(fds[u->nbLayers]);
+        if(u->layers[u->nbLayers] == NULL){
+            tar_union_close(u);
+            return NULL;
+        }
+    }
+    for(int layer = n - 1; layer >= 0; layer--){
+        if(unionMergeLayer(u, layer) < 0){
+            tar_union_close(u);
+            return NULL;
+        }
+    }
+    unionBuildTree(u);
+    return u;
+}
+
+/**
+ * Releases a union and the indexes of its layers. Their file descriptors are left open.
+ *
+ * @param u A union, or NULL.
+ */
+void tar_union_close(tar_union_t *u) {
+    if(u == NULL){
+        return;
+    }
+    for(int layer = 0; layer < u->nbLayers; layer++){
+        tar_close(u->layers[layer]);
+    }
+    free(u->layers);
+    free(u->nodes);
+    free(u->slots);
+    free(u->strings);
+    free(u);
+}
+
+/* The entry at path in the union, with or without its trailing slash. */
+static const struct union_node *unionEntry(const tar_union_t *u, const char *path) {
+    size_t len = strlen(path);
+    while(len > 0 && path[len - 1] == '/'){
+        len--;
+    }
+    const struct union_node *node = unionFind(u, path, len, 0);
+    return node != NULL && node->kind == UNION_ENTRY ? node : NULL;
+}
+
+static const struct union_node *unionLookup(const tar_union_t *u, const char *path, int hops);
+
+/* Where a symlink of the union finally leads, or the node itself if it is not a symlink. */
+static const struct union_node *unionResolve(const tar_union_t *u, const struct union_node *node, int hops) {
+    char target[MAX_PATH];
+    while(node != NULL && nodeEntry(u, node)->typeflag == SYMTYPE){
+        const char *path = nodePath(u, node);
+        if(hops++ >= MAX_HOPS || foldPath(path, dirLength(path), entryLinkname(u->layers[node->layer], nodeEntry(u, node)), target) < 0){
+            return NULL;
+        }
+        node = unionLookup(u, target, hops);
+    }
+    return node;
+}
+
+/* The entry at path, or, when there is none, the entry path leads to through the links
+ * among its leading directories. */
+static const struct union_node *unionLookup(const tar_union_t *u, const char *path, int hops) {
+    const struct union_node *node = unionEntry(u, path);
+    if(node != NULL || strchr(path, '/') == NULL){
+        return node;
+    }
+    char walked[MAX_PATH];
+    char rest[MAX_PATH];
+    size_t len = 0;
+    const char *component = path;
+    while(*component != '\0'){
+        const char *end = strchrnul(component, '/');
+        if(end == component){
+            component++;
+            continue;
+        }
+        if(len + 1 + (end - component) >= MAX_PATH){
+            return NULL;
+        }
+        if(len > 0){
+            walked[len++] = '/';
+        }
+        memcpy(walked + len, component, end - component);
+        len += end - component;
+        walked[len] = '\0';
+        node = unionEntry(u, walked);
+        if(node != NULL && *end != '\0' && nodeEntry(u, node)->typeflag == SYMTYPE){
+            /* carry on from where the link leads */
+            node = unionResolve(u, node, hops);
+            if(node == NULL || snprintf(rest, sizeof(rest), "%s%s", nodePath(u, node), end) >= (int) sizeof(rest)){
+                return NULL;
+            }
+            return unionLookup(u, rest, hops + 1);
+        }
+        component = end;
+    }
+    return node;
+}
+
+/**
+ * Same as exists(), answered from the merged layers.
+ */
+int exists_u(tar_union_t *u, char *path) {
+    return unionEntry(u, path) != NULL;
+}
+
+/**
+ * Same as is_dir(), answered from the merged layers.
+ */
+int is_dir_u(tar_union_t *u, char *path) {
+    const struct union_node *node = unionEntry(u, path);
+    return node != NULL && nodeEntry(u, node)->typeflag == DIRTYPE;
+}
+
+/**
+ * Same as is_file(), answered from the merged layers.
+ */
+int is_file_u(tar_union_t *u, char *path) {
+    const struct union_node *node = unionEntry(u, path);
+    return node != NULL && (nodeEntry(u, node)->typeflag == REGTYPE || nodeEntry(u, node)->typeflag == AREGTYPE);
+}
+
+/**
+ * Same as is_symlink(), answered from the merged layers.
+ */
+int is_symlink_u(tar_union_t *u, char *path) {
+    const struct union_node *node = unionEntry(u, path);
+    return node != NULL && nodeEntry(u, node)->typeflag == SYMTYPE;
+}
+
+/**
+ * Same as list(), answered from the merged layers: the entries of a directory come from
+ * every layer that holds it and is not hidden, the upper layers first.
+ */
+int list_u(tar_union_t *u, char *path, char **entries, size_t *no_entries) {
+    uint32_t next = u->rootChild;
+    if(path[0] != '\0'){
+        const struct union_node *dir = unionResolve(u, unionLookup(u, path, 0), 0);
+        if(dir == NULL || nodeEntry(u, dir)->typeflag != DIRTYPE){
+            *no_entries = 0;
+            return 0;
+        }
+        next = dir->first_child;
+    }
+    size_t index = 0;
+    while(index < *no_entries && next != INDEX_NONE){
+        const struct union_node *node = &u->nodes[next];
+        copyListed(entries[index++], entryName(u->layers[node->layer], nodeEntry(u, node)));
+        next = u->nodes[next].next_sibling;
+    }
+    *no_entries = index;
+    return 1;
+}
+
 /**
- * Checks whether the archive is valid.
- *
- * Each non-null header of a valid archive has:
- *  - a magic value of "ustar" and a null,
- *  - a version value of "00" and no null,
- *  - a correct checksum
+ * Same as read_file(), the file is read from the layer holding its winning entry. Symlinks
+ * and hard links are resolved in the merged tree.
+ */
+ssize_t read_file_u(tar_union_t *u, char *path, size_t offset, uint8_t *dest, size_t *len) {
+    const struct union_node *node = unionResolve(u, unionLookup(u, path, 0), 0);
+    if(node != NULL && nodeEntry(u, node)->typeflag == LNKTYPE){
+        node = unionResolve(u, unionEntry(u, entryLinkname(u->layers[node->layer], nodeEntry(u, node))), 0);
+    }
+    if(node == NULL || (nodeEntry(u, node)->typeflag != REGTYPE && nodeEntry(u, node)->typeflag != AREGTYPE)){
+        return -1;
+    }
+    return readEntry(u->layers[node->layer], nodeEntry(u, node), offset, dest, len);
+}
+
+/*
+ * Sidecar index
  *
- * @param tar_fd A file descriptor pointing to the start of a file supposed to contain a tar archive.
+ * The tables of a handle can be saved next to the archive and mapped back
+ * at open time, so that a large archive serves queries without being
+ * scanned again. The file holds a header, then the entries, the hash slots,
+ * the entries sorted by path and the string pool, each section aligned on
+ * 8 bytes and stored in the byte order of the machine that wrote it.
  *
- * @return a zero or positive value if the archive is valid, representing the number of headers in the archive,
- *         -1 if the archive contains a header with an invalid magic value,
- *         -2 if the archive contains a header with an invalid version value,
- *         -3 if the archive contains a header with an invalid checksum value
+ * The index is stale, and rebuilt, when the archive size or modification
+ * time changed, or when its first or last indexed header no longer hashes
+ * to the recorded value.
  */
-int check_archive(int tar_fd) {
-    int nbHeaders = 0;
-    struct posix_header *header = malloc(sizeof(struct posix_header));
-    while(read(tar_fd,header, sizeof(struct posix_header))>0){
-        long sum = 0;
-        for(int i =0; i<512;i++){
-            if(i>=148&&i<156){
-                sum += ' ';
-            }else{
-                char* c = (char*) header+i;
-                sum += *c;
-            }
 
+#define SIDECAR_MAGIC "LTARIDX"
+#define SIDECAR_VERSION 3
+#define SIDECAR_BYTE_ORDER 0x01020304u
+
+struct sidecar_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t archive_size;
+    int64_t archive_mtime_sec;
+    int64_t archive_mtime_nsec;
+    uint64_t header_hash;     /* hash of the first and last indexed header blocks */
+    int64_t check;            /* what check_archive returns on the archive */
+    uint64_t nb_entries;
+    uint64_t root_child;      /* first entry at the top of the tree */
+    uint64_t entries_offset;
+    uint64_t nb_slots;
+    uint64_t slots_offset;
+    uint64_t sorted_offset;
+    uint64_t len_strings;
+    uint64_t strings_offset;
+};
+
+static int compareNames(const void *a, const void *b, void *arg) {
+    const tar_archive_t *archive = arg;
+    return strcmp(entryName(archive, &archive->entries[*(const uint32_t *) a]),
+                  entryName(archive, &archive->entries[*(const uint32_t *) b]));
+}
+
+/* The entry indexes in path order, built the first time they are needed. */
+static const uint32_t *sortedEntries(tar_archive_t *archive) {
+    pthread_mutex_lock(&archive->lockCopies);
+    if(archive->sorted == NULL && archive->nbEntries > 0){
+        uint32_t *sorted = malloc(archive->nbEntries * sizeof(uint32_t));
+        if(sorted != NULL){
+            for(size_t e = 0; e < archive->nbEntries; e++){
+                sorted[e] = e;
+            }
+            qsort_r(sorted, archive->nbEntries, sizeof(uint32_t), compareNames, archive);
         }
-        if(sum==256){
-            break;
-        }
+        archive->sorted = sorted;
+    }
+    pthread_mutex_unlock(&archive->lockCopies);
+    return archive->sorted;
+}
 
-        if(strcmp(header->magic,TMAGIC)!=0){
-            lseek(tar_fd,0,SEEK_SET);
+/* FNV-1a over the first and last indexed header blocks. */
+static int hashHeaders(const tar_archive_t *archive, uint64_t *hash) {
+    *hash = 14695981039346656037ull;
+    if(archive->nbEntries == 0){
+        return 0;
+    }
+    uint64_t offsets[2] = {archive->entries[0].header_offset, archive->entries[archive->nbEntries - 1].header_offset};
+    for(int i = 0; i < 2; i++){
+        uint8_t block[512];
+        if(readAt(archive, block, sizeof(block), offsets[i]) != sizeof(block)){
             return -1;
         }
-        if(strncmp(header->version,TVERSION,2)!=0){
-            lseek(tar_fd,0,SEEK_SET);
-            return -2;
-        }
-        if(sum!=(TAR_INT(header->chksum))){
-            lseek(tar_fd,0,SEEK_SET);
-            return -3;
+        for(int j = 0; j < 512; j++){
+            *hash ^= block[j];
+            *hash *= 1099511628211ull;
         }
-        nbHeaders++;
-        unsigned int size = TAR_INT(header->size);
-        if(size%512!=0){
-            lseek(tar_fd,((size/512)+1)*512,SEEK_CUR);
-        }else{
-            lseek(tar_fd,((size/512))*512,SEEK_CUR);
+    }
+    return 0;
+}
+
+static uint64_t align8(uint64_t offset) {
+    return (offset + 7) & ~(uint64_t) 7;
+}
+
+static int writeAll(int fd, const void *buf, size_t len, uint64_t offset) {
+    while(len > 0){
+        ssize_t nbWritten = pwrite(fd, buf, len, offset);
+        if(nbWritten < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            return -1;
         }
+        buf = (const uint8_t *) buf + nbWritten;
+        len -= nbWritten;
+        offset += nbWritten;
     }
-	free(header);
-    lseek(tar_fd,0,SEEK_SET);
-    return nbHeaders;
+    return 0;
 }
 
 /**
- * Checks whether an entry exists in the archive.
+ * Saves the index of an archive to a sidecar file, to be mapped back by tar_open_index().
  *
- * @param tar_fd A file descriptor pointing to the start of a tar archive file.
- * @param path A path to an entry in the archive.
+ * @param archive A handle on an archive.
+ * @param idx_path Where to write the index, by convention the archive path followed by ".idx".
+ *                 The file is replaced atomically.
  *
- * @return zero if no entry at the given path exists in the archive,
- *         any other value otherwise.
+ * @return zero on success, -1 on failure with errno set, ENOTSUP for a compressed archive.
  */
-int exists(int tar_fd, char *path) {
-    struct posix_header *header = malloc(sizeof(struct posix_header));
-    while(read(tar_fd,header, sizeof(struct posix_header))>0){
-        if(strcmp(path,header->name)==0){
-            lseek(tar_fd,0,SEEK_SET);
-            return 1;
-        }
+int tar_index_write(tar_archive_t *archive, const char *idx_path) {
+    struct stat st;
+    struct sidecar_header header = {SIDECAR_MAGIC, SIDECAR_VERSION, SIDECAR_BYTE_ORDER};
+    if(archive->codec != CODEC_NONE){
+        errno = ENOTSUP;        /* the restart points of the decoder are not saved */
+        return -1;
+    }
+    if(fstat(archive->fd, &st) < 0 || hashHeaders(archive, &header.header_hash) < 0){
+        return -1;
+    }
+    const uint32_t *sorted = sortedEntries(archive);
+    if(sorted == NULL && archive->nbEntries > 0){
+        return -1;
+    }
+    header.archive_size = st.st_size;
+    header.archive_mtime_sec = st.st_mtim.tv_sec;
+    header.archive_mtime_nsec = st.st_mtim.tv_nsec;
+    header.check = archive->check;
+    header.nb_entries = archive->nbEntries;
+    header.root_child = archive->rootChild;
+    header.entries_offset = align8(sizeof(header));
+    header.nb_slots = archive->nbSlots;
+    header.slots_offset = align8(header.entries_offset + archive->nbEntries * sizeof(struct index_entry));
+    header.sorted_offset = align8(header.slots_offset + archive->nbSlots * sizeof(uint32_t));
+    header.len_strings = archive->lenStrings;
+    header.strings_offset = align8(header.sorted_offset + archive->nbEntries * sizeof(uint32_t));
 
-        unsigned int size = TAR_INT(header->size);
-        if(size%512!=0){
-            lseek(tar_fd,((size/512)+1)*512,SEEK_CUR);
-        }else{
-            lseek(tar_fd,((size/512))*512,SEEK_CUR);
+    size_t lenPath = strlen(idx_path);
+    char *tmpPath = malloc(lenPath + 8);
+    if(tmpPath == NULL){
+        return -1;
+    }
+    memcpy(tmpPath, idx_path, lenPath);
+    memcpy(tmpPath + lenPath, ".XXXXXX", 8);
+    int fd = mkstemp(tmpPath);
+    if(fd < 0){
+        free(tmpPath);
+        return -1;
+    }
+    int ret = 0;
+    if(writeAll(fd, &header, sizeof(header), 0) < 0
+       || writeAll(fd, archive->entries, archive->nbEntries * sizeof(struct index_entry), header.entries_offset) < 0
+       || writeAll(fd, archive->slots, archive->nbSlots * sizeof(uint32_t), header.slots_offset) < 0
+       || writeAll(fd, sorted, archive->nbEntries * sizeof(uint32_t), header.sorted_offset) < 0
+       || writeAll(fd, archive->strings, archive->lenStrings, header.strings_offset) < 0
+       || fchmod(fd, 0644) < 0
+       || rename(tmpPath, idx_path) < 0){
+        int err = errno;
+        unlink(tmpPath);
+        errno = err;
+        ret = -1;
+    }
+    close(fd);
+    free(tmpPath);
+    return ret;
+}
+
+/* Whether count items of size bytes from offset fit in a file of len bytes, without overflow. */
+static int sectionFits(uint64_t offset, uint64_t count, size_t size, uint64_t len) {
+    return offset <= len && offset % 8 == 0 && count <= (len - offset) / size;
+}
+
+/* Checks every index stored in the tables of a sidecar, so that a damaged body cannot
+ * send a lookup out of them: slots, string offsets and links must all stay in range.
+ * Returns -1 at the first one that does not. */
+static int checkSidecar(const struct sidecar_header *header, const uint8_t *base) {
+    const struct index_entry *entries = (const struct index_entry *) (base + header->entries_offset);
+    const uint32_t *slots = (const uint32_t *) (base + header->slots_offset);
+    const uint32_t *sorted = (const uint32_t *) (base + header->sorted_offset);
+    uint64_t nbEntries = header->nb_entries;
+    int hasEmpty = 0;
+    for(uint64_t i = 0; i < header->nb_slots; i++){
+        if(slots[i] > nbEntries){
+            return -1;
+        }
+        hasEmpty |= slots[i] == INDEX_EMPTY;
+    }
+    if(header->nb_slots > 0 && !hasEmpty){
+        return -1;            /* a lookup of a missing path would never stop */
+    }
+    for(uint64_t e = 0; e < nbEntries; e++){
+        const struct index_entry *entry = &entries[e];
+        if(entry->name >= header->len_strings || entry->linkname >= header->len_strings
+           || (entry->parent >= nbEntries && entry->parent != INDEX_ROOT && entry->parent != INDEX_NONE)
+           || (entry->first_child >= nbEntries && entry->first_child != INDEX_NONE)
+           || (entry->next_sibling != INDEX_NONE && (entry->next_sibling >= nbEntries || entry->next_sibling <= e))
+           || sorted[e] >= nbEntries){
+            return -1;
         }
+    }
+    return 0;
+}
 
+/* Maps a sidecar index into the handle, returns -1 if it is missing, damaged or stale. */
+static int mapIndex(tar_archive_t *archive, const char *idx_path) {
+    struct stat st;
+    struct stat stIndex;
+    if(fstat(archive->fd, &st) < 0){
+        return -1;
+    }
+    int fd = open(idx_path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0){
+        return -1;
+    }
+    if(fstat(fd, &stIndex) < 0 || (size_t) stIndex.st_size < sizeof(struct sidecar_header)){
+        close(fd);
+        return -1;
+    }
+    void *base = mmap(NULL, stIndex.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED){
+        return -1;
+    }
+    const struct sidecar_header *header = base;
+    uint64_t size = stIndex.st_size;
+    uint64_t hash;
+    if(memcmp(header->magic, SIDECAR_MAGIC, sizeof(header->magic)) != 0
+       || header->version != SIDECAR_VERSION
+       || header->byte_order != SIDECAR_BYTE_ORDER
+       || header->archive_size != (uint64_t) st.st_size
+       || header->archive_mtime_sec != st.st_mtim.tv_sec
+       || header->archive_mtime_nsec != st.st_mtim.tv_nsec
+       || header->nb_entries >= INDEX_ROOT
+       || (header->root_child >= header->nb_entries && header->root_child != INDEX_NONE)
+       || !sectionFits(header->entries_offset, header->nb_entries, sizeof(struct index_entry), size)
+       || !sectionFits(header->slots_offset, header->nb_slots, sizeof(uint32_t), size)
+       || !sectionFits(header->sorted_offset, header->nb_entries, sizeof(uint32_t), size)
+       || !sectionFits(header->strings_offset, header->len_strings, 1, size)
+       || (header->nb_slots & (header->nb_slots - 1)) != 0
+       || (header->nb_entries > 0 && header->nb_slots == 0)
+       || (header->len_strings > 0 && ((const char *) base)[header->strings_offset + header->len_strings - 1] != '\0')
+       || checkSidecar(header, base) < 0){
+        munmap(base, stIndex.st_size);
+        return -1;
+    }
+    archive->sidecar = base;
+    archive->lenSidecar = stIndex.st_size;
+    archive->check = header->check;
+    archive->entries = (struct index_entry *) ((uint8_t *) base + header->entries_offset);
+    archive->nbEntries = header->nb_entries;
+    archive->rootChild = header->root_child;
+    archive->slots = (uint32_t *) ((uint8_t *) base + header->slots_offset);
+    archive->nbSlots = header->nb_slots;
+    archive->sorted = (uint32_t *) ((uint8_t *) base + header->sorted_offset);
+    archive->strings = (char *) base + header->strings_offset;
+    archive->lenStrings = header->len_strings;
+    if(hashHeaders(archive, &hash) < 0 || hash != header->header_hash || allocateCaches(archive) < 0){
+        return -1;
     }
-    free(header);
-    lseek(tar_fd,0,SEEK_SET);
     return 0;
 }
 
 /**
- * Checks whether an entry exists in the archive and is a directory.
+ * Opens an archive using a sidecar index written by tar_index_write().
  *
- * @param tar_fd A file descriptor pointing to the start of a tar archive file.
- * @param path A path to an entry in the archive.
+ * The index is mapped in memory, so queries are served without scanning the archive.
+ * When the index is missing or stale (the archive size, modification time or first and
+ * last headers changed), the archive is indexed as tar_open() does and the sidecar is
+ * written for the next time (failing to write it is not an error). A compressed
+ * archive has no sidecar and is always indexed.
  *
- * @return zero if no entry at the given path exists in the archive or the entry is not a directory,
- *         any other value otherwise.
+ * @param tar_fd A file descriptor pointing to a tar archive file.
+ * @param idx_path The path of the sidecar index, by convention the archive path followed by ".idx".
+ *
+ * @return a handle on the archive, or NULL if the archive could not be read.
  */
-int is_dir(int tar_fd, char *path) {
-    struct posix_header *header = malloc(sizeof(struct posix_header));
-    while(read(tar_fd,header, sizeof(struct posix_header))>0){
+tar_archive_t *tar_open_index(int tar_fd, const char *idx_path) {
+    if(fileCodec(tar_fd) != CODEC_NONE){
+        return tar_open(tar_fd);
+    }
+    tar_archive_t *archive = calloc(1, sizeof(tar_archive_t));
+    if(archive == NULL){
+        return NULL;
+    }
+    archive->fd = tar_fd;
+    pthread_mutex_init(&archive->lockCopies, NULL);
+    if(mapIndex(archive, idx_path) == 0){
+        return archive;
+    }
+    tar_close(archive);
+    archive = tar_open(tar_fd);
+    if(archive != NULL){
+        tar_index_write(archive, idx_path);
+    }
+    return archive;
+}
 
-        if(strcmp(path,header->name)==0){
-            if(header->typeflag==DIRTYPE){
-                lseek(tar_fd,0,SEEK_SET);
-                return 1;
-            }
-        }
+/*
+ * Queries by prefix and pattern
+ *
+ * tar_find() walks the entries in path order, as the sidecar stores them:
+ * a binary search finds the first path starting with the prefix, and the
+ * walk stops at the first one that does not. The literal head of a pattern
+ * holding a slash narrows the prefix further before the search, so the
+ * cost follows the size of the range and not that of the archive.
+ */
+
+/* Whether c starts a wildcard in a pattern given to fnmatch(). */
+static int isWildcard(char c) {
+    return c == '*' || c == '?' || c == '[' || c == '\\';
+}
 
-        unsigned int size = TAR_INT(header->size);
-        if(size%512!=0){
-            lseek(tar_fd,((size/512)+1)*512,SEEK_CUR);
+/* The first position in sorted whose path is not below key. */
+static size_t lowerBound(const tar_archive_t *archive, const uint32_t *sorted, const char *key) {
+    size_t low = 0;
+    size_t high = archive->nbEntries;
+    while(low < high){
+        size_t mid = low + (high - low) / 2;
+        if(strcmp(entryName(archive, &archive->entries[sorted[mid]]), key) < 0){
+            low = mid + 1;
         }else{
-            lseek(tar_fd,((size/512))*512,SEEK_CUR);
+            high = mid;
         }
-
     }
-    free(header);
-    lseek(tar_fd,0,SEEK_SET);
-    return 0;
+    return low;
 }
 
 /**
- * Checks whether an entry exists in the archive and is a file.
+ * Calls a function on every entry whose path starts with a prefix and matches a pattern.
  *
- * @param tar_fd A file descriptor pointing to the start of a tar archive file.
- * @param path A path to an entry in the archive.
+ * @param archive A handle on an archive.
+ * @param prefix The start of the paths to look at, "a/b/" for everything under a/b, or "".
+ *               Symlinks among its directories are not followed.
+ * @param glob A pattern as fnmatch() takes them, '*' not going past a '/', or NULL for all.
+ *             A pattern without a '/' is matched against the last component of the path,
+ *             "*.json" finds the JSON files at any depth; one with a '/' is matched against
+ *             the whole path after the prefix.
+ * @param fn Called with the path, the type and the size of each entry found, in path order,
+ *           and arg. Returning non-zero stops the search.
+ * @param arg Passed to fn as it is.
  *
- * @return zero if no entry at the given path exists in the archive or the entry is not a file,
- *         any other value otherwise.
+ * @return the number of entries passed to fn, or -1 if out of memory.
  */
-int is_file(int tar_fd, char *path) {
-    struct posix_header *header = malloc(sizeof(struct posix_header));
-    while(read(tar_fd,header, sizeof(struct posix_header))>0){
+ssize_t tar_find(tar_archive_t *archive, const char *prefix, const char *glob, tar_find_fn fn, void *arg) {
+    if(archive->nbEntries == 0){
+        return 0;
+    }
+    const uint32_t *sorted = sortedEntries(archive);
+    if(sorted == NULL){
+        return -1;
+    }
+    size_t lenPrefix = strlen(prefix);
+    int wholePath = glob != NULL && strchr(glob, '/') != NULL;
+    size_t lenLiteral = 0;
+    if(wholePath){
+        while(glob[lenLiteral] != '\0' && !isWildcard(glob[lenLiteral])){
+            lenLiteral++;
+        }
+    }
+    char *range = malloc(lenPrefix + lenLiteral + 1);
+    if(range == NULL){
+        return -1;
+    }
+    memcpy(range, prefix, lenPrefix);
+    if(wholePath){
+        /* glob may be NULL otherwise, which memcpy() must not see even for no bytes */
+        memcpy(range + lenPrefix, glob, lenLiteral);
+    }
+    range[lenPrefix + lenLiteral] = '\0';
+    size_t lenRange = lenPrefix + lenLiteral;
 
-        if(strcmp(path,header->name)==0){
-            if(header->typeflag==REGTYPE || header->typeflag==AREGTYPE){
-                lseek(tar_fd,0,SEEK_SET);
-                return 1;
+    char name[MAX_PATH];
+    ssize_t nbFound = 0;
+    for(size_t i = lowerBound(archive, sorted, range); i < archive->nbEntries; i++){
+        const struct index_entry *entry = &archive->entries[sorted[i]];
+        const char *path = entryName(archive, entry);
+        if(strncmp(path, range, lenRange) != 0){
+            break;
+        }
+        if(((i + 1 < archive->nbEntries && strcmp(path, entryName(archive, &archive->entries[sorted[i + 1]])) == 0)
+            || (i > 0 && strcmp(path, entryName(archive, &archive->entries[sorted[i - 1]])) == 0))
+           && findEntry(archive, path) != entry){
+            continue;             /* a path met more than once: only the one the index answers with */
+        }
+        const char *rest = path + lenPrefix;
+        size_t lenRest = strlen(rest);
+        while(lenRest > 0 && rest[lenRest - 1] == '/'){
+            lenRest--;
+        }
+        if(lenRest == 0 || lenRest >= MAX_PATH){
+            continue;             /* the prefix itself */
+        }
+        if(glob != NULL){
+            memcpy(name, rest, lenRest);
+            name[lenRest] = '\0';
+            const char *subject = name;
+            if(!wholePath){
+                const char *slash = strrchr(name, '/');
+                subject = slash != NULL ? slash + 1 : name;
+            }
+            if(fnmatch(glob, subject, FNM_PATHNAME) != 0){
+                continue;
             }
         }
-
-        unsigned int size = TAR_INT(header->size);
-        if(size%512!=0){
-            lseek(tar_fd,((size/512)+1)*512,SEEK_CUR);
-        }else{
-            lseek(tar_fd,((size/512))*512,SEEK_CUR);
+        nbFound++;
+        if(fn(path, entry->typeflag, entry->size, arg) != 0){
+            break;
         }
-
     }
-    free(header);
-    lseek(tar_fd,0,SEEK_SET);
-    return 0;
+    free(range);
+    return nbFound;
 }
 
-/**
- * Checks whether an entry exists in the archive and is a symlink.
+/*
+ * Archive writer
  *
- * @param tar_fd A file descriptor pointing to the start of a tar archive file.
- * @param path A path to an entry in the archive.
- * @return zero if no entry at the given path exists in the archive or the entry is not symlink,
- *         any other value otherwise.
+ * Headers and small members are gathered in a large buffer written out in
+ * one call when full. The data of a member read from a file descriptor goes
+ * through sendRange(), so the kernel copies it by itself when it can. Names
+ * longer than the 100 bytes of the ustar name field are split over the
+ * prefix field when a slash allows it, and otherwise carried by a PAX
+ * extended header, as are link targets longer than 100 bytes. Sizes past the
+ * 11 octal digits of the size field are stored in base-256, as GNU tar does.
+ *
+ * In append mode the writer starts on the first end-of-archive block, so the
+ * new members replace the old end and the archive is closed again after them.
  */
 
- //printf("Header name : %s\nHeader flag : %c\n", header->name,header->typeflag);
-int is_symlink(int tar_fd, char *path) {
-    struct posix_header *header = malloc(sizeof(struct posix_header));
-    while(read(tar_fd,header, sizeof(struct posix_header))>0){
+#define WRITER_BUFFER (1 << 20)
+#define OCTAL_SIZE_MAX 077777777777ULL
 
+struct tar_writer {
+    int fd;
+    uint8_t *buf;
+    size_t lenBuf;
+    uint64_t offset;              /* in the archive, of buf[0] */
+    time_t mtime;                 /* of the directories and symlinks */
+    int failed;                   /* set by the first failed write, nothing is written past it */
+};
 
-        if(strcmp(path,header->name)==0){
+static int writerFlush(tar_writer_t *w) {
+    if(w->lenBuf > 0 && writeFull(w->fd, w->buf, w->lenBuf) < 0){
+        w->failed = 1;
+        return -1;
+    }
+    w->offset += w->lenBuf;
+    w->lenBuf = 0;
+    return 0;
+}
 
-            if(header->typeflag==SYMTYPE){
-                lseek(tar_fd,0,SEEK_SET);
-                return 1;
-            }
+/* Appends len bytes, or zeros when data is NULL. */
+static int writerAppend(tar_writer_t *w, const void *data, size_t len) {
+    while(len > 0){
+        if(w->lenBuf == WRITER_BUFFER && writerFlush(w) < 0){
+            return -1;
         }
-
-        unsigned int size = TAR_INT(header->size);
-        if(size%512!=0){
-            lseek(tar_fd,((size/512)+1)*512,SEEK_CUR);
+        size_t chunk = WRITER_BUFFER - w->lenBuf < len ? WRITER_BUFFER - w->lenBuf : len;
+        if(data != NULL){
+            memcpy(w->buf + w->lenBuf, data, chunk);
+            data = (const uint8_t *) data + chunk;
         }else{
-            lseek(tar_fd,((size/512))*512,SEEK_CUR);
+            memset(w->buf + w->lenBuf, 0, chunk);
         }
-
+        w->lenBuf += chunk;
+        len -= chunk;
     }
-    free(header);
-    lseek(tar_fd,0,SEEK_SET);
     return 0;
 }
 
+/* Pads the data of a member to a whole block. */
+static int writerPad(tar_writer_t *w, uint64_t size) {
+    return writerAppend(w, NULL, (512 - size % 512) % 512);
+}
 
-
-
-int depthPath(char *path){
-    char* pathCpy = (char *)calloc(strlen(path),sizeof(char));
-    strcpy(pathCpy,path);
-    char *token;
-    size_t NPath = 0;
-    const char delim = '/';
-    token = strtok(pathCpy, &delim);
-    while( token != NULL ) {
-        NPath++;
-        token = strtok(NULL, &delim);
+/* Where name is cut between the prefix and the name fields, or 0 if it cannot be. */
+static size_t splitName(const char *name, size_t len) {
+    if(len <= 100){
+        return 0;
     }
-    free(pathCpy);
-    return NPath;
+    /* the name field must hold what follows the slash, the prefix what precedes it */
+    for(size_t i = len - 101; i < len - 1; i++){
+        if(name[i] == '/' && i <= 155 && i > 0){
+            return i;
+        }
+    }
+    return 0;
 }
 
-char* getEndPath(char *path,int lenPath){
-    int len = 0;
-    const char delim = '/';
-    char* token = strtok(path, &delim);
-    while( len < lenPath-1 ) {
-        len++;
-
-        token = strtok(NULL, &delim);
+/* Appends the PAX record "len key=value\n", whose length counts its own digits. */
+static void writerPaxRecord(char *out, size_t *lenOut, const char *key, const char *value) {
+    size_t body = strlen(key) + strlen(value) + 3;       /* the space, '=' and '\n' */
+    size_t total = body + 1;
+    while(total != body + snprintf(NULL, 0, "%zu", total)){
+        total = body + snprintf(NULL, 0, "%zu", total);
     }
-    return token;
+    if(out != NULL){
+        sprintf(out + *lenOut, "%zu %s=%s\n", total, key, value);
+    }
+    *lenOut += total;
 }
 
+/* Writes value as len - 1 octal digits and a null byte. */
+static void setOctal(char *field, size_t len, uint64_t value) {
+    field[len - 1] = '\0';
+    for(size_t i = len - 1; i > 0; i--){
+        field[i - 1] = '0' + (value & 7);
+        value >>= 3;
+    }
+}
 
+static void setSize(char *field, uint64_t size) {
+    if(size <= OCTAL_SIZE_MAX){
+        setOctal(field, 12, size);
+        return;
+    }
+    memset(field, 0, 12);
+    field[0] = (char) 0x80;
+    for(int i = 11; i > 0 && size > 0; i--){
+        field[i] = size & 0xff;
+        size >>= 8;
+    }
+}
 
+/* Appends the header of a member, preceded by a PAX header when its name or link target needs one. */
+static int writerHeader(tar_writer_t *w, char typeflag, const char *name, const char *linkname,
+                        mode_t mode, uint64_t size, time_t mtime) {
+    if(w->failed){
+        errno = EIO;
+        return -1;
+    }
+    size_t lenName = strlen(name);
+    size_t lenLinkname = linkname != NULL ? strlen(linkname) : 0;
+    size_t cut = splitName(name, lenName);
+    int paxPath = lenName > 100 && cut == 0;
+    int paxLinkpath = lenLinkname > 100;
 
-int findPathFromFilename(int tar_fd, char *path,char *filename){
-
-    struct posix_header *header = malloc(sizeof(struct posix_header));
-    while(read(tar_fd,header, sizeof(struct posix_header))>0){
+    tar_header_t header;
+    memset(&header, 0, sizeof(header));
+    setOctal(header.mode, sizeof(header.mode), mode & 07777);
+    setOctal(header.uid, sizeof(header.uid), getuid() & 07777777);
+    setOctal(header.gid, sizeof(header.gid), getgid() & 07777777);
+    setOctal(header.mtime, sizeof(header.mtime), mtime > 0 ? (uint64_t) mtime : 0);
+    memcpy(header.magic, TMAGIC, TMAGLEN);
+    memcpy(header.version, TVERSION, TVERSLEN);
 
-        char* pathCpy = (char *)calloc(strlen(header->name),sizeof(char));
-        strcpy(pathCpy,header->name);
-        if(getEndPath(pathCpy,depthPath(pathCpy)) != NULL && strcmp(filename,getEndPath(pathCpy,depthPath(pathCpy)))==0){
-                free(pathCpy);
-                strcpy(path,header->name);
-                lseek(tar_fd,0,SEEK_SET);
-                return 1;
+    if(paxPath || paxLinkpath){
+        size_t lenRecords = 0;
+        if(paxPath){
+            writerPaxRecord(NULL, &lenRecords, "path", name);
         }
-        free(pathCpy);
-        unsigned int size = TAR_INT(header->size);
-        if(size%512!=0){
-            lseek(tar_fd,((size/512)+1)*512,SEEK_CUR);
-        }else{
-            lseek(tar_fd,((size/512))*512,SEEK_CUR);
+        if(paxLinkpath){
+            writerPaxRecord(NULL, &lenRecords, "linkpath", linkname);
+        }
+        char *records = malloc(lenRecords + 1);
+        if(records == NULL){
+            return -1;
+        }
+        lenRecords = 0;
+        if(paxPath){
+            writerPaxRecord(records, &lenRecords, "path", name);
+        }
+        if(paxLinkpath){
+            writerPaxRecord(records, &lenRecords, "linkpath", linkname);
+        }
+        tar_header_t pax = header;
+        strcpy(pax.name, "././@PaxHeader");
+        setSize(pax.size, lenRecords);
+        pax.typeflag = XHDTYPE;
+        setOctal(pax.chksum, 7, tar_checksum(&pax));
+        pax.chksum[7] = ' ';
+        int ret = writerAppend(w, &pax, sizeof(pax));
+        if(ret == 0){
+            ret = writerAppend(w, records, lenRecords);
+        }
+        free(records);
+        if(ret < 0 || writerPad(w, lenRecords) < 0){
+            return -1;
         }
+    }
 
+    /* with a PAX path, the ustar fields keep what fits for the readers that ignore it */
+    if(cut > 0){
+        memcpy(header.prefix, name, cut);
+        memcpy(header.name, name + cut + 1, lenName - cut - 1);
+    }else{
+        memcpy(header.name, name, lenName < sizeof(header.name) ? lenName : sizeof(header.name));
     }
-    free(header);
-    lseek(tar_fd,0,SEEK_SET);
-    return 0;
+    if(linkname != NULL){
+        memcpy(header.linkname, linkname, lenLinkname < sizeof(header.linkname) ? lenLinkname : sizeof(header.linkname));
+    }
+    setSize(header.size, size);
+    header.typeflag = typeflag;
+    setOctal(header.chksum, 7, tar_checksum(&header));
+    header.chksum[7] = ' ';
+    return writerAppend(w, &header, sizeof(header));
+}
+
+/* The offset of the first end-of-archive block of an archive, or -1. */
+static int64_t archiveEnd(int tar_fd) {
+    struct tar_iter it;
+    tar_entry_t entry;
+    int ret;
+    if(iterInit(&it, tar_fd, ITER_BUFFER, TAR_ITER_RAW) < 0){
+        return -1;
+    }
+    if(it.codec != NULL){
+        iterRelease(&it);
+        errno = ENOTSUP;
+        return -1;
+    }
+    while((ret = iterNext(&it, &entry)) > 0){
+    }
+    int64_t end = it.next;
+    iterRelease(&it);
+    if(ret < 0){
+        errno = EINVAL;
+        return -1;
+    }
+    return end;
 }
 
 /**
- * Lists the entries at a given path in the archive.
+ * Starts writing an archive.
  *
- * @param tar_fd A file descriptor pointing to the start of a tar archive file.
- * @param path A path to an entry in the archive. If the entry is a symlink, it must be resolved to its linked-to entry.
- * @param entries An array of char arrays, each one is long enough to contain a tar entry
- * @param no_entries An in-out argument.
- *                   The caller set it to the number of entry in entries.
- *                   The callee set it to the number of entry listed.
+ * @param out_fd Where to write: a file, a pipe or a socket, in blocking mode. The archive is
+ *               written from its current offset, except in append mode.
+ * @param flags TAR_WRITER_APPEND to add members to the archive out_fd already holds, which
+ *              must then be an uncompressed archive opened for reading and writing, or zero.
  *
- * @return zero if no directory at the given path exists in the archive,
- *         any other value otherwise.
+ * @return a writer to be finished with tar_writer_close(), or NULL with errno set,
+ *         to EINVAL if the archive to append to is not valid.
  */
-
-
-
-int list(int tar_fd, char *path, char **entries, size_t *no_entries) {
-
-    if(is_dir(tar_fd,path)==0 && is_symlink(tar_fd,path)==0) {
-        *no_entries=0;
-        return 0;
+tar_writer_t *tar_writer_open(int out_fd, int flags) {
+    int64_t end = 0;
+    if(flags & TAR_WRITER_APPEND){
+        end = archiveEnd(out_fd);
+        if(end < 0 || lseek(out_fd, end, SEEK_SET) < 0){
+            return NULL;
+        }
     }
-    struct posix_header *header = malloc(sizeof(struct posix_header));
-    int NPath = depthPath(path);
-    int lenPath = strlen(path);
-    int index = 0;
-    while(read(tar_fd,header, sizeof(struct posix_header))>0){
-
-        if (strcmp(path, header->name) == 0 && header->typeflag==SYMTYPE) {
+    tar_writer_t *w = calloc(1, sizeof(tar_writer_t));
+    if(w == NULL || (w->buf = malloc(WRITER_BUFFER)) == NULL){
+        free(w);
+        return NULL;
+    }
+    w->fd = out_fd;
+    w->offset = end;
+    w->mtime = time(NULL);
+    return w;
+}
 
-            char* pathCpy = (char *)calloc(strlen(header->linkname),sizeof(char));
-            strcpy(pathCpy,header->linkname);
-            lseek(tar_fd,0,SEEK_SET);
-            char* pathToFind = calloc(100, sizeof(char));
-            findPathFromFilename(tar_fd,pathToFind,getEndPath(pathCpy,depthPath(pathCpy)));
-            free(pathCpy);
-            return list(tar_fd,pathToFind,entries,no_entries);
+/**
+ * Adds a regular file whose data is read from a file descriptor.
+ *
+ * @param w A writer.
+ * @param name The path of the member in the archive, of any length.
+ * @param src_fd A regular file, read whole from its start. Its offset is left untouched.
+ * @param mode The permissions of the member, the modification time is taken from src_fd.
+ *
+ * @return zero on success, -1 with errno set otherwise. After a failed write the archive
+ *         is incomplete and every further call fails.
+ */
+int tar_writer_add_file(tar_writer_t *w, const char *name, int src_fd, mode_t mode) {
+    struct stat st;
+    if(fstat(src_fd, &st) < 0){
+        return -1;
+    }
+    if(!S_ISREG(st.st_mode)){
+        errno = EINVAL;
+        return -1;
+    }
+    uint64_t size = st.st_size;
+    if(writerHeader(w, REGTYPE, name, NULL, mode, size, st.st_mtime) < 0){
+        return -1;
+    }
+    if(size > 0){
+        if(writerFlush(w) < 0){
+            return -1;
         }
-
-        if(depthPath(header->name)-1==NPath) {
-            //verifie si le fichier un repertoire de plus que le path
-            char *str = calloc(lenPath, sizeof(char));
-            char *strToCmp = strncat(str, header->name, lenPath);
-
-            if (strcmp(path, strToCmp) == 0 && *no_entries>index) {
-                    strcpy(entries[index],header->name);
-                    index++;
-
+        ssize_t nbSent = sendRange(src_fd, w->fd, 0, size);
+        if(nbSent < 0 || (uint64_t) nbSent != size){
+            /* the header promised size bytes, the archive cannot be finished */
+            w->failed = 1;
+            if(nbSent >= 0){
+                errno = EIO;
             }
+            return -1;
         }
+        w->offset += size;
     }
+    return writerPad(w, size);
+}
 
-    unsigned int size = TAR_INT(header->size);
-    if(size%512!=0){
-        lseek(tar_fd,((size/512)+1)*512,SEEK_CUR);
-    }
-    else{
-        lseek(tar_fd,((size/512))*512,SEEK_CUR);
+/**
+ * Adds a regular file whose data is in memory.
+ *
+ * @param w A writer.
+ * @param name The path of the member in the archive, of any length.
+ * @param data The data of the member.
+ * @param len Its length.
+ * @param mode The permissions of the member.
+ *
+ * @return zero on success, -1 with errno set otherwise.
+ */
+int tar_writer_add_data(tar_writer_t *w, const char *name, const void *data, size_t len, mode_t mode) {
+    if(writerHeader(w, REGTYPE, name, NULL, mode, len, w->mtime) < 0 || writerAppend(w, data, len) < 0){
+        return -1;
     }
-    *no_entries=index;
-    lseek(tar_fd,0,SEEK_SET);
-    free(header);
-    return 1;
+    return writerPad(w, len);
 }
 
 /**
- * Reads a file at a given path in the archive.
- *
- * @param tar_fd A file descriptor pointing to the start of a tar archive file.
- * @param path A path to an entry in the archive to read from.  If the entry is a symlink, it must be resolved to its linked-to entry.
- * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
- * @param dest A destination buffer to read the given file into.
- * @param len An in-out argument.
- *            The caller set it to the size of dest.
- *            The callee set it to the number of bytes written to dest.
+ * Adds a directory.
  *
- * @return -1 if no entry at the given path exists in the archive or the entry is not a file,
- *         -2 if the offset is outside the file total length,
- *         zero if the file was read in its entirety into the destination buffer,
- *         a positive value if the file was partially read, representing the remaining bytes left to be read.
+ * @param w A writer.
+ * @param name The path of the directory, a slash is added at its end if it has none.
+ * @param mode The permissions of the directory.
  *
+ * @return zero on success, -1 with errno set otherwise.
  */
-ssize_t read_file(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len) {
-
-    struct posix_header *header = malloc(sizeof(struct posix_header));
-    while(read(tar_fd,header, sizeof(struct posix_header))>0){
-        unsigned int size = TAR_INT(header->size);
-        if(strcmp(path,header->name)==0 && (header->typeflag==REGTYPE || header->typeflag==AREGTYPE)){
-            if(size<offset){
-                lseek(tar_fd,0,SEEK_SET);
-                return -2;
-            }
-            lseek(tar_fd,offset,SEEK_CUR);
-            int nbByteToRead;
-            if(*len < (size-offset)){
-                nbByteToRead = *len;
-            } else{
-                nbByteToRead = size-offset;
-            }
-            int byteRead = read(tar_fd,dest,nbByteToRead);
-            *len = byteRead;
-            lseek(tar_fd,0,SEEK_SET);
-            return (ssize_t) (size-offset) - byteRead;
-        }
-        if (strcmp(path,header->name)==0 && header->typeflag==SYMTYPE) {
-            lseek(tar_fd,0,SEEK_SET);
-            return read_file(tar_fd,header->linkname,offset,dest,len);
-        }
+int tar_writer_add_dir(tar_writer_t *w, const char *name, mode_t mode) {
+    size_t len = strlen(name);
+    if(len > 0 && name[len - 1] == '/'){
+        return writerHeader(w, DIRTYPE, name, NULL, mode, 0, w->mtime);
+    }
+    char *dirName = malloc(len + 2);
+    if(dirName == NULL){
+        return -1;
+    }
+    memcpy(dirName, name, len);
+    strcpy(dirName + len, "/");
+    int ret = writerHeader(w, DIRTYPE, dirName, NULL, mode, 0, w->mtime);
+    free(dirName);
+    return ret;
+}
 
+/**
+ * Adds a symlink.
+ *
+ * @param w A writer.
+ * @param name The path of the symlink, of any length.
+ * @param target What it points to, of any length.
+ *
+ * @return zero on success, -1 with errno set otherwise.
+ */
+int tar_writer_add_symlink(tar_writer_t *w, const char *name, const char *target) {
+    return writerHeader(w, SYMTYPE, name, target, 0777, 0, w->mtime);
+}
 
-        if(size%512!=0){
-            lseek(tar_fd,((size/512)+1)*512,SEEK_CUR);
-        }else{
-            lseek(tar_fd,((size/512))*512,SEEK_CUR);
+/**
+ * Ends the archive with its two zero blocks, padded to a whole record of 10240 bytes as
+ * tar does, writes what is left in the buffer and frees the writer. out_fd stays open.
+ *
+ * @param w A writer, or NULL.
+ *
+ * @return zero on success, -1 with errno set if the archive could not be written whole.
+ */
+int tar_writer_close(tar_writer_t *w) {
+    if(w == NULL){
+        return 0;
+    }
+    int ret = -1;
+    if(!w->failed){
+        uint64_t end = w->offset + w->lenBuf + 2 * 512;
+        if(writerAppend(w, NULL, 2 * 512 + (10240 - end % 10240) % 10240) == 0){
+            ret = writerFlush(w);
         }
-
+    }else{
+        errno = EIO;
     }
-    free(header);
-    lseek(tar_fd,0,SEEK_SET);
-    return -1;
+    free(w->buf);
+    free(w);
+    return ret;
 }
-
-
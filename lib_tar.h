@@ -3,8 +3,13 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/types.h>
 #include <unistd.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef struct posix_header
 {                              /* byte offset */
     char name[100];               /*   0 */
@@ -41,6 +46,125 @@ typedef struct posix_header
 /* Converts an ASCII-encoded octal-based number into a regular integer */
 #define TAR_INT(char_ptr) strtol(char_ptr, NULL, 8)
 
+/**
+ * Converts an ASCII-encoded octal number into a regular integer, like TAR_INT but
+ * bounded by the field length and eight digits at a time.
+ *
+ * Leading spaces are skipped, and the number stops at the first byte that is not an
+ * octal digit (usually the terminating null or space).
+ *
+ * @param field The first byte of the field.
+ * @param len The length of the field.
+ *
+ * @return the value of the number, zero if the field holds no digit.
+ */
+uint64_t tar_parse_octal(const char *field, size_t len);
+
+/**
+ * Computes the checksum of a header as defined by POSIX: the sum of its bytes taken
+ * as unsigned, with the chksum field counted as if it held spaces.
+ *
+ * @param header A header of the archive.
+ *
+ * @return the checksum, to be compared with the value of the chksum field.
+ */
+unsigned int tar_checksum(const tar_header_t *header);
+
+/**
+ * Selects the implementation used by tar_checksum(), mainly for benchmarks and tests.
+ * By default the fastest one supported by the CPU is used.
+ *
+ * @param name One of "avx2", "sse2" or "scalar", or NULL to go back to the default.
+ *
+ * @return zero if the implementation is now in use,
+ *         -1 if it is unknown or not supported by this CPU.
+ */
+int tar_checksum_kernel(const char *name);
+
+/*
+ * Archives compressed with gzip, or with zstd when the library is built with
+ * LIB_TAR_ZSTD defined, are read directly: the offsets below are then offsets
+ * in the archive once decoded.
+ */
+
+/**
+ * A single pass over the entries of an archive, see tar_iter_open().
+ */
+typedef struct tar_iter tar_iter_t;
+
+/**
+ * An entry returned by tar_iter_next().
+ */
+typedef struct tar_entry {
+    const char *name;            /* the path of the entry, null-terminated, of any length */
+    const char *linkname;        /* the target of a link, null-terminated, of any length */
+    char typeflag;               /* the type of the entry, see the values above */
+    uint64_t size;               /* the size of its data */
+    uint64_t header_offset;      /* the offset of its header in the archive */
+    uint64_t data_offset;        /* the offset of its data in the archive */
+    const tar_header_t *header;  /* the ustar header of the entry itself */
+} tar_entry_t;
+
+/* Checks every header as check_archive() does. */
+#define TAR_ITER_CHECK 1
+/* Returns the PAX and GNU extended headers as entries of their own, instead of
+ * applying them to the entry they describe. */
+#define TAR_ITER_RAW 2
+
+/**
+ * Starts a single pass over the entries of an archive.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a tar archive. A seekable file
+ *               is read with positional reads and its offset is left untouched, anything
+ *               else (a pipe, a socket) is read in sequence from where it stands.
+ * @param bufsize The size of the reads, zero for 1 MiB. It is rounded up to 512 bytes.
+ * @param flags TAR_ITER_CHECK to check every header as check_archive() does,
+ *              TAR_ITER_RAW to return the extended headers as entries of their own,
+ *              or zero.
+ *
+ * @return an iterator to be released with tar_iter_close(), or NULL if out of memory.
+ */
+tar_iter_t *tar_iter_open(int tar_fd, size_t bufsize, int flags);
+
+/**
+ * Moves to the next entry of the archive.
+ *
+ * @param it An iterator returned by tar_iter_open().
+ * @param entry Filled with the entry. Its name, link target and header stay valid until
+ *              the next call on the iterator.
+ *
+ * @return 1 if there is an entry, 0 at the end of the archive,
+ *         -1, -2 or -3 for an invalid header when checking as check_archive() does,
+ *         -4 if the archive could not be read.
+ *         Once the end or an error is reached, every call returns the same.
+ */
+int tar_iter_next(tar_iter_t *it, tar_entry_t *entry);
+
+/**
+ * Reads the data of the current entry, from where the previous call stopped.
+ *
+ * @param it An iterator returned by tar_iter_open().
+ * @param buf A destination buffer.
+ * @param len The size of buf.
+ *
+ * @return the number of bytes written to buf, less than len only once the end of the
+ *         data is reached, zero after it, or -1 if the archive could not be read.
+ */
+ssize_t tar_iter_read(tar_iter_t *it, void *buf, size_t len);
+
+/**
+ * Releases an iterator. The file descriptor is left open.
+ *
+ * @param it An iterator returned by tar_iter_open(), NULL is accepted.
+ */
+void tar_iter_close(tar_iter_t *it);
+
+/*
+ * The functions below never move the file offset of tar_fd, the archive is only
+ * accessed with positional reads. They may be called concurrently on the same
+ * descriptor, and leave the caller's own offset untouched.
+ */
+
 /**
  * Checks whether the archive is valid.
  *
@@ -54,10 +178,82 @@ typedef struct posix_header
  * @return a zero or positive value if the archive is valid, representing the number of headers in the archive,
  *         -1 if the archive contains a header with an invalid magic value,
  *         -2 if the archive contains a header with an invalid version value,
- *         -3 if the archive contains a header with an invalid checksum value
+ *         -3 if the archive contains a header with an invalid checksum value,
+ *         -4 if the archive could not be read
  */
 int check_archive(int tar_fd);
 
+/**
+ * Checks whether the archive is valid, like check_archive(), spreading the header
+ * checks over several threads.
+ *
+ * @param tar_fd A file descriptor pointing to a file supposed to contain a tar archive.
+ * @param nthreads The number of threads to use, zero or less to use one per online CPU.
+ *                 A compressed archive is checked by check_archive().
+ *
+ * @return the same value as check_archive(): the number of headers of a valid archive,
+ *         or the error of the first invalid header of the archive.
+ *         -4 if the archive could not be read.
+ */
+int check_archive_parallel(int tar_fd, int nthreads);
+
+/**
+ * Where check_archive_resume() stopped: the validated prefix of an archive.
+ */
+typedef struct tar_check_state {
+    uint64_t offset;           /* end of the validated prefix, where the next header is expected */
+    uint64_t nb_headers;       /* headers validated, as check_archive() counts them */
+    uint32_t crc;              /* CRC-32 of the headers and data validated */
+    uint32_t last_crc;         /* CRC-32 of the last validated header block */
+    uint64_t last_header;      /* its offset */
+    int verify_prefix;         /* set by the caller to have the whole prefix hashed again */
+} tar_check_state_t;
+
+/**
+ * Checks the headers appended to an archive since the last call, as check_archive() does.
+ *
+ * Only the headers and data past the validated prefix are read, so checking an archive
+ * that keeps growing costs the size of what was appended. A prefix that was cut or whose
+ * last header changed is reported; a change further inside it is only seen when
+ * verify_prefix is set, which reads the whole prefix again. A member whose data is not
+ * all written yet is left for the next call. A compressed archive is decoded from its
+ * start every time.
+ *
+ * @param tar_fd A file descriptor pointing to a file supposed to contain a tar archive.
+ * @param state Where the last call stopped, zeroed before the first one. It is moved past
+ *              the headers found valid, and left where it is on an error. Set its
+ *              verify_prefix to re-hash the part already validated instead of its last header.
+ *
+ * @return the number of headers of the archive, as check_archive() counts them, when the
+ *         new ones are valid, the error of the first invalid one otherwise as
+ *         check_archive() returns it, -4 if the archive could not be read,
+ *         -5 if the part already validated was modified.
+ */
+int check_archive_resume(int tar_fd, tar_check_state_t *state);
+
+/**
+ * What tar_stat_batch() finds out about a path.
+ */
+typedef struct tar_stat {
+    int exists;                /* non-zero if an entry at the path exists in the archive */
+    char typeflag;             /* the type of the entry, see the values above */
+    uint64_t size;             /* the size of its data */
+    uint64_t data_offset;      /* the offset of its data in the archive file */
+} tar_stat_t;
+
+/**
+ * Looks up many paths in a single pass over the archive.
+ *
+ * @param tar_fd A file descriptor pointing to a tar archive file.
+ * @param paths The paths to look up. The same path may appear more than once.
+ * @param n The number of paths.
+ * @param results Filled with what is known about each path, results[i] for paths[i].
+ *                When a path appears several times in the archive, the first entry counts.
+ *
+ * @return the number of paths that exist in the archive, or -1 if the archive could not be read.
+ */
+ssize_t tar_stat_batch(int tar_fd, char **paths, size_t n, tar_stat_t *results);
+
 /**
  * Checks whether an entry exists in the archive.
  *
@@ -110,6 +306,7 @@ int is_symlink(int tar_fd, char *path);
  * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
  * @param path A path to an entry in the archive. If the entry is a symlink, it must be resolved to its linked-to entry.
  * @param entries An array of char arrays, each one is long enough to contain a tar entry
+ *                (100 bytes and a null: longer paths are cut, list_next() returns them whole)
  * @param no_entries An in-out argument.
  *                   The caller set it to the number of entry in entries.
  *                   The callee set it to the number of entry listed.
@@ -124,6 +321,7 @@ int list(int tar_fd, char *path, char **entries, size_t *no_entries);
  *
  * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
  * @param path A path to an entry in the archive to read from.  If the entry is a symlink, it must be resolved to its linked-to entry.
+ *             A hard link reads the data of the file it links to.
  * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
  * @param dest A destination buffer to read the given file into.
  * @param len An in-out argument.
@@ -138,4 +336,638 @@ int list(int tar_fd, char *path, char **entries, size_t *no_entries);
  */
 ssize_t read_file(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len);
 
+/*
+ * Counters and tracing of the calls above, built only when the library is compiled with
+ * LIB_TAR_STATS defined. Without it the calls pay nothing and the functions below return -1.
+ */
+
+/* The APIs counted apart. */
+enum {
+    TAR_API_CHECK_ARCHIVE,
+    TAR_API_EXISTS,
+    TAR_API_IS_DIR,
+    TAR_API_IS_FILE,
+    TAR_API_IS_SYMLINK,
+    TAR_API_LIST,
+    TAR_API_READ_FILE,
+    TAR_API_COUNT
+};
+
+/**
+ * The counters of one call, or the totals of one API.
+ */
+typedef struct tar_call_stats {
+    uint64_t calls;
+    uint64_t headers;          /* headers visited, extended ones included */
+    uint64_t reads;            /* read and pread syscalls */
+    uint64_t seeks;            /* lseek syscalls */
+    uint64_t bytes;            /* bytes those reads returned */
+    uint64_t symlinks;         /* symlinks followed */
+    uint64_t ns;               /* time spent in the calls */
+} tar_call_stats_t;
+
+typedef struct tar_stats {
+    tar_call_stats_t api[TAR_API_COUNT];   /* indexed by the TAR_API_* values */
+} tar_stats_t;
+
+/**
+ * Called at the end of every call, with the argument given to tar_trace_set(), the
+ * TAR_API_* value of the call, the path asked for (NULL for check_archive()) and the
+ * counters of that call alone.
+ */
+typedef void (*tar_trace_fn)(void *arg, int api, const char *path, const tar_call_stats_t *call);
+
+/**
+ * Copies the counters of every API since the start or the last tar_stats_reset().
+ *
+ * @param stats Filled with the counters, zeroed if the library is built without LIB_TAR_STATS.
+ *
+ * @return zero, or -1 if the library is built without LIB_TAR_STATS.
+ */
+int tar_stats_get(tar_stats_t *stats);
+
+/**
+ * Sets every counter back to zero.
+ *
+ * @return zero, or -1 if the library is built without LIB_TAR_STATS.
+ */
+int tar_stats_reset(void);
+
+/**
+ * Sets the function called at the end of every call of the descriptor API.
+ *
+ * @param fn Called with arg, the API, the path asked for (NULL for check_archive()) and
+ *           the counters of that call alone, from the thread that made it. NULL to stop.
+ * @param arg Passed to fn as it is.
+ *
+ * @return zero, or -1 if the library is built without LIB_TAR_STATS.
+ */
+int tar_trace_set(tar_trace_fn fn, void *arg);
+
+/**
+ * An archive opened once and indexed in memory.
+ *
+ * The *_h variants of the queries below answer from the index instead of scanning the archive.
+ */
+typedef struct tar_archive tar_archive_t;
+
+/**
+ * Opens an archive and indexes all of its entries.
+ *
+ * @param tar_fd A file descriptor pointing to a tar archive file. It is only accessed
+ *               through positional reads and must stay open until tar_close().
+ *
+ * @return a handle on the archive, or NULL if the archive could not be read.
+ *         An invalid archive still gets a handle holding the entries before the first
+ *         invalid header, check_archive_h() reports why it is invalid. Headers in the
+ *         GNU format, which check_archive() rejects for their magic, are indexed anyway.
+ *
+ * A compressed archive is decoded once, keeping restart points about every MiB of
+ * output, so reading a member later only decodes from the closest point before it.
+ */
+tar_archive_t *tar_open(int tar_fd);
+
+/**
+ * Opens an archive like tar_open(), with the whole archive mapped in memory so that
+ * tar_map_file() can hand out pointers to the member data without copying it.
+ *
+ * When the file cannot be mapped, the handle falls back to positional reads, and when
+ * the descriptor is not seekable either (a pipe for instance) the stream is read
+ * in memory once. A compressed archive is decoded in memory once.
+ *
+ * @param tar_fd A file descriptor pointing to a tar archive file.
+ *
+ * @return a handle on the archive, or NULL if the archive could not be read.
+ */
+tar_archive_t *tar_open_mmap(int tar_fd);
+
+/**
+ * Releases a handle returned by tar_open() or tar_open_mmap(). The file descriptor is left open.
+ * Reads queued with tar_read_submit() are waited for, and their completions dropped.
+ *
+ * @param archive A handle on an archive, NULL is accepted.
+ */
+void tar_close(tar_archive_t *archive);
+
+/* Same as check_archive(), exists(), is_dir(), is_file(), is_symlink(), list() and read_file(),
+ * answered from the index of an archive opened with tar_open(). */
+int check_archive_h(tar_archive_t *archive);
+int exists_h(tar_archive_t *archive, char *path);
+int is_dir_h(tar_archive_t *archive, char *path);
+int is_file_h(tar_archive_t *archive, char *path);
+int is_symlink_h(tar_archive_t *archive, char *path);
+int list_h(tar_archive_t *archive, char *path, char **entries, size_t *no_entries);
+ssize_t read_file_h(tar_archive_t *archive, char *path, size_t offset, uint8_t *dest, size_t *len);
+
+/**
+ * What the cache of a handle did since tar_cache_set().
+ */
+typedef struct tar_cache_stats {
+    uint64_t hits;             /* blocks found in the cache */
+    uint64_t misses;           /* blocks read from the archive */
+    uint64_t evictions;        /* blocks dropped to stay within the budget */
+    uint64_t bytes;            /* member data held now */
+} tar_cache_stats_t;
+
+/**
+ * Caches the data read by read_file_h() on a handle, within a budget.
+ *
+ * Data is kept in blocks of 64 KiB of a member, or the whole member when it is smaller,
+ * and the least recently used blocks are dropped first. The hard links to a file share
+ * its blocks. A handle holding the archive in memory (see tar_open_mmap()) reads from
+ * there and gets no cache.
+ *
+ * @param archive A handle on an archive, not used by other threads during the call.
+ * @param max_bytes The most member data to keep, zero to drop the cache.
+ *
+ * @return zero, or -1 if out of memory.
+ */
+int tar_cache_set(tar_archive_t *archive, size_t max_bytes);
+
+/**
+ * Gives the hit and miss counts of the cache of a handle.
+ *
+ * @param archive A handle on an archive.
+ * @param stats Filled with the counts since tar_cache_set(), zeroed if there is no cache.
+ */
+void tar_cache_stats(tar_archive_t *archive, tar_cache_stats_t *stats);
+
+/**
+ * A position in the listing of a directory, see list_begin().
+ * It only refers to the archive, so listing allocates nothing.
+ */
+typedef struct tar_list_cursor {
+    tar_archive_t *archive;
+    uint32_t next;
+} tar_list_cursor_t;
+
+/**
+ * Starts listing the entries at a given path in the archive.
+ *
+ * @param archive A handle on an archive.
+ * @param path A path to a directory in the archive, or "" for the top of the archive.
+ *             If the entry is a symlink, it is resolved to its linked-to entry as list() does.
+ * @param cursor Set up to return the entries of the directory with list_next().
+ *
+ * @return zero if no directory at the given path exists in the archive,
+ *         any other value otherwise.
+ */
+int list_begin(tar_archive_t *archive, char *path, tar_list_cursor_t *cursor);
+
+/**
+ * Returns the next entry of a directory listed with list_begin().
+ *
+ * @param cursor A cursor set up by list_begin().
+ *
+ * @return the full path of the next entry, or NULL once all of them were returned.
+ *         The path belongs to the archive and stays valid until tar_close().
+ */
+const char *list_next(tar_list_cursor_t *cursor);
+
+/**
+ * Returns the next entries of a directory listed with list_begin(), a page at a time.
+ *
+ * @param cursor A cursor set up by list_begin().
+ * @param names Filled with the full paths of the next entries, as list_next() returns them.
+ * @param max The number of paths names can hold.
+ *
+ * @return the number of paths written to names, zero once all of them were returned.
+ */
+size_t list_next_page(tar_list_cursor_t *cursor, const char **names, size_t max);
+
+/**
+ * Called by tar_find() with the path, the type and the size of an entry found.
+ * Returning non-zero stops the search.
+ */
+typedef int (*tar_find_fn)(const char *path, char typeflag, uint64_t size, void *arg);
+
+/**
+ * Calls a function on every entry whose path starts with a prefix and matches a pattern.
+ *
+ * The entries are searched in path order, so the cost follows the number of paths starting
+ * with the prefix rather than the size of the archive.
+ *
+ * @param archive A handle on an archive.
+ * @param prefix The start of the paths to look at, "a/b/" for everything under a/b, or "".
+ *               Symlinks among its directories are not followed.
+ * @param glob A pattern as fnmatch() takes them, '*' not going past a '/', or NULL for all.
+ *             A pattern without a '/' is matched against the last component of the path,
+ *             "*.json" finds the JSON files at any depth; one with a '/' is matched against
+ *             the whole path after the prefix.
+ * @param fn Called with the path, the type and the size of each entry found, in path order,
+ *           and arg. Returning non-zero stops the search.
+ * @param arg Passed to fn as it is.
+ *
+ * @return the number of entries passed to fn, or -1 if out of memory.
+ */
+ssize_t tar_find(tar_archive_t *archive, const char *prefix, const char *glob, tar_find_fn fn, void *arg);
+
+/**
+ * Gives access to the data of a file in the archive without copying it.
+ *
+ * @param archive A handle returned by tar_open_mmap() or tar_open().
+ * @param path A path to an entry in the archive. If the entry is a symlink, it is resolved
+ *             to its linked-to entry as read_file() does.
+ * @param data Set to the first byte of the file data. The data stays valid until tar_close().
+ * @param len Set to the size of the file data.
+ *
+ * @return zero on success,
+ *         -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         -2 if the data could not be read.
+ *
+ * With a mapped archive the pointer goes straight into the mapping. Otherwise the data is
+ * read once with pread and kept with the handle.
+ */
+int tar_map_file(tar_archive_t *archive, char *path, const uint8_t **data, size_t *len);
+
+/**
+ * Gives the number of entries in the index of a handle.
+ *
+ * @param archive A handle on an archive.
+ *
+ * @return the number of entries, to be read with tar_entry_at().
+ */
+size_t tar_entry_count(tar_archive_t *archive);
+
+/**
+ * Gives an entry of the index of a handle, in the order of the archive. The extended
+ * headers are already applied, as tar_iter_next() does, and a path present several times
+ * is there each time.
+ *
+ * @param archive A handle on an archive.
+ * @param index The position of the entry, below tar_entry_count().
+ * @param entry Filled with the entry. Its name and link target stay valid until tar_close(),
+ *              and its header is NULL.
+ *
+ * @return 1 if there is an entry at that index, 0 otherwise.
+ */
+int tar_entry_at(tar_archive_t *archive, size_t index, tar_entry_t *entry);
+
+/**
+ * Same as tar_map_file(), for the entry at an index of the handle rather than a path.
+ * Links are not followed.
+ *
+ * @param archive A handle on an archive.
+ * @param index The position of the entry, below tar_entry_count().
+ * @param data Set to the first byte of the file data. The data stays valid until tar_close().
+ * @param len Set to the size of the file data.
+ *
+ * @return zero on success,
+ *         -1 if there is no entry at that index or it is not a regular file,
+ *         -2 if the data could not be read.
+ */
+int tar_map_entry(tar_archive_t *archive, size_t index, const uint8_t **data, size_t *len);
+
+/**
+ * Tells whether a handle holds the whole archive in memory: one from tar_open_mmap() does
+ * unless the file could not be mapped. tar_map_file() and tar_map_entry() then hand out
+ * pointers into it; otherwise each member they are asked for is read and kept with the
+ * handle until tar_close().
+ *
+ * @param archive A handle on an archive.
+ *
+ * @return 1 if the archive is held in memory, 0 otherwise.
+ */
+int tar_in_memory(tar_archive_t *archive);
+
+/**
+ * Tells where the data of a file lies in the archive file, so that it can be read with
+ * pread, by another process for instance, without going through the library.
+ *
+ * @param archive A handle on an archive.
+ * @param path A path to an entry in the archive, resolved as read_file() does.
+ * @param data_offset Set to the offset of the file data in the archive file.
+ * @param size Set to the size of the file data.
+ *
+ * @return zero on success,
+ *         -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         -2 if the archive is compressed or was read from a pipe, its data not being
+ *         in the archive file as is. The size is set all the same.
+ */
+int tar_locate(tar_archive_t *archive, char *path, uint64_t *data_offset, uint64_t *size);
+
+/**
+ * Writes the data of a file in the archive to a file descriptor, without going through
+ * a user buffer when the kernel can copy it by itself.
+ *
+ * @param archive A handle on an archive.
+ * @param path A path to an entry in the archive. If the entry is a symlink, it is resolved
+ *             to its linked-to entry as read_file() does.
+ * @param out_fd Where to write: a file, a pipe or a socket, in blocking mode. The data is
+ *               written at its current offset, which moves past it.
+ * @param offset An offset in the file from which to start, zero indicates the start of the file.
+ * @param count The number of bytes to send, cut to what the file holds past offset.
+ *
+ * @return the number of bytes written to out_fd, fewer than asked only if the archive
+ *         is cut short or writing failed part of the way,
+ *         -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         -2 if the offset is outside the file total length,
+ *         -3 if nothing could be written, with errno set.
+ */
+ssize_t tar_send_file(tar_archive_t *archive, char *path, int out_fd, uint64_t offset, uint64_t count);
+
+/**
+ * A read queued with tar_read_submit() that is done.
+ */
+typedef struct tar_read_completion {
+    void *user_data;           /* as given to tar_read_submit() */
+    ssize_t ret;               /* what read_file_h() returns for the same read */
+    size_t len;                /* the number of bytes read into the buffer */
+} tar_read_completion_t;
+
+/**
+ * Queues a read of a file in the archive, to be reported by tar_read_poll() or tar_read_wait().
+ *
+ * The path is looked up in the index at once. The reads of the archive file are handed
+ * to the kernel in batches when completions are asked for, through io_uring, or through
+ * a small pool of threads calling pread where io_uring is not available. A member held
+ * in memory, in the cache or in a compressed archive is read during the call, and so is
+ * a path that leads to no file, its completion carrying -1. Hundreds of reads can be in
+ * flight; the handle is meant to be driven by one thread at a time.
+ *
+ * @param archive A handle on an archive.
+ * @param path A path to an entry in the archive, resolved as read_file() does.
+ * @param offset An offset in the file from which to start reading.
+ * @param buf A buffer left untouched by the caller until the read is reported.
+ * @param len The size of buf.
+ * @param user_data Handed back with the completion.
+ *
+ * @return zero if the read is queued, or -1 with errno set.
+ */
+int tar_read_submit(tar_archive_t *archive, char *path, size_t offset, uint8_t *buf, size_t len, void *user_data);
+
+/**
+ * Returns the reads that are done, without waiting.
+ *
+ * @param archive A handle on an archive.
+ * @param completions Filled with the reads that are done, in no particular order.
+ * @param max The size of completions.
+ *
+ * @return the number of completions filled, or -1 with errno set.
+ */
+int tar_read_poll(tar_archive_t *archive, tar_read_completion_t *completions, int max);
+
+/**
+ * Returns the reads that are done, waiting for one if none is.
+ *
+ * @param archive A handle on an archive.
+ * @param completions Filled with the reads that are done, in no particular order.
+ * @param max The size of completions.
+ *
+ * @return the number of completions filled, zero only if no read is queued,
+ *         or -1 with errno set.
+ */
+int tar_read_wait(tar_archive_t *archive, tar_read_completion_t *completions, int max);
+
+/**
+ * Extracts the entries of an archive under a directory.
+ *
+ * The directories are made first, then the files are written by a pool of threads, each
+ * taking the files of its share and then those left in the others' shares, their data
+ * copied by the kernel when it can. Hard links and symlinks are made last. Leading slashes
+ * are dropped from the paths, and a path with a ".." component, or a symlink pointing
+ * to an absolute path or above dest_dir, is refused. Symlinks found under dest_dir are
+ * never followed, and a symlink that leads above dest_dir only through other links is
+ * removed once they are all made.
+ *
+ * @param archive A handle on an archive.
+ * @param dest_dir The directory to extract to, which must exist.
+ * @param nthreads The number of threads writing the files, zero or less for one per online CPU.
+ *
+ * @return the number of entries that could not be extracted, those refused for their path
+ *         or link target included, zero if all of them were, or -1 if dest_dir cannot be
+ *         opened or memory is short. Entries other than files, directories and links are
+ *         skipped, and a path present several times is extracted as the index resolves it.
+ */
+int tar_extract(tar_archive_t *archive, const char *dest_dir, int nthreads);
+
+/* The digests computed by tar_manifest(). */
+#define TAR_HASH_CRC32C 1        /* CRC-32C (Castagnoli), in the low 32 bits of the digest */
+#define TAR_HASH_XXH64  2        /* 64-bit xxHash, seed zero */
+
+/**
+ * A regular file of an archive and the digest of its data, see tar_manifest().
+ */
+typedef struct tar_manifest_entry {
+    const char *path;          /* the path of the file, valid until tar_close() */
+    uint64_t size;             /* the size of its data */
+    uint64_t offset;           /* the offset of its data in the archive */
+    uint64_t digest;
+} tar_manifest_entry_t;
+
+typedef int (*tar_manifest_fn)(const tar_manifest_entry_t *entry, void *arg);
+
+/**
+ * Hashes the data of every regular file of an archive.
+ *
+ * The data of each file is read once, the files being spread over a pool of threads,
+ * the largest first. CRC-32C uses the crc32 instruction of SSE 4.2 when the CPU has it.
+ * A path present several times in the archive is hashed each time.
+ *
+ * @param archive A handle on an archive.
+ * @param algo TAR_HASH_CRC32C or TAR_HASH_XXH64.
+ * @param nthreads The number of threads hashing the files, zero or less for one per online CPU.
+ * @param fn Called with each file and its digest, in the order of the archive, and arg,
+ *           from the calling thread once all files are hashed. Returning non-zero stops the calls.
+ * @param arg Passed to fn as it is.
+ *
+ * @return the number of files passed to fn, -1 if algo is unknown or memory is short,
+ *         -2 if a file could not be read.
+ */
+ssize_t tar_manifest(tar_archive_t *archive, int algo, int nthreads, tar_manifest_fn fn, void *arg);
+
+/**
+ * Writes the manifest of an archive, as tar_manifest() computes it, to a file descriptor.
+ *
+ * The first line names the algorithm, then each file has a line "digest size offset path",
+ * the digest in hex and the path last, its backslashes and newlines written \\ and \n.
+ *
+ * @param archive A handle on an archive.
+ * @param algo TAR_HASH_CRC32C or TAR_HASH_XXH64.
+ * @param nthreads The number of threads hashing the files, zero or less for one per online CPU.
+ * @param out_fd Where to write the manifest, from its current offset.
+ *
+ * @return the number of files in the manifest, -1 if algo is unknown or memory is short,
+ *         -2 if a file could not be read, -3 if the manifest could not be written.
+ */
+ssize_t tar_manifest_write(tar_archive_t *archive, int algo, int nthreads, int out_fd);
+
+/* The differences reported by tar_manifest_verify(). */
+#define TAR_VERIFY_CHANGED 1     /* the size or the digest of the file differs */
+#define TAR_VERIFY_MISSING 2     /* the file is in the manifest, not in the archive */
+#define TAR_VERIFY_ADDED   3     /* the file is in the archive, not in the manifest */
+
+typedef void (*tar_verify_fn)(const char *path, int what, void *arg);
+
+/**
+ * Checks an archive against a manifest written by tar_manifest_write(), with the
+ * algorithm named in the manifest. The files are matched by path, the copies of a path
+ * in the order of the archive; a file whose data merely moved in the archive matches.
+ *
+ * @param archive A handle on an archive.
+ * @param manifest_fd The manifest, read from its current offset to its end.
+ * @param nthreads The number of threads hashing the files, zero or less for one per online CPU.
+ * @param fn Called with the path of each difference and its kind, and arg, or NULL.
+ * @param arg Passed to fn as it is.
+ *
+ * @return the number of differences, zero if the archive matches the manifest,
+ *         -1 if the manifest is malformed or memory is short, -2 if a file could not be read.
+ */
+ssize_t tar_manifest_verify(tar_archive_t *archive, int manifest_fd, int nthreads, tar_verify_fn fn, void *arg);
+
+/**
+ * A stack of archives seen as one tree, as the layers of a container image.
+ *
+ * A path in a layer hides the same path in the layers below it. A ".wh.NAME" entry
+ * removes NAME, and what lies under it, from the layers below, and a ".wh..wh..opq"
+ * entry hides what the layers below hold in its directory. The whiteout entries
+ * themselves are not part of the tree. Each query costs one lookup in a table merged
+ * once at open time, and a path names the same directory with or without its trailing
+ * slash.
+ */
+typedef struct tar_union tar_union_t;
+
+/**
+ * Opens a stack of archives as one tree.
+ *
+ * @param fds File descriptors pointing to tar archives, from the bottom layer up. Each is
+ *            indexed as tar_open() does and must stay open until tar_union_close().
+ * @param n The number of layers.
+ *
+ * @return the union, or NULL if one of the layers could not be read or memory is short.
+ */
+tar_union_t *tar_union_open(int *fds, int n);
+
+/**
+ * Releases a union and the indexes of its layers. Their file descriptors are left open.
+ *
+ * @param u A union, or NULL.
+ */
+void tar_union_close(tar_union_t *u);
+
+/* Same as exists(), is_dir(), is_file(), is_symlink(), list() and read_file(), answered
+ * from the merged layers. list_u() returns the entries of a directory from every layer
+ * that holds it and is not hidden, the upper layers first. Symlinks and hard links are
+ * resolved in the merged tree. */
+int exists_u(tar_union_t *u, char *path);
+int is_dir_u(tar_union_t *u, char *path);
+int is_file_u(tar_union_t *u, char *path);
+int is_symlink_u(tar_union_t *u, char *path);
+int list_u(tar_union_t *u, char *path, char **entries, size_t *no_entries);
+ssize_t read_file_u(tar_union_t *u, char *path, size_t offset, uint8_t *dest, size_t *len);
+
+/**
+ * Saves the index of an archive to a sidecar file, to be mapped back by tar_open_index().
+ *
+ * @param archive A handle on an archive.
+ * @param idx_path Where to write the index, by convention the archive path followed by ".idx".
+ *                 The file is replaced atomically.
+ *
+ * @return zero on success, -1 on failure with errno set, ENOTSUP for a compressed archive.
+ */
+int tar_index_write(tar_archive_t *archive, const char *idx_path);
+
+/**
+ * Opens an archive using a sidecar index written by tar_index_write().
+ *
+ * The index is mapped in memory, so queries are served without scanning the archive.
+ * When the index is missing or stale (the archive size, modification time or first and
+ * last headers changed), the archive is indexed as tar_open() does and the sidecar is
+ * written for the next time (failing to write it is not an error). A compressed
+ * archive has no sidecar and is always indexed.
+ *
+ * @param tar_fd A file descriptor pointing to a tar archive file.
+ * @param idx_path The path of the sidecar index, by convention the archive path followed by ".idx".
+ *
+ * @return a handle on the archive, or NULL if the archive could not be read.
+ */
+tar_archive_t *tar_open_index(int tar_fd, const char *idx_path);
+
+
+/**
+ * An archive being written, see tar_writer_open().
+ *
+ * Members are written as ustar headers, with a PAX extended header for the names and
+ * link targets that do not fit, and the archive is ended by tar_writer_close().
+ */
+typedef struct tar_writer tar_writer_t;
+
+/* Adds members to an existing archive, in place of its end-of-archive blocks. */
+#define TAR_WRITER_APPEND 1
+
+/**
+ * Starts writing an archive.
+ *
+ * @param out_fd Where to write: a file, a pipe or a socket, in blocking mode. The archive is
+ *               written from its current offset, except in append mode.
+ * @param flags TAR_WRITER_APPEND to add members to the archive out_fd already holds, which
+ *              must then be an uncompressed archive opened for reading and writing, or zero.
+ *
+ * @return a writer to be finished with tar_writer_close(), or NULL with errno set,
+ *         to EINVAL if the archive to append to is not valid.
+ */
+tar_writer_t *tar_writer_open(int out_fd, int flags);
+
+/**
+ * Adds a regular file whose data is read from a file descriptor.
+ *
+ * @param w A writer.
+ * @param name The path of the member in the archive, of any length.
+ * @param src_fd A regular file, read whole from its start. Its offset is left untouched.
+ * @param mode The permissions of the member, the modification time is taken from src_fd.
+ *
+ * @return zero on success, -1 with errno set otherwise. After a failed write the archive
+ *         is incomplete and every further call fails.
+ */
+int tar_writer_add_file(tar_writer_t *w, const char *name, int src_fd, mode_t mode);
+
+/**
+ * Adds a regular file whose data is in memory.
+ *
+ * @param w A writer.
+ * @param name The path of the member in the archive, of any length.
+ * @param data The data of the member.
+ * @param len Its length.
+ * @param mode The permissions of the member.
+ *
+ * @return zero on success, -1 with errno set otherwise.
+ */
+int tar_writer_add_data(tar_writer_t *w, const char *name, const void *data, size_t len, mode_t mode);
+
+/**
+ * Adds a directory.
+ *
+ * @param w A writer.
+ * @param name The path of the directory, a slash is added at its end if it has none.
+ * @param mode The permissions of the directory.
+ *
+ * @return zero on success, -1 with errno set otherwise.
+ */
+int tar_writer_add_dir(tar_writer_t *w, const char *name, mode_t mode);
+
+/**
+ * Adds a symlink.
+ *
+ * @param w A writer.
+ * @param name The path of the symlink, of any length.
+ * @param target What it points to, of any length.
+ *
+ * @return zero on success, -1 with errno set otherwise.
+ */
+int tar_writer_add_symlink(tar_writer_t *w, const char *name, const char *target);
+
+/**
+ * Ends the archive with its two zero blocks, padded to a whole record of 10240 bytes as
+ * tar does, writes what is left in the buffer and frees the writer. out_fd stays open.
+ *
+ * @param w A writer, or NULL.
+ *
+ * @return zero on success, -1 with errno set if the archive could not be written whole.
+ */
+int tar_writer_close(tar_writer_t *w);
+
+#ifdef __cplusplus
+}
 #endif
+
+#endif
\ No newline at end of file
@@ -0,0 +1,300 @@
+#ifndef LIB_TAR_HPP
+#define LIB_TAR_HPP
+
+/*
+ * A C++17 layer over the handle API of lib_tar.h.
+ *
+ * tar::archive owns a handle and closes it, and can only be moved. Its
+ * entries() and list() are ranges walking the index in place: an entry is
+ * a few words pointing into the handle, its name a std::string_view that
+ * stays valid as long as the archive. Reads go into a caller's span. An
+ * archive held in memory, as open_mmap() makes it, also hands out the data
+ * of a member as a span straight into the mapping; data() refuses the
+ * other handles rather than keep a copy of every member asked for, and
+ * read() is the way there. Iterating and reading allocate nothing. With
+ * C++20 tar::span is std::span.
+ *
+ * Failures to open throw std::system_error, and the other failures of the
+ * C API throw tar::error carrying its return code. Indexes past the end
+ * throw std::out_of_range, and data() on a handle not in memory
+ * std::logic_error.
+ */
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <stdexcept>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#if __cplusplus > 201703L && __has_include(<span>)
+#include <span>
+#endif
+
+#include "lib_tar.h"
+
+namespace tar {
+
+#ifdef __cpp_lib_span
+template <class T>
+using span = std::span<T>;
+#else
+/* The part of std::span used here. */
+template <class T>
+class span {
+public:
+    constexpr span() noexcept = default;
+    constexpr span(T *data, std::size_t size) noexcept : data_(data), size_(size) {}
+    template <std::size_t N>
+    constexpr span(T (&array)[N]) noexcept : data_(array), size_(N) {}
+    template <class C, class = decltype(std::declval<C &>().data())>
+    constexpr span(C &container) noexcept : data_(container.data()), size_(container.size()) {}
+
+    constexpr T *data() const noexcept { return data_; }
+    constexpr std::size_t size() const noexcept { return size_; }
+    constexpr bool empty() const noexcept { return size_ == 0; }
+    constexpr T *begin() const noexcept { return data_; }
+    constexpr T *end() const noexcept { return data_ + size_; }
+    constexpr T &operator[](std::size_t i) const noexcept { return data_[i]; }
+    constexpr span first(std::size_t n) const noexcept { return span(data_, n); }
+    constexpr span subspan(std::size_t offset) const noexcept { return span(data_ + offset, size_ - offset); }
+
+private:
+    T *data_ = nullptr;
+    std::size_t size_ = 0;
+};
+#endif
+
+/* The data of a member. */
+using bytes = span<const std::uint8_t>;
+
+/* A failure of the C API, with the value it returned. */
+class error : public std::runtime_error {
+public:
+    error(const char *what, int code) : std::runtime_error(what), code_(code) {}
+    int code() const noexcept { return code_; }
+
+private:
+    int code_;
+};
+
+/* An entry of the index of an archive, valid as long as the archive. Its name and link
+ * target are null-terminated, so name().data() can be handed back to the path functions. */
+class entry {
+public:
+    entry() noexcept = default;
+    entry(tar_archive_t *archive, std::size_t index) : archive_(archive), index_(index) {
+        if (!tar_entry_at(archive, index, &raw_))
+            throw std::out_of_range("tar::entry");
+    }
+
+    std::string_view name() const noexcept { return raw_.name; }
+    std::string_view linkname() const noexcept { return raw_.linkname; }
+    char type() const noexcept { return raw_.typeflag; }
+    bool is_file() const noexcept { return raw_.typeflag == REGTYPE || raw_.typeflag == AREGTYPE; }
+    bool is_dir() const noexcept { return raw_.typeflag == DIRTYPE; }
+    bool is_symlink() const noexcept { return raw_.typeflag == SYMTYPE; }
+    bool is_hardlink() const noexcept { return raw_.typeflag == LNKTYPE; }
+    std::uint64_t size() const noexcept { return raw_.size; }
+    std::uint64_t header_offset() const noexcept { return raw_.header_offset; }
+    std::uint64_t data_offset() const noexcept { return raw_.data_offset; }
+    std::size_t index() const noexcept { return index_; }
+
+    /* The data of a regular file, empty for the other entries, from an archive held in
+     * memory only. Links are not followed. */
+    bytes data() const {
+        if (!tar_in_memory(archive_))
+            throw std::logic_error("tar::entry::data needs an archive in memory, use archive::read");
+        const std::uint8_t *data;
+        std::size_t len;
+        int ret = tar_map_entry(archive_, index_, &data, &len);
+        if (ret == -1)
+            return bytes();
+        if (ret != 0)
+            throw error("tar_map_entry", ret);
+        return bytes(data, len);
+    }
+
+private:
+    tar_archive_t *archive_ = nullptr;
+    std::size_t index_ = 0;
+    tar_entry_t raw_ = {};
+};
+
+/* Every entry of an archive, in the order of the archive. */
+class entry_range {
+public:
+    class iterator {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = entry;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = entry;
+
+        iterator() noexcept = default;
+        iterator(tar_archive_t *archive, std::size_t index) noexcept : archive_(archive), index_(index) {}
+
+        entry operator*() const { return entry(archive_, index_); }
+        iterator &operator++() noexcept {
+            index_++;
+            return *this;
+        }
+        iterator operator++(int) noexcept {
+            iterator old = *this;
+            index_++;
+            return old;
+        }
+        bool operator==(const iterator &other) const noexcept { return index_ == other.index_; }
+        bool operator!=(const iterator &other) const noexcept { return index_ != other.index_; }
+
+    private:
+        tar_archive_t *archive_ = nullptr;
+        std::size_t index_ = 0;
+    };
+
+    explicit entry_range(tar_archive_t *archive) noexcept : archive_(archive) {}
+
+    iterator begin() const noexcept { return iterator(archive_, 0); }
+    iterator end() const noexcept { return iterator(archive_, size()); }
+    std::size_t size() const noexcept { return tar_entry_count(archive_); }
+    bool empty() const noexcept { return size() == 0; }
+    /* throws std::out_of_range past the end */
+    entry operator[](std::size_t index) const { return entry(archive_, index); }
+
+private:
+    tar_archive_t *archive_;
+};
+
+/* The full paths of the entries of a directory, as list_next() returns them. */
+class list_range {
+public:
+    class iterator {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = std::string_view;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = std::string_view;
+
+        iterator() noexcept = default;
+        explicit iterator(const tar_list_cursor_t &cursor) noexcept : cursor_(cursor), name_(list_next(&cursor_)) {}
+
+        std::string_view operator*() const noexcept { return name_; }
+        iterator &operator++() noexcept {
+            name_ = list_next(&cursor_);
+            return *this;
+        }
+        void operator++(int) noexcept { ++*this; }
+        /* only tells whether both are at the end, which is what a loop asks */
+        bool operator==(const iterator &other) const noexcept { return (name_ == nullptr) == (other.name_ == nullptr); }
+        bool operator!=(const iterator &other) const noexcept { return !(*this == other); }
+
+    private:
+        tar_list_cursor_t cursor_ = {};
+        const char *name_ = nullptr;
+    };
+
+    list_range(tar_archive_t *archive, const char *path) noexcept {
+        found_ = list_begin(archive, const_cast<char *>(path), &cursor_) != 0;
+    }
+
+    iterator begin() const noexcept { return found_ ? iterator(cursor_) : iterator(); }
+    iterator end() const noexcept { return iterator(); }
+    /* false if there is no directory at the path */
+    explicit operator bool() const noexcept { return found_; }
+
+private:
+    tar_list_cursor_t cursor_ = {};
+    bool found_ = false;
+};
+
+/* What read() wrote, and what is left of the file after it. */
+struct read_result {
+    span<std::uint8_t> data;
+    std::uint64_t remaining;
+};
+
+/* A handle on an archive, closed when it goes out of scope. */
+class archive {
+public:
+    /* Indexes an archive, see tar_open(). The file descriptor is not owned. */
+    static archive open(int tar_fd) { return archive(check(tar_open(tar_fd), "tar_open")); }
+
+    /* Indexes an archive held in memory, see tar_open_mmap(). */
+    static archive open_mmap(int tar_fd) { return archive(check(tar_open_mmap(tar_fd), "tar_open_mmap")); }
+
+    /* Maps or builds the index of an archive, see tar_open_index(). */
+    static archive open_index(int tar_fd, const char *idx_path) {
+        return archive(check(tar_open_index(tar_fd, idx_path), "tar_open_index"));
+    }
+
+    /* Takes over a handle returned by the C API. */
+    explicit archive(tar_archive_t *handle) noexcept : handle_(handle) {}
+    archive(archive &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+    archive &operator=(archive &&other) noexcept {
+        if (this != &other) {
+            tar_close(handle_);
+            handle_ = std::exchange(other.handle_, nullptr);
+        }
+        return *this;
+    }
+    archive(const archive &) = delete;
+    archive &operator=(const archive &) = delete;
+    ~archive() { tar_close(handle_); }
+
+    tar_archive_t *get() const noexcept { return handle_; }
+    /* Gives the handle back to the caller, who then closes it. */
+    tar_archive_t *release() noexcept { return std::exchange(handle_, nullptr); }
+
+    /* The paths are null-terminated, as the C API wants them; they are not modified. */
+    bool exists(const char *path) const noexcept { return exists_h(handle_, const_cast<char *>(path)) != 0; }
+    bool is_dir(const char *path) const noexcept { return is_dir_h(handle_, const_cast<char *>(path)) != 0; }
+    bool is_file(const char *path) const noexcept { return is_file_h(handle_, const_cast<char *>(path)) != 0; }
+    bool is_symlink(const char *path) const noexcept { return is_symlink_h(handle_, const_cast<char *>(path)) != 0; }
+
+    entry_range entries() const noexcept { return entry_range(handle_); }
+
+    /* The entries of the directory at path, "" for the top of the archive. */
+    list_range list(const char *path) const noexcept { return list_range(handle_, path); }
+
+    /* Reads a file into dest from offset, following links as read_file() does. Throws
+     * tar::error with code -1 if there is no file at path, -2 if offset is past its end. */
+    read_result read(const char *path, span<std::uint8_t> dest, std::uint64_t offset = 0) const {
+        std::size_t len = dest.size();
+        ssize_t ret = read_file_h(handle_, const_cast<char *>(path), offset, dest.data(), &len);
+        if (ret < 0)
+            throw error("read_file_h", static_cast<int>(ret));
+        return read_result{dest.first(len), static_cast<std::uint64_t>(ret)};
+    }
+
+    /* Whether data() can be used, see tar_in_memory(). */
+    bool in_memory() const noexcept { return tar_in_memory(handle_) != 0; }
+
+    /* The whole data of a file, following links, see tar_map_file(). Only for an archive
+     * held in memory: on the others read() fills a buffer of the caller's instead. */
+    bytes data(const char *path) const {
+        if (!in_memory())
+            throw std::logic_error("tar::archive::data needs an archive in memory, use read");
+        const std::uint8_t *data;
+        std::size_t len;
+        int ret = tar_map_file(handle_, const_cast<char *>(path), &data, &len);
+        if (ret != 0)
+            throw error("tar_map_file", ret);
+        return bytes(data, len);
+    }
+
+private:
+    static tar_archive_t *check(tar_archive_t *handle, const char *what) {
+        if (handle == nullptr)
+            throw std::system_error(errno ? errno : EINVAL, std::generic_category(), what);
+        return handle;
+    }
+
+    tar_archive_t *handle_ = nullptr;
+};
+
+} // namespace tar
+
+#endif
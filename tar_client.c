@@ -0,0 +1,292 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "tar_server.h"
+#include <unistd.h>
+#include <getopt.h>
+
+#define READ_MAX (64 << 10)
+
+/**
+ * Loads a tar_server with requests and reports their latencies, one JSON object per line
+ * as bench does.
+ *
+ * Usage: tar_client [-s socket_path] [-a archive] [-t threads] [-n requests] [-w stat|list|read|mix] [-r seed]
+ *
+ * The paths are found first, by walking the entries of the archive through the server.
+ * Each thread then opens a connection of its own and sends its requests one at a time,
+ * on paths drawn at random: "mix" sends 60% reads, 30% stats and 10% lists. A read asks
+ * for a whole file, up to 64 KiB, and reads the data from the archive itself when the
+ * server hands over its descriptor rather than the data.
+ */
+
+enum { OP_STAT, OP_LIST, OP_READ, NB_OPS };
+
+static const char *op_names[NB_OPS] = {"stat", "list", "read"};
+
+struct paths {
+    char **names;
+    long n;
+    long cap;
+};
+
+struct params {
+    const char *socket_path;
+    unsigned archive;
+    long requests;
+    int workload;              /* one of the OP_*, or NB_OPS for the mix */
+    unsigned seed;
+    struct paths files;
+    struct paths dirs;
+};
+
+struct worker {
+    const struct params *params;
+    unsigned seed;
+    double *ns[NB_OPS];        /* the latencies of the requests of each kind */
+    long n[NB_OPS];
+    long errors;
+    pthread_t thread;
+};
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/* Reports the distribution of n latencies, sorting them on the way. */
+static void report_latencies(const char *bench, const char *impl, double *ns, long n, double wall_ns) {
+    double total = 0;
+    for (long i = 0; i < n; i++)
+        total += ns[i];
+    qsort(ns, n, sizeof(double), compare_doubles);
+    printf("{\"bench\":\"%s\",\"impl\":\"%s\",\"n\":%ld,\"ns_per_op\":%.2f,\"ops_per_s\":%.0f,"
+           "\"p50_ns\":%.0f,\"p90_ns\":%.0f,\"p99_ns\":%.0f,\"max_ns\":%.0f}\n",
+           bench, impl, n, total / n, n / (wall_ns / 1e9), ns[n / 2], ns[n * 9 / 10], ns[n * 99 / 100], ns[n - 1]);
+}
+
+static void add_path(struct paths *paths, const char *name) {
+    if (paths->n == paths->cap) {
+        paths->cap = paths->cap ? paths->cap * 2 : 256;
+        paths->names = realloc(paths->names, paths->cap * sizeof(char *));
+    }
+    paths->names[paths->n++] = strdup(name);
+}
+
+static int connect_server(const char *socket_path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        perror(socket_path);
+        exit(1);
+    }
+    return fd;
+}
+
+/* Sends a request and waits for its reply, into reply. A descriptor passed with the reply
+ * is stored in *passed_fd. Returns the length of the reply, or -1 if the server is gone. */
+static ssize_t call(int fd, uint32_t op, uint32_t archive, uint32_t flags, uint64_t offset, uint64_t len,
+                    const char *path, struct tar_reply *reply, int *passed_fd) {
+    char request[sizeof(struct tar_request) + 4096];
+    struct tar_request *req = (struct tar_request *) request;
+    size_t lenPath = strlen(path) + 1;
+    if (lenPath > sizeof(request) - sizeof(*req))
+        return -1;
+    *req = (struct tar_request) {.op = op, .archive = archive, .flags = flags, .offset = offset, .len = len};
+    memcpy(req->path, path, lenPath);
+    if (send(fd, request, sizeof(*req) + lenPath, MSG_NOSIGNAL) < 0)
+        return -1;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct iovec iov = {reply, TAR_SERVER_MSG};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf, .msg_controllen = sizeof(control.buf)};
+    ssize_t got;
+    while ((got = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+        ;
+    if (got < (ssize_t) sizeof(*reply))
+        return -1;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        int passed;
+        memcpy(&passed, CMSG_DATA(cmsg), sizeof(int));
+        if (passed_fd != NULL && *passed_fd < 0)
+            *passed_fd = passed;
+        else
+            close(passed);
+    }
+    return got;
+}
+
+/* Walks every entry of the archive, sorting the paths into files and directories. The walk
+ * is flat rather than down from the top, which lists nothing when the directories of the
+ * archive have no entries of their own. */
+static void find_paths(struct params *params) {
+    int fd = connect_server(params->socket_path);
+    struct tar_reply *reply = malloc(TAR_SERVER_MSG);
+    struct tar_reply *stat = malloc(TAR_SERVER_MSG);
+    add_path(&params->dirs, "");
+    uint64_t skip = 0;
+    for (;;) {
+        ssize_t len = call(fd, TAR_REQ_ENTRIES, params->archive, 0, skip, 0, "", reply, NULL);
+        if (len < 0 || reply->status < 0)
+            break;
+        const char *name = reply->data;
+        for (int64_t i = 0; i < reply->status; i++) {
+            if (call(fd, TAR_REQ_STAT, params->archive, 0, 0, 0, name, stat, NULL) >= 0) {
+                if (stat->status & TAR_STAT_DIR)
+                    add_path(&params->dirs, name);
+                else if (stat->status & TAR_STAT_FILE)
+                    add_path(&params->files, name);
+            }
+            name += strlen(name) + 1;
+        }
+        if (!(reply->flags & TAR_REPLY_MORE))
+            break;
+        skip += reply->status;
+    }
+    free(stat);
+    free(reply);
+    close(fd);
+}
+
+static void *run_worker(void *arg) {
+    struct worker *w = arg;
+    const struct params *params = w->params;
+    int fd = connect_server(params->socket_path);
+    int archive_fd = -1;
+    struct tar_reply *reply = malloc(TAR_SERVER_MSG);
+    uint8_t *buf = malloc(READ_MAX);
+    for (long i = 0; i < params->requests; i++) {
+        int op = params->workload;
+        if (op == NB_OPS) {
+            int draw = rand_r(&w->seed) % 10;
+            op = draw < 6 ? OP_READ : draw < 9 ? OP_STAT : OP_LIST;
+        }
+        if (params->files.n == 0 || params->dirs.n == 0)
+            op = OP_LIST;
+        const struct paths *paths = op == OP_LIST ? &params->dirs : &params->files;
+        const char *path = paths->names[rand_r(&w->seed) % paths->n];
+        double start = now_ns();
+        ssize_t len;
+        int ok;
+        if (op == OP_STAT) {
+            len = call(fd, TAR_REQ_STAT, params->archive, 0, 0, 0, path, reply, NULL);
+            ok = len >= 0 && (reply->status & TAR_STAT_FILE);
+        } else if (op == OP_LIST) {
+            len = call(fd, TAR_REQ_LIST, params->archive, 0, 0, 0, path, reply, NULL);
+            ok = len >= 0 && reply->status >= 0;
+        } else {
+            len = call(fd, TAR_REQ_READ, params->archive, archive_fd < 0 ? TAR_REQ_WANT_FD : 0, 0, READ_MAX, path, reply, &archive_fd);
+            ok = len >= 0 && reply->status >= 0;
+            if (ok && (reply->flags & TAR_REPLY_FD))
+                ok = archive_fd >= 0 && pread(archive_fd, buf, reply->size, reply->offset) == (ssize_t) reply->size;
+            else if (ok)
+                ok = len == (ssize_t) (sizeof(*reply) + reply->size);
+        }
+        w->ns[op][w->n[op]++] = now_ns() - start;
+        if (len < 0) {
+            fprintf(stderr, "the server closed the connection\n");
+            exit(1);
+        }
+        w->errors += !ok;
+    }
+    if (archive_fd >= 0)
+        close(archive_fd);
+    free(buf);
+    free(reply);
+    close(fd);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    struct params params = {.socket_path = TAR_SERVER_SOCKET, .requests = 100000, .workload = NB_OPS, .seed = 42};
+    int nthreads = 4;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:a:t:n:w:r:")) != -1) {
+        switch (opt) {
+        case 's': params.socket_path = optarg; break;
+        case 'a': params.archive = atoi(optarg); break;
+        case 't': nthreads = atoi(optarg); break;
+        case 'n': params.requests = atol(optarg); break;
+        case 'w':
+            params.workload = strcmp(optarg, "stat") == 0 ? OP_STAT : strcmp(optarg, "list") == 0 ? OP_LIST
+                            : strcmp(optarg, "read") == 0 ? OP_READ : strcmp(optarg, "mix") == 0 ? NB_OPS : -1;
+            break;
+        case 'r': params.seed = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-s socket_path] [-a archive] [-t threads] [-n requests] [-w stat|list|read|mix] [-r seed]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (nthreads < 1 || params.requests < 1 || params.workload < 0) {
+        fprintf(stderr, "%s: invalid parameters\n", argv[0]);
+        return 1;
+    }
+
+    find_paths(&params);
+    if (params.files.n == 0 && params.dirs.n <= 1) {
+        fprintf(stderr, "%s: nothing to ask for in archive %u\n", argv[0], params.archive);
+        return 1;
+    }
+    struct worker *workers = calloc(nthreads, sizeof(struct worker));
+    double start = now_ns();
+    for (int t = 0; t < nthreads; t++) {
+        workers[t].params = &params;
+        workers[t].seed = params.seed + t;
+        for (int op = 0; op < NB_OPS; op++)
+            workers[t].ns[op] = malloc(params.requests * sizeof(double));
+        pthread_create(&workers[t].thread, NULL, run_worker, &workers[t]);
+    }
+    long errors = 0;
+    for (int t = 0; t < nthreads; t++) {
+        pthread_join(workers[t].thread, NULL);
+        errors += workers[t].errors;
+    }
+    double wall = now_ns() - start;
+
+    char impl[32];
+    snprintf(impl, sizeof(impl), "%d_clients", nthreads);
+    double *all = malloc(nthreads * params.requests * sizeof(double));
+    long nbAll = 0;
+    for (int op = 0; op < NB_OPS; op++) {
+        long n = 0;
+        double *ns = malloc(nthreads * params.requests * sizeof(double));
+        for (int t = 0; t < nthreads; t++) {
+            memcpy(ns + n, workers[t].ns[op], workers[t].n[op] * sizeof(double));
+            n += workers[t].n[op];
+        }
+        memcpy(all + nbAll, ns, n * sizeof(double));
+        nbAll += n;
+        if (n > 0) {
+            char bench[32];
+            snprintf(bench, sizeof(bench), "server_%s", op_names[op]);
+            report_latencies(bench, impl, ns, n, wall);
+        }
+        free(ns);
+    }
+    report_latencies("server", impl, all, nbAll, wall);
+    printf("{\"bench\":\"server_errors\",\"impl\":\"%s\",\"n\":%ld,\"files\":%ld,\"dirs\":%ld}\n",
+           impl, errors, params.files.n, params.dirs.n);
+    free(all);
+    for (int t = 0; t < nthreads; t++)
+        for (int op = 0; op < NB_OPS; op++)
+            free(workers[t].ns[op]);
+    free(workers);
+    return errors != 0;
+}
@@ -0,0 +1,328 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include "lib_tar.h"
+#include "tar_server.h"
+#include <unistd.h>
+#include <getopt.h>
+
+#define MAX_EVENTS 64
+#define MAX_BATCH 64
+
+/**
+ * Serves the entries of archives to the processes of the host, over a Unix domain socket.
+ *
+ * Usage: tar_server [-s socket_path] archive...
+ *
+ * Each archive is indexed once, at start, and the requests of all the clients are answered
+ * from those indexes by a single thread waiting on epoll. The data of a small file, or of
+ * a file in a compressed archive, comes inline in the reply, straight from the mapping
+ * of the archive. For a larger one the reply gives where the data lies in the archive
+ * file, whose descriptor is passed to the client with SCM_RIGHTS the first time, so that
+ * the client reads it with pread on its own. See tar_server.h for the protocol.
+ */
+
+struct archive {
+    int fd;
+    tar_archive_t *handle;
+};
+
+struct client {
+    int fd;
+    uint8_t *pending;          /* a reply that could not be sent yet, or NULL */
+    size_t lenPending;
+    int passFd;                /* the descriptor to pass with it, or -1 */
+};
+
+static struct archive *archives;
+static int nbArchives;
+static volatile sig_atomic_t stopping;
+
+static void stop(int sig) {
+    (void) sig;
+    stopping = 1;
+}
+
+/* Sends a reply made of a header and data, with a descriptor when pass_fd is not -1.
+ * Returns 0 once sent, 1 if the socket is full, -1 if the client is gone. */
+static int send_reply(int fd, const void *header, size_t len_header, const void *data, size_t len_data, int pass_fd) {
+    struct iovec iov[2] = {{(void *) header, len_header}, {(void *) data, len_data}};
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = len_data > 0 ? 2 : 1};
+    if (pass_fd >= 0) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &pass_fd, sizeof(int));
+    }
+    for (;;) {
+        if (sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) >= 0)
+            return 0;
+        if (errno == EINTR)
+            continue;
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+    }
+}
+
+/* Packs names after reply until the message is full, counting them in its status. */
+static size_t add_name(struct tar_reply *reply, size_t used, const char *name) {
+    size_t lenName = strlen(name) + 1;
+    if (used + lenName > TAR_SERVER_MSG) {
+        reply->flags |= TAR_REPLY_MORE;
+        return 0;
+    }
+    memcpy((char *) reply + used, name, lenName);
+    reply->status++;
+    return used + lenName;
+}
+
+/* Answers one request into reply, the data going either after it or to *data. */
+static size_t answer(const struct tar_request *req, size_t len, struct tar_reply *reply, const void **data, size_t *len_data, int *pass_fd) {
+    memset(reply, 0, sizeof(*reply));
+    *data = NULL;
+    *len_data = 0;
+    *pass_fd = -1;
+    if (len <= sizeof(*req) || ((const char *) req)[len - 1] != '\0' || req->archive >= (uint32_t) nbArchives) {
+        reply->status = TAR_REPLY_BAD;
+        return sizeof(*reply);
+    }
+    tar_archive_t *archive = archives[req->archive].handle;
+    char *path = (char *) req->path;
+    uint64_t data_offset, size;
+    switch (req->op) {
+    case TAR_REQ_STAT:
+        if (exists_h(archive, path)) {
+            reply->status = TAR_STAT_EXISTS;
+            reply->status |= is_dir_h(archive, path) ? TAR_STAT_DIR : 0;
+            reply->status |= is_file_h(archive, path) ? TAR_STAT_FILE : 0;
+            reply->status |= is_symlink_h(archive, path) ? TAR_STAT_SYMLINK : 0;
+            if (tar_locate(archive, path, &data_offset, &size) != -1)
+                reply->size = size;
+        }
+        return sizeof(*reply);
+    case TAR_REQ_LIST: {
+        tar_list_cursor_t cursor;
+        if (!list_begin(archive, path, &cursor)) {
+            reply->status = -1;
+            return sizeof(*reply);
+        }
+        const char *name;
+        for (uint64_t skip = 0; skip < req->offset && list_next(&cursor) != NULL; skip++)
+            ;
+        size_t used = sizeof(*reply);
+        while ((name = list_next(&cursor)) != NULL) {
+            size_t next = add_name(reply, used, name);
+            if (next == 0)
+                break;
+            used = next;
+        }
+        return used;
+    }
+    case TAR_REQ_ENTRIES: {
+        /* every entry, those whose directory has no header of its own included */
+        tar_entry_t entry;
+        size_t used = sizeof(*reply);
+        for (uint64_t i = req->offset; tar_entry_at(archive, i, &entry); i++) {
+            size_t next = add_name(reply, used, entry.name);
+            if (next == 0)
+                break;
+            used = next;
+        }
+        return used;
+    }
+    case TAR_REQ_READ: {
+        int located = tar_locate(archive, path, &data_offset, &size);
+        if (located == -1) {
+            reply->status = -1;
+            return sizeof(*reply);
+        }
+        if (req->offset > size) {
+            reply->status = -2;
+            return sizeof(*reply);
+        }
+        uint64_t count = size - req->offset < req->len ? size - req->offset : req->len;
+        if (located == 0 && size > TAR_SERVER_INLINE) {
+            reply->flags = TAR_REPLY_FD;
+            reply->offset = data_offset + req->offset;
+            reply->size = count;
+            reply->status = size - req->offset - count;
+            if (req->flags & TAR_REQ_WANT_FD)
+                *pass_fd = archives[req->archive].fd;
+            return sizeof(*reply);
+        }
+        const uint8_t *file;
+        size_t lenFile;
+        if (tar_map_file(archive, path, &file, &lenFile) != 0) {
+            reply->status = -1;
+            return sizeof(*reply);
+        }
+        if (count > TAR_SERVER_MSG - sizeof(*reply))
+            count = TAR_SERVER_MSG - sizeof(*reply);
+        if (req->offset + count > lenFile) {
+            /* the archive is cut short */
+            reply->status = -1;
+            return sizeof(*reply);
+        }
+        reply->size = count;
+        reply->status = size - req->offset - count;
+        *data = file + req->offset;
+        *len_data = count;
+        return sizeof(*reply);
+    }
+    default:
+        reply->status = TAR_REPLY_BAD;
+        return sizeof(*reply);
+    }
+}
+
+static void drop_client(int epfd, struct client *client) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    free(client->pending);
+    free(client);
+}
+
+/* Answers the requests waiting on a client until its socket is drained or full, at most
+ * MAX_BATCH of them so that one client cannot hold up the others: epoll reports it again.
+ * Returns -1 if the client is to be dropped. */
+static int serve_client(int epfd, struct client *client, uint8_t *request, uint8_t *reply) {
+    if (client->pending != NULL) {
+        int sent = send_reply(client->fd, client->pending, client->lenPending, NULL, 0, client->passFd);
+        if (sent != 0)
+            return sent;
+        free(client->pending);
+        client->pending = NULL;
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = client};
+        epoll_ctl(epfd, EPOLL_CTL_MOD, client->fd, &ev);
+    }
+    for (int n = 0; n < MAX_BATCH; n++) {
+        ssize_t len = recv(client->fd, request, TAR_SERVER_MSG, MSG_DONTWAIT);
+        if (len == 0)
+            return -1;
+        if (len < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+        const void *data;
+        size_t len_data;
+        int pass_fd;
+        size_t len_reply = answer((const struct tar_request *) request, len, (struct tar_reply *) reply, &data, &len_data, &pass_fd);
+        int sent = send_reply(client->fd, reply, len_reply, data, len_data, pass_fd);
+        if (sent < 0)
+            return -1;
+        if (sent > 0) {
+            /* the client does not read its replies: keep this one and stop reading */
+            client->pending = malloc(len_reply + len_data);
+            if (client->pending == NULL)
+                return -1;
+            memcpy(client->pending, reply, len_reply);
+            if (len_data > 0)
+                memcpy(client->pending + len_reply, data, len_data);
+            client->lenPending = len_reply + len_data;
+            client->passFd = pass_fd;
+            struct epoll_event ev = {.events = EPOLLOUT, .data.ptr = client};
+            epoll_ctl(epfd, EPOLL_CTL_MOD, client->fd, &ev);
+            return 0;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *socket_path = TAR_SERVER_SOCKET;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:")) != -1) {
+        switch (opt) {
+        case 's': socket_path = optarg; break;
+        default:
+            fprintf(stderr, "usage: %s [-s socket_path] archive...\n", argv[0]);
+            return 1;
+        }
+    }
+    nbArchives = argc - optind;
+    if (nbArchives < 1) {
+        fprintf(stderr, "usage: %s [-s socket_path] archive...\n", argv[0]);
+        return 1;
+    }
+    archives = calloc(nbArchives, sizeof(struct archive));
+    for (int i = 0; i < nbArchives; i++) {
+        archives[i].fd = open(argv[optind + i], O_RDONLY | O_CLOEXEC);
+        if (archives[i].fd < 0 || (archives[i].handle = tar_open_mmap(archives[i].fd)) == NULL) {
+            fprintf(stderr, "%s: cannot index %s\n", argv[0], argv[optind + i]);
+            return 1;
+        }
+    }
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", argv[0]);
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path);
+    int listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    unlink(socket_path);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(listen_fd, SOMAXCONN) < 0) {
+        perror("socket");
+        return 1;
+    }
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    if (epfd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
+        perror("epoll");
+        return 1;
+    }
+    struct sigaction sa = {.sa_handler = stop};
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    fprintf(stderr, "serving %d archives on %s\n", nbArchives, socket_path);
+
+    uint8_t *request = malloc(TAR_SERVER_MSG);
+    uint8_t *reply = malloc(TAR_SERVER_MSG);
+    struct epoll_event events[MAX_EVENTS];
+    while (!stopping) {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        for (int i = 0; i < n; i++) {
+            struct client *client = events[i].data.ptr;
+            if (client == NULL) {
+                int fd;
+                while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                    client = calloc(1, sizeof(struct client));
+                    struct epoll_event cev = {.events = EPOLLIN, .data.ptr = client};
+                    if (client == NULL || epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &cev) < 0) {
+                        free(client);
+                        close(fd);
+                        continue;
+                    }
+                    client->fd = fd;
+                    client->passFd = -1;
+                }
+                continue;
+            }
+            if (serve_client(epfd, client, request, reply) < 0)
+                drop_client(epfd, client);
+        }
+    }
+
+    unlink(socket_path);
+    for (int i = 0; i < nbArchives; i++) {
+        tar_close(archives[i].handle);
+        close(archives[i].fd);
+    }
+    free(archives);
+    free(request);
+    free(reply);
+    return 0;
+}
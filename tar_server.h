@@ -0,0 +1,62 @@
+#ifndef TAR_SERVER_H
+#define TAR_SERVER_H
+
+#include <stdint.h>
+
+/*
+ * The protocol of tar_server, over a SOCK_SEQPACKET Unix domain socket. Each request is
+ * one message and gets one reply, in the order of the requests.
+ */
+
+#define TAR_SERVER_SOCKET "/tmp/tar_server.sock"
+#define TAR_SERVER_MSG (64 << 10)        /* the largest message, either way */
+#define TAR_SERVER_INLINE (16 << 10)     /* files up to this size are sent in the reply */
+
+enum {
+    TAR_REQ_STAT = 1,       /* what is at path */
+    TAR_REQ_LIST,           /* the entries of the directory at path */
+    TAR_REQ_READ,           /* the data of the file at path */
+    TAR_REQ_ENTRIES,        /* the paths of all the entries, in archive order; path is "" */
+};
+
+/* READ: the client has no descriptor on the archive yet, pass one with the reply. */
+#define TAR_REQ_WANT_FD 1
+
+struct tar_request {
+    uint32_t op;
+    uint32_t archive;       /* the position of the archive on the command line of the server */
+    uint32_t flags;
+    uint32_t pad;
+    uint64_t offset;        /* READ: where to start in the file, LIST and ENTRIES: the number
+                             * of names to skip */
+    uint64_t len;           /* READ: the most bytes wanted */
+    char path[];            /* null-terminated */
+};
+
+/* The status of a STAT reply. */
+#define TAR_STAT_EXISTS  1
+#define TAR_STAT_DIR     2
+#define TAR_STAT_FILE    4
+#define TAR_STAT_SYMLINK 8
+
+/* READ: the data is to be read from the archive descriptor, at offset, rather than inline. */
+#define TAR_REPLY_FD   1
+/* LIST and ENTRIES: more names follow, to be asked for by skipping those already received. */
+#define TAR_REPLY_MORE 2
+
+/* The status of any reply to a malformed request or for an unknown archive. */
+#define TAR_REPLY_BAD  (-3)
+
+struct tar_reply {
+    int64_t status;         /* STAT: the TAR_STAT_* bits, LIST: the number of names, or -1 if
+                             * there is no directory at path, ENTRIES: the number of names,
+                             * READ: what read_file() returns */
+    uint64_t size;          /* STAT: the size of a file, READ: the number of bytes of data */
+    uint64_t offset;        /* READ with TAR_REPLY_FD: where the data starts in the archive */
+    uint32_t flags;
+    uint32_t pad;
+    char data[];            /* LIST and ENTRIES: the names, each null-terminated, READ: the
+                             * data, inline */
+};
+
+#endif
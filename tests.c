@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -6,8 +7,15 @@
 #include <string.h>
 #include "lib_tar.h"
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <zlib.h>
+#include <ftw.h>
+#include <stddef.h>
 
 #define BUFSIZE 100
+#define NB_THREADS 8
+#define NB_ROUNDS 200
 
 /**
  * You are free to use this file to write tests for your implementation
@@ -28,6 +36,986 @@ void debug_dump(const uint8_t *bytes, size_t len) {
     }
 }
 
+/* Everything the fd-based API answers about one path. */
+struct answers {
+    int check;
+    int exists;
+    int is_dir;
+    int is_file;
+    int is_symlink;
+    int list;
+    size_t no_entries;
+    char entries[10][100];
+    ssize_t read;
+    size_t len;
+    uint8_t data[1000];
+};
+
+struct stress {
+    int fd;
+    char *path;
+    const struct answers *expected;
+    int failures;
+};
+
+void collect_answers(int fd, char *path, struct answers *a) {
+    char *entries[10];
+    for (int i = 0; i < 10; i++)
+        entries[i] = a->entries[i];
+    a->check = check_archive(fd);
+    a->exists = exists(fd,path);
+    a->is_dir = is_dir(fd,path);
+    a->is_file = is_file(fd,path);
+    a->is_symlink = is_symlink(fd,path);
+    a->no_entries = 10;
+    a->list = list(fd,path,entries,&a->no_entries);
+    a->len = sizeof(a->data);
+    a->read = read_file(fd,path,0,a->data,&a->len);
+}
+
+int same_answers(const struct answers *a, const struct answers *b) {
+    if (a->check != b->check || a->exists != b->exists || a->is_dir != b->is_dir || a->is_file != b->is_file
+        || a->is_symlink != b->is_symlink || a->list != b->list || a->no_entries != b->no_entries || a->read != b->read)
+        return 0;
+    for (int i = 0; i < a->no_entries; i++)
+        if (strcmp(a->entries[i],b->entries[i]) != 0)
+            return 0;
+    return a->read < 0 || (a->len == b->len && memcmp(a->data,b->data,a->len) == 0);
+}
+
+void *stress_thread(void *arg) {
+    struct stress *s = arg;
+    struct answers got;
+    for (int i = 0; i < NB_ROUNDS; i++) {
+        memset(&got, 0, sizeof(got));
+        collect_answers(s->fd,s->path,&got);
+        if (!same_answers(&got,s->expected))
+            s->failures++;
+    }
+    return NULL;
+}
+
+/* Corrupts pairs of headers of a copy of the archive, check_archive_parallel must
+ * report the same error as check_archive. */
+int corrupt_and_check(int fd) {
+    static const int fields[] = {257, 263, 148}; /* magic, version, chksum */
+    char path[] = "/tmp/lib_tar_testsXXXXXX";
+    int copy = mkstemp(path);
+    int failures = 0;
+    if (copy == -1) {
+        perror("mkstemp");
+        return 1;
+    }
+    unlink(path);
+    struct stat st;
+    fstat(fd,&st);
+    uint8_t *bytes = malloc(st.st_size);
+    if (pread(fd,bytes,st.st_size,0) != st.st_size) {
+        perror("pread");
+        return 1;
+    }
+    off_t offsets[64];
+    int nb = 0;
+    for (off_t off = 0; off + 512 <= st.st_size && nb < 64 && bytes[off] != 0; nb++) {
+        offsets[nb] = off;
+        off += 512 + (tar_parse_octal((char *) bytes + off + 124, 12) + 511) / 512 * 512;
+    }
+    for (int k = 0; k < nb; k++) {
+        for (int f = 0; f < 3; f++) {
+            if (pwrite(copy,bytes,st.st_size,0) != st.st_size)
+                return failures + 1;
+            pwrite(copy,"X",1,offsets[k] + fields[f]);
+            if (k + 2 < nb)
+                pwrite(copy,"X",1,offsets[k + 2] + fields[(f + 1) % 3]);
+            int expected = check_archive(copy);
+            for (int n = 1; n <= 3; n++)
+                if (check_archive_parallel(copy,n) != expected) {printf("check_archive_parallel differs on header %d\n", k); failures++;}
+        }
+    }
+    free(bytes);
+    close(copy);
+    return failures;
+}
+
+/* Feeds the archive to a pipe, to iterate over input that cannot be seeked. */
+struct feed {
+    int fd;
+    int out;
+};
+
+void *feed_pipe(void *arg) {
+    struct feed *feed = arg;
+    uint8_t buf[4096];
+    ssize_t n;
+    off_t off = 0;
+    while ((n = pread(feed->fd,buf,sizeof(buf),off)) > 0) {
+        if (write(feed->out,buf,n) != n)
+            break;
+        off += n;
+    }
+    close(feed->out);
+    return NULL;
+}
+
+/* Walks the archive with a small buffer, the entries and their data must match what
+ * check_archive and read_file report. */
+int iterate_and_compare(int fd, int input, size_t bufsize, int expected) {
+    int failures = 0;
+    int nb = 0;
+    int ret;
+    tar_entry_t entry;
+    tar_iter_t *it = tar_iter_open(input,bufsize,TAR_ITER_CHECK);
+    if (it == NULL)
+        return 1;
+    while ((ret = tar_iter_next(it,&entry)) > 0) {
+        nb++;
+        if (!exists(fd,(char *) entry.name)) {printf("tar_iter_next returned unknown %s\n", entry.name); failures++;}
+        if (entry.typeflag != REGTYPE && entry.typeflag != AREGTYPE)
+            continue;
+        uint8_t *expected_data = malloc(entry.size + 1);
+        uint8_t *data = malloc(entry.size + 1);
+        size_t len = entry.size;
+        size_t done = 0;
+        ssize_t n;
+        read_file(fd,(char *) entry.name,0,expected_data,&len);
+        while ((n = tar_iter_read(it,data + done,7)) > 0)
+            done += n;
+        if (done != len || memcmp(data,expected_data,len) != 0) {printf("tar_iter_read differs on %s\n", entry.name); failures++;}
+        free(data);
+        free(expected_data);
+    }
+    if ((ret < 0 ? ret : nb) != expected) {printf("tar_iter_next returned %d entries instead of %d\n", ret < 0 ? ret : nb, expected); failures++;}
+    tar_iter_close(it);
+    return failures;
+}
+
+/* A copy of the archive compressed with gzip, as two members to also go from one to the next. */
+int gzip_copy(int fd) {
+    char path[] = "/tmp/lib_tar_testsXXXXXX";
+    int copy = mkstemp(path);
+    if (copy == -1) {
+        perror("mkstemp");
+        return -1;
+    }
+    unlink(path);
+    struct stat st;
+    fstat(fd,&st);
+    uint8_t *bytes = malloc(st.st_size);
+    uLong bound = compressBound(st.st_size) + 64;
+    uint8_t *out = malloc(bound);
+    if (pread(fd,bytes,st.st_size,0) != st.st_size)
+        return -1;
+    off_t half = st.st_size / 1024 * 512;
+    off_t starts[] = {0, half, st.st_size};
+    for (int m = 0; m < 2; m++) {
+        z_stream z;
+        memset(&z, 0, sizeof(z));
+        deflateInit2(&z,Z_DEFAULT_COMPRESSION,Z_DEFLATED,15 + 16,8,Z_DEFAULT_STRATEGY);
+        z.next_in = bytes + starts[m];
+        z.avail_in = starts[m + 1] - starts[m];
+        z.next_out = out;
+        z.avail_out = bound;
+        deflate(&z,Z_FINISH);
+        if (write(copy,out,bound - z.avail_out) < 0)
+            return -1;
+        deflateEnd(&z);
+    }
+    free(bytes);
+    free(out);
+    return copy;
+}
+
+/* Appends a ustar entry and its data to an archive being written at *off. */
+void append_entry(int fd, off_t *off, char typeflag, const char *name, const char *linkname, const void *data, size_t len) {
+    tar_header_t header;
+    memset(&header, 0, sizeof(header));
+    /* the fields are not null-terminated when full */
+    memcpy(header.name, name, strnlen(name, sizeof(header.name)));
+    if (linkname != NULL)
+        memcpy(header.linkname, linkname, strnlen(linkname, sizeof(header.linkname)));
+    memcpy(header.mode, "0000644", 8);
+    snprintf(header.size, sizeof(header.size), "%011lo", (unsigned long) len);
+    header.typeflag = typeflag;
+    memcpy(header.magic, TMAGIC, TMAGLEN);
+    memcpy(header.version, TVERSION, TVERSLEN);
+    snprintf(header.chksum, sizeof(header.chksum), "%06o", tar_checksum(&header));
+    header.chksum[7] = ' ';
+    if (pwrite(fd,&header,sizeof(header),*off) < 0 || pwrite(fd,data,len,*off + 512) < 0)
+        perror("pwrite");
+    *off += 512 + (len + 511) / 512 * 512;
+}
+
+/* Rewrites the size of the header at off in base 256 and fixes its checksum. */
+void set_size_base256(int fd, off_t off, uint64_t size) {
+    tar_header_t header;
+    if (pread(fd,&header,sizeof(header),off) != sizeof(header))
+        return;
+    memset(header.size, 0, sizeof(header.size));
+    header.size[0] = (char) 0x80;
+    for (int i = 0; i < 8; i++)
+        header.size[11 - i] = (char) (size >> (8 * i));
+    snprintf(header.chksum, sizeof(header.chksum), "%06o", tar_checksum(&header));
+    header.chksum[7] = ' ';
+    if (pwrite(fd,&header,sizeof(header),off) < 0)
+        perror("pwrite");
+}
+
+/* Long names in all their forms: GNU, PAX, ustar prefix, and a size in base 256.
+ * The same questions must get the same answers with and without the index. */
+int check_long_names(void) {
+    char path[] = "/tmp/lib_tar_testsXXXXXX";
+    int fd = mkstemp(path);
+    int failures = 0;
+    if (fd == -1) {
+        perror("mkstemp");
+        return 1;
+    }
+    unlink(path);
+    char gnu_name[200], pax_name[320], pax_record[400], dir[160];
+    memset(dir, 'd', sizeof(dir));
+    strcpy(dir + 150, "/");
+    snprintf(gnu_name, sizeof(gnu_name), "%sgnu.txt", dir);
+    snprintf(pax_name, sizeof(pax_name), "%spax-link-%0150d", dir, 0);
+    char record[360];
+    snprintf(record, sizeof(record), " path=%s\n", pax_name);
+    snprintf(pax_record, sizeof(pax_record), "%zu%s", strlen(record) + 3, record);
+    char linkpath[] = "20 linkpath=gnu.txt\n";
+    off_t off = 0;
+    append_entry(fd,&off,DIRTYPE,"x",NULL,"",0);
+    /* the directory itself, with its long name in a GNU header */
+    append_entry(fd,&off,'L',"././@LongLink",NULL,dir,strlen(dir) + 1);
+    append_entry(fd,&off,DIRTYPE,"truncated",NULL,"",0);
+    append_entry(fd,&off,'L',"././@LongLink",NULL,gnu_name,strlen(gnu_name) + 1);
+    append_entry(fd,&off,REGTYPE,"truncated",NULL,"long names",10);
+    char both[sizeof(pax_record) + sizeof(linkpath)];
+    snprintf(both, sizeof(both), "%s%s", pax_record, linkpath);
+    append_entry(fd,&off,'x',"PaxHeaders/x",NULL,both,strlen(both));
+    append_entry(fd,&off,SYMTYPE,"truncated","truncated","",0);
+    off_t prefixed = off;
+    append_entry(fd,&off,REGTYPE,"file.txt",NULL,"prefix",6);
+    tar_header_t header;
+    pread(fd,&header,sizeof(header),prefixed);
+    strcpy(header.prefix, "pre/fix");
+    snprintf(header.chksum, sizeof(header.chksum), "%06o", tar_checksum(&header));
+    header.chksum[7] = ' ';
+    pwrite(fd,&header,sizeof(header),prefixed);
+    off_t based = off;
+    append_entry(fd,&off,REGTYPE,"base256.txt",NULL,"base 256",8);
+    set_size_base256(fd,based,8);
+    if (ftruncate(fd,off + 1024) < 0)
+        perror("ftruncate");
+
+    tar_archive_t *archive = tar_open(fd);
+    char *names[] = {gnu_name, pax_name, "pre/fix/file.txt", "base256.txt"};
+    char *expected[] = {"long names", "long names", "prefix", "base 256"};
+    if (check_archive(fd) != 9 || archive == NULL || check_archive_h(archive) != 9) {printf("check_archive differs on long names\n"); failures++;}
+    if (!is_dir(fd,dir) || !is_symlink(fd,pax_name)) {printf("long names are not found\n"); failures++;}
+    for (int i = 0; i < 4 && archive != NULL; i++) {
+        uint8_t data[32], datah[32];
+        size_t len = sizeof(data), lenh = sizeof(datah);
+        if (read_file(fd,names[i],0,data,&len) != 0 || len != strlen(expected[i]) || memcmp(data,expected[i],len) != 0)
+            {printf("read_file differs on %s\n", names[i]); failures++;}
+        if (read_file_h(archive,names[i],0,datah,&lenh) != 0 || lenh != len || memcmp(data,datah,len) != 0)
+            {printf("read_file_h differs on %s\n", names[i]); failures++;}
+    }
+    tar_list_cursor_t cursor;
+    int listed = 0;
+    if (archive != NULL && list_begin(archive,dir,&cursor))
+        for (const char *name; (name = list_next(&cursor)) != NULL; listed++)
+            if (strcmp(name,names[listed < 2 ? listed : 0]) != 0) {printf("list_next differs on %s\n", name); failures++;}
+    if (listed != 2) {printf("list_next returned %d long names\n", listed); failures++;}
+    tar_close(archive);
+
+    /* a member over 4 GiB, as a hole, with its size in base 256 */
+    uint64_t huge = (5ULL << 30) + 3;
+    off = 0;
+    append_entry(fd,&off,REGTYPE,"huge.bin",NULL,"",0);
+    set_size_base256(fd,0,huge);
+    off = 512 + (huge + 511) / 512 * 512;
+    append_entry(fd,&off,REGTYPE,"after.txt",NULL,"after",5);
+    if (ftruncate(fd,off + 1024) == 0) {
+        uint8_t tail[8];
+        size_t len = sizeof(tail);
+        if (check_archive(fd) != 2 || !is_file(fd,"after.txt")) {printf("check_archive differs past 4 GiB\n"); failures++;}
+        if (read_file(fd,"huge.bin",huge - 3,tail,&len) != 0 || len != 3) {printf("read_file differs past 4 GiB\n"); failures++;}
+        len = sizeof(tail);
+        if (read_file(fd,"after.txt",0,tail,&len) != 0 || len != 5 || memcmp(tail,"after",5) != 0) {printf("read_file differs after 4 GiB\n"); failures++;}
+    }
+    close(fd);
+    return failures;
+}
+
+/* Sends part of a file to a regular file, a pipe and a socket: each must receive what
+ * read_file returns for the same range. */
+int send_and_compare(tar_archive_t *archive, int fd, char *path) {
+    int failures = 0;
+    uint8_t expected[1000], got[1000];
+    size_t len = sizeof(expected);
+    ssize_t ret = read_file(fd,path,3,expected,&len);
+    char tmp[] = "/tmp/lib_tar_testsXXXXXX";
+    int targets[3][2];
+    targets[0][0] = mkstemp(tmp);
+    targets[0][1] = targets[0][0];
+    unlink(tmp);
+    if (targets[0][0] == -1 || pipe(targets[1]) < 0 || socketpair(AF_UNIX,SOCK_STREAM,0,targets[2]) < 0) {
+        perror("send targets");
+        return 1;
+    }
+    for (int t = 0; t < 3; t++) {
+        ssize_t sent = tar_send_file(archive,path,targets[t][1],3,len);
+        if (ret < 0 ? sent != ret : sent != len) {printf("tar_send_file returned %zd on %s to target %d\n", sent, path, t); failures++;}
+        if (sent > 0 && (pread(targets[t][0],got,len,0) == len || read(targets[t][0],got,len) == len) && memcmp(got,expected,len) != 0)
+            {printf("tar_send_file sent other data on %s to target %d\n", path, t); failures++;}
+        close(targets[t][0]);
+        if (targets[t][1] != targets[t][0])
+            close(targets[t][1]);
+    }
+    return failures;
+}
+
+/* Writes an archive holding every kind of member, then appends to it: both must read back
+ * as written, with and without the index. */
+int check_writer(int src_fd) {
+    char path[] = "/tmp/lib_tar_testsXXXXXX";
+    int fd = mkstemp(path);
+    int failures = 0;
+    if (fd == -1) {
+        perror("mkstemp");
+        return 1;
+    }
+    unlink(path);
+    char prefixed[200], pax_name[200], pax_target[210];
+    memset(prefixed, 'p', 150);
+    snprintf(prefixed + 150, sizeof(prefixed) - 150, "/prefixed.txt");
+    memset(pax_name, 'x', 150);
+    snprintf(pax_name + 150, sizeof(pax_name) - 150, ".txt");
+    snprintf(pax_target, sizeof(pax_target), "../%s", pax_name);
+    tar_writer_t *w = tar_writer_open(fd, 0);
+    if (w == NULL || tar_writer_add_dir(w,"w",0755) < 0 || tar_writer_add_data(w,"w/a.txt","hello",5,0644) < 0
+        || tar_writer_add_file(w,"w/copy.tar",src_fd,0644) < 0 || tar_writer_add_symlink(w,"w/link","a.txt") < 0
+        || tar_writer_add_data(w,prefixed,"prefix",6,0644) < 0 || tar_writer_add_data(w,pax_name,"pax",3,0644) < 0
+        || tar_writer_add_symlink(w,"w/long",pax_target) < 0 || tar_writer_close(w) < 0)
+        {printf("tar_writer failed\n"); failures++;}
+    off_t end = lseek(fd,0,SEEK_END);
+    if (end % 10240 != 0 || check_archive(fd) != 9) {printf("written archive differs\n"); failures++;}
+
+    w = tar_writer_open(fd, TAR_WRITER_APPEND);
+    if (w == NULL || tar_writer_add_data(w,"w/b.txt","appended",8,0644) < 0 || tar_writer_close(w) < 0)
+        {printf("tar_writer append failed\n"); failures++;}
+    if (check_archive(fd) != 10) {printf("appended archive differs\n"); failures++;}
+
+    struct stat st;
+    uint8_t *copy = NULL;
+    if (fstat(src_fd,&st) == 0 && (copy = malloc(st.st_size)) != NULL && pread(src_fd,copy,st.st_size,0) != st.st_size)
+        perror("pread");
+    tar_archive_t *archive = tar_open(fd);
+    char *names[] = {"w/a.txt", "w/link", prefixed, pax_name, "w/long", "w/b.txt", "w/copy.tar"};
+    char *expected[] = {"hello", "hello", "prefix", "pax", "pax", "appended", (char *) copy};
+    size_t lens[] = {5, 5, 6, 3, 3, 8, st.st_size};
+    uint8_t *data = malloc(st.st_size + 16), *datah = malloc(st.st_size + 16);
+    for (int i = 0; i < 7 && archive != NULL && copy != NULL; i++) {
+        size_t len = st.st_size + 16, lenh = st.st_size + 16;
+        if (read_file(fd,names[i],0,data,&len) != 0 || len != lens[i] || memcmp(data,expected[i],len) != 0)
+            {printf("read_file differs on written %s\n", names[i]); failures++;}
+        if (read_file_h(archive,names[i],0,datah,&lenh) != 0 || lenh != len || memcmp(data,datah,len) != 0)
+            {printf("read_file_h differs on written %s\n", names[i]); failures++;}
+    }
+    if (archive == NULL || !is_dir_h(archive,"w/") || !is_symlink(fd,"w/long")) {printf("written members are not found\n"); failures++;}
+    tar_close(archive);
+    free(data);
+    free(datah);
+    free(copy);
+    close(fd);
+    return failures;
+}
+
+struct trace_log { int calls; int last_api; };
+
+void trace_call(void *arg, int api, const char *path, const tar_call_stats_t *call) {
+    struct trace_log *log = arg;
+    log->calls++;
+    log->last_api = api;
+}
+
+/* The counters are only there when the library is built with LIB_TAR_STATS. */
+int check_stats(int fd, char *path) {
+    int failures = 0;
+    tar_stats_t stats;
+    struct trace_log log = {0, -1};
+    if (tar_stats_reset() != 0) {
+        if (tar_stats_get(&stats) != -1 || stats.api[TAR_API_EXISTS].calls != 0 || tar_trace_set(trace_call,&log) != -1)
+            {printf("stats differ without LIB_TAR_STATS\n"); failures++;}
+        return failures;
+    }
+    tar_trace_set(trace_call,&log);
+    int nb_headers = check_archive(fd);
+    uint8_t data[100];
+    size_t len = sizeof(data);
+    exists(fd,path);
+    read_file(fd,"dirarchive/testf1.txt",0,data,&len);
+    tar_trace_set(NULL,NULL);
+    exists(fd,path);
+    if (tar_stats_get(&stats) != 0) {printf("tar_stats_get failed\n"); failures++;}
+    if (stats.api[TAR_API_CHECK_ARCHIVE].calls != 1 || stats.api[TAR_API_CHECK_ARCHIVE].headers != nb_headers)
+        {printf("check_archive stats differ\n"); failures++;}
+    if (stats.api[TAR_API_EXISTS].calls != 2 || stats.api[TAR_API_EXISTS].reads == 0 || stats.api[TAR_API_EXISTS].seeks == 0)
+        {printf("exists stats differ\n"); failures++;}
+    if (stats.api[TAR_API_READ_FILE].calls != 1 || stats.api[TAR_API_READ_FILE].bytes < len || stats.api[TAR_API_READ_FILE].ns == 0)
+        {printf("read_file stats differ\n"); failures++;}
+    if (log.calls != 3 || log.last_api != TAR_API_READ_FILE) {printf("trace saw %d calls\n", log.calls); failures++;}
+    tar_stats_reset();
+    tar_stats_get(&stats);
+    if (stats.api[TAR_API_EXISTS].calls != 0) {printf("tar_stats_reset differs\n"); failures++;}
+    return failures;
+}
+
+/* Reads a member spanning a few cache blocks and a hard link to it, through caches of
+ * different budgets: the data must stay the same and the counts add up. */
+int check_cache(void) {
+    char path[] = "/tmp/lib_tar_testsXXXXXX";
+    int fd = mkstemp(path);
+    int failures = 0;
+    if (fd == -1) {
+        perror("mkstemp");
+        return 1;
+    }
+    unlink(path);
+    size_t size = 150000;
+    uint8_t *hot = malloc(size), *got = malloc(size);
+    for (size_t i = 0; i < size; i++)
+        hot[i] = i * 7 + i / 251;
+    off_t off = 0;
+    append_entry(fd,&off,REGTYPE,"hot.bin",NULL,hot,size);
+    append_entry(fd,&off,LNKTYPE,"hard",NULL,"",0);
+    append_entry(fd,&off,REGTYPE,"small.txt",NULL,"small",5);
+    tar_header_t header;
+    pread(fd,&header,sizeof(header),512 + (size + 511) / 512 * 512);
+    strcpy(header.linkname, "hot.bin");
+    snprintf(header.chksum, sizeof(header.chksum), "%06o", tar_checksum(&header));
+    header.chksum[7] = ' ';
+    pwrite(fd,&header,sizeof(header),512 + (size + 511) / 512 * 512);
+    if (ftruncate(fd,off + 1024) < 0)
+        perror("ftruncate");
+
+    size_t len = size;
+    if (read_file(fd,"hard",0,got,&len) != 0 || len != size || memcmp(got,hot,size) != 0) {printf("read_file differs on a hard link\n"); failures++;}
+    tar_archive_t *archive = tar_open(fd);
+    tar_cache_stats_t stats;
+    char *names[] = {"hot.bin", "hot.bin", "hard", "small.txt"};
+    if (archive == NULL || tar_cache_set(archive,1 << 20) != 0) {
+        printf("tar_cache_set failed\n");
+        close(fd);
+        return failures + 1;
+    }
+    for (int i = 0; i < 4; i++) {
+        len = size;
+        ssize_t ret = read_file_h(archive,names[i],0,got,&len);
+        if (i < 3 ? ret != 0 || len != size || memcmp(got,hot,size) != 0 : ret != 0 || len != 5 || memcmp(got,"small",5) != 0)
+            {printf("read_file_h differs on cached %s\n", names[i]); failures++;}
+    }
+    tar_cache_stats(archive,&stats);
+    if (stats.misses != 4 || stats.hits != 6 || stats.evictions != 0 || stats.bytes != size + 5)
+        {printf("cache counted %llu hits %llu misses\n", (unsigned long long) stats.hits, (unsigned long long) stats.misses); failures++;}
+
+    /* a budget smaller than the member: the blocks are dropped as it is read */
+    tar_cache_set(archive,140000);
+    for (int i = 0; i < 2; i++) {
+        len = 1000;
+        if (read_file_h(archive,"hard",65000,got,&len) != size - 66000 || memcmp(got,hot + 65000,1000) != 0)
+            {printf("read_file_h differs across cached blocks\n"); failures++;}
+    }
+    len = size;
+    if (read_file_h(archive,"hot.bin",0,got,&len) != 0 || memcmp(got,hot,size) != 0) {printf("read_file_h differs on a small cache\n"); failures++;}
+    tar_cache_stats(archive,&stats);
+    if (stats.bytes > 140000 || stats.evictions != 1 || stats.hits != 4) {printf("small cache differs\n"); failures++;}
+    tar_close(archive);
+    free(hot);
+    free(got);
+    close(fd);
+    return failures;
+}
+
+struct found { int nb; char paths[8][64]; int stop_after; };
+
+int collect_found(const char *path, char typeflag, uint64_t size, void *arg) {
+    struct found *found = arg;
+    if (found->nb < 8)
+        snprintf(found->paths[found->nb], sizeof(found->paths[0]), "%s", path);
+    found->nb++;
+    return found->nb == found->stop_after;
+}
+
+/* Prefix and pattern queries must find the paths shell globbing would, in path order. */
+int check_find(void) {
+    char path[] = "/tmp/lib_tar_testsXXXXXX";
+    int fd = mkstemp(path);
+    int failures = 0;
+    if (fd == -1) {
+        perror("mkstemp");
+        return 1;
+    }
+    unlink(path);
+    tar_writer_t *w = tar_writer_open(fd, 0);
+    tar_writer_add_dir(w,"configs",0755);
+    tar_writer_add_data(w,"configs/b.json","{}",2,0644);
+    tar_writer_add_dir(w,"configs/sub",0755);
+    tar_writer_add_data(w,"configs/sub/c.json","{}",2,0644);
+    tar_writer_add_data(w,"configs/a.txt","a",1,0644);
+    tar_writer_add_data(w,"configsx.json","{}",2,0644);
+    tar_writer_add_data(w,"other/d.json","{}",2,0644);
+    tar_writer_add_data(w,"configs/b.json","{ }",3,0644);
+    tar_writer_close(w);
+    tar_archive_t *archive = tar_open(fd);
+    struct {
+        const char *prefix, *glob;
+        int nb;
+        const char *first, *last;
+    } queries[] = {
+        {"configs/", "*.json", 2, "configs/b.json", "configs/sub/c.json"},
+        {"configs/", NULL, 4, "configs/a.txt", "configs/sub/c.json"},
+        {"", "configs/*.json", 1, "configs/b.json", "configs/b.json"},
+        {"", "*.json", 4, "configs/b.json", "other/d.json"},
+        {"configs/s", "ub/*", 1, "configs/sub/c.json", "configs/sub/c.json"},
+        {"nothing/", NULL, 0, NULL, NULL},
+    };
+    for (int q = 0; q < sizeof(queries) / sizeof(queries[0]) && archive != NULL; q++) {
+        struct found found = {0};
+        ssize_t nb = tar_find(archive,queries[q].prefix,queries[q].glob,collect_found,&found);
+        if (nb != queries[q].nb || found.nb != nb || (nb > 0 && (strcmp(found.paths[0],queries[q].first) != 0 || strcmp(found.paths[nb - 1],queries[q].last) != 0)))
+            {printf("tar_find differs on %s %s: %zd\n", queries[q].prefix, queries[q].glob, nb); failures++;}
+    }
+    struct found found = {0, {{0}}, 2};
+    if (archive == NULL || tar_find(archive,"",NULL,collect_found,&found) != 2) {printf("tar_find does not stop\n"); failures++;}
+    tar_close(archive);
+    close(fd);
+    return failures;
+}
+
+int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    return remove(path);
+}
+
+/* Extracts an archive holding every kind of entry, unsafe ones included, with several threads. */
+int check_extract(int src_fd) {
+    char path[] = "/tmp/lib_tar_testsXXXXXX";
+    char base[] = "/tmp/lib_tar_extractXXXXXX";
+    int fd = mkstemp(path);
+    int failures = 0;
+    if (fd == -1 || mkdtemp(base) == NULL) {
+        perror("mkstemp");
+        return 1;
+    }
+    unlink(path);
+    char dest[64], file[128];
+    snprintf(dest, sizeof(dest), "%s/out", base);
+    mkdir(dest, 0755);
+    snprintf(file, sizeof(file), "%s/outside.txt", base);
+    close(open(file, O_WRONLY | O_CREAT, 0644));
+    tar_writer_t *w = tar_writer_open(fd, 0);
+    tar_writer_add_dir(w,"top",0750);
+    for (int i = 0; i < 20; i++) {
+        snprintf(file, sizeof(file), "top/sub%d/file%d.txt", i % 3, i);
+        tar_writer_add_data(w,file,file,strlen(file),0640);
+    }
+    tar_writer_add_file(w,"top/copy.tar",src_fd,0644);
+    tar_writer_add_data(w,"/abs.txt","abs",3,0644);
+    tar_writer_add_data(w,"top/../../evil.txt","evil",4,0644);
+    tar_writer_add_symlink(w,"top/link","sub1/file1.txt");
+    tar_writer_add_symlink(w,"top/escape","../../..");
+    /* each target stays inside on its own, but out climbs through d/up */
+    tar_writer_add_dir(w,"d",0755);
+    tar_writer_add_symlink(w,"d/up","..");
+    tar_writer_add_symlink(w,"out","d/up/..");
+    tar_writer_close(w);
+    /* the writer makes no hard link: one is put in place of the end of the archive */
+    int nb = check_archive(fd);
+    w = tar_writer_open(fd, TAR_WRITER_APPEND);
+    off_t off = lseek(fd,0,SEEK_CUR);
+    tar_writer_close(w);
+    append_entry(fd,&off,LNKTYPE,"top/hard","top/sub2/file2.txt","",0);
+    if (ftruncate(fd,off + 1024) < 0 || check_archive(fd) != nb + 1)
+        {printf("hard link not appended\n"); failures++;}
+
+    tar_archive_t *archives[] = {tar_open(fd), tar_open_mmap(fd)};
+    for (int a = 0; a < 2; a++) {
+        int ret = archives[a] == NULL ? -1 : tar_extract(archives[a],dest,3);
+        if (ret != 3) {printf("tar_extract returned %d\n", ret); failures++;}
+        for (int i = 0; i < 20; i++) {
+            char got[64] = {0};
+            snprintf(file, sizeof(file), "%s/top/sub%d/file%d.txt", dest, i % 3, i);
+            int in = open(file, O_RDONLY);
+            if (in < 0 || read(in,got,sizeof(got)) != strlen(file) - strlen(dest) - 1 || strcmp(got,file + strlen(dest) + 1) != 0)
+                {printf("extracted %s differs\n", file); failures++;}
+            if (in >= 0)
+                close(in);
+        }
+        struct stat st, st_src, st_hard, st_target;
+        char link[64] = {0};
+        snprintf(file, sizeof(file), "%s/top/copy.tar", dest);
+        if (stat(file,&st) < 0 || fstat(src_fd,&st_src) < 0 || st.st_size != st_src.st_size) {printf("extracted copy differs\n"); failures++;}
+        snprintf(file, sizeof(file), "%s/top/link", dest);
+        if (readlink(file,link,sizeof(link)) < 0 || strcmp(link,"sub1/file1.txt") != 0) {printf("extracted symlink differs\n"); failures++;}
+        snprintf(file, sizeof(file), "%s/top/escape", dest);
+        if (lstat(file,&st) == 0) {printf("escaping symlink extracted\n"); failures++;}
+        snprintf(file, sizeof(file), "%s/out", dest);
+        if (lstat(file,&st) == 0) {printf("chained escaping symlink extracted\n"); failures++;}
+        snprintf(file, sizeof(file), "%s/d/up", dest);
+        memset(link, 0, sizeof(link));
+        if (readlink(file,link,sizeof(link)) < 0 || strcmp(link,"..") != 0) {printf("extracted symlink to the top differs\n"); failures++;}
+        snprintf(file, sizeof(file), "%s/evil.txt", base);
+        if (lstat(file,&st) == 0) {printf("escaping path extracted\n"); failures++;}
+        snprintf(file, sizeof(file), "%s/abs.txt", dest);
+        if (lstat(file,&st) < 0) {printf("absolute path not extracted\n"); failures++;}
+        snprintf(file, sizeof(file), "%s/top/hard", dest);
+        char target[128];
+        snprintf(target, sizeof(target), "%s/top/sub2/file2.txt", dest);
+        if (stat(file,&st_hard) < 0 || stat(target,&st_target) < 0 || st_hard.st_ino != st_target.st_ino) {printf("extracted hard link differs\n"); failures++;}
+        tar_close(archives[a]);
+        nftw(dest, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+        mkdir(dest, 0755);
+    }
+    nftw(base, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    close(fd);
+    return failures;
+}
+
+/* Validates an archive as it grows: each call only counts what was appended, and a
+ * change to what was already validated is caught. */
+int check_resume(void) {
+    char path[] = "/tmp/lib_tar_testsXXXXXX";
+    int fd = mkstemp(path);
+    int failures = 0;
+    if (fd == -1) {
+        perror("mkstemp");
+        return 1;
+    }
+    unlink(path);
+    tar_check_state_t state;
+    memset(&state, 0, sizeof(state));
+    tar_writer_t *w = tar_writer_open(fd, 0);
+    tar_writer_add_data(w,"log/1","first",5,0644);
+    tar_writer_add_data(w,"log/2","second",6,0644);
+    tar_writer_close(w);
+    if (check_archive_resume(fd,&state) != 2 || check_archive_resume(fd,&state) != 2) {printf("check_archive_resume differs\n"); failures++;}
+    uint64_t validated = state.offset;
+
+    w = tar_writer_open(fd, TAR_WRITER_APPEND);
+    tar_writer_add_data(w,"log/3","third",5,0644);
+    tar_writer_close(w);
+    if (check_archive_resume(fd,&state) != 3 || state.offset != validated + 1024 || check_archive(fd) != 3)
+        {printf("check_archive_resume differs after an append\n"); failures++;}
+
+    /* a member whose data is still being written is left for later */
+    off_t off = state.offset;
+    append_entry(fd,&off,REGTYPE,"log/4",NULL,"fourth",6);
+    if (ftruncate(fd,state.offset + 512 + 3) < 0 || check_archive_resume(fd,&state) != 3)
+        {printf("check_archive_resume counts a partial member\n"); failures++;}
+    off = state.offset;
+    append_entry(fd,&off,REGTYPE,"log/4",NULL,"fourth",6);
+    if (ftruncate(fd,off + 1024) < 0 || check_archive_resume(fd,&state) != 4) {printf("check_archive_resume differs once complete\n"); failures++;}
+
+    /* a change inside the prefix is only seen when it is hashed again */
+    tar_check_state_t saved = state;
+    if (pwrite(fd,"F",1,512) != 1 || check_archive_resume(fd,&state) != 4) {printf("check_archive_resume rehashed the prefix\n"); failures++;}
+    state.verify_prefix = 1;
+    if (check_archive_resume(fd,&state) != -5 || memcmp(&state,&saved,offsetof(tar_check_state_t,verify_prefix)) != 0)
+        {printf("check_archive_resume missed a change in the prefix\n"); failures++;}
+    pwrite(fd,"f",1,512);
+    if (check_archive_resume(fd,&state) != 4) {printf("check_archive_resume differs on the whole prefix\n"); failures++;}
+    state.verify_prefix = 0;
+    /* the last validated header rewritten */
+    tar_header_t header;
+    pread(fd,&header,sizeof(header),state.last_header);
+    header.name[4] = '5';
+    snprintf(header.chksum, sizeof(header.chksum), "%06o", tar_checksum(&header));
+    header.chksum[7] = ' ';
+    pwrite(fd,&header,sizeof(header),state.last_header);
+    if (check_archive_resume(fd,&state) != -5) {printf("check_archive_resume missed a rewritten header\n"); failures++;}
+    close(fd);
+    return failures;
+}
+
+/* Three layers stacked: upper files, whiteouts, an opaque directory and a file in place
+ * of a directory must each hide what the layers below hold. */
+int check_union(void) {
+    int fds[3];
+    int failures = 0;
+    for (int i = 0; i < 3; i++) {
+        char path[] = "/tmp/lib_tar_testsXXXXXX";
+        fds[i] = mkstemp(path);
+        if (fds[i] == -1) {
+            perror("mkstemp");
+            return 1;
+        }
+        unlink(path);
+    }
+    tar_writer_t *w = tar_writer_open(fds[0], 0);
+    tar_writer_add_dir(w,"etc",0755);
+    tar_writer_add_data(w,"etc/a.conf","a0",2,0644);
+    tar_writer_add_data(w,"etc/b.conf","b0",2,0644);
+    tar_writer_add_dir(w,"var",0755);
+    tar_writer_add_dir(w,"var/log",0755);
+    tar_writer_add_data(w,"var/log/x","x",1,0644);
+    tar_writer_add_dir(w,"opt",0755);
+    tar_writer_add_data(w,"opt/keep","k",1,0644);
+    tar_writer_add_dir(w,"usr",0755);
+    tar_writer_add_data(w,"usr/old","o",1,0644);
+    tar_writer_close(w);
+    w = tar_writer_open(fds[1], 0);
+    tar_writer_add_data(w,"etc/a.conf","a1",2,0644);
+    tar_writer_add_data(w,"etc/.wh.b.conf","",0,0644);
+    tar_writer_add_data(w,".wh.var","",0,0644);
+    tar_writer_add_dir(w,"opt",0755);
+    tar_writer_add_data(w,"opt/.wh..wh..opq","",0,0644);
+    tar_writer_add_data(w,"opt/new","n",1,0644);
+    tar_writer_add_data(w,"usr","file",4,0644);
+    tar_writer_close(w);
+    w = tar_writer_open(fds[2], 0);
+    tar_writer_add_data(w,"etc/c.conf","c2",2,0644);
+    tar_writer_add_symlink(w,"link","etc/a.conf");
+    tar_writer_close(w);
+
+    tar_union_t *u = tar_union_open(fds, 3);
+    if (u == NULL) {
+        printf("tar_union_open failed\n");
+        return failures + 1;
+    }
+    char *present[] = {"etc/a.conf", "etc/c.conf", "opt/new", "usr", "link", "etc", "etc/", "opt/"};
+    char *absent[] = {"etc/b.conf", "etc/.wh.b.conf", "var", "var/log/x", "opt/keep", "usr/old", "opt/.wh..wh..opq"};
+    for (int i = 0; i < sizeof(present) / sizeof(present[0]); i++)
+        if (!exists_u(u,present[i])) {printf("exists_u misses %s\n", present[i]); failures++;}
+    for (int i = 0; i < sizeof(absent) / sizeof(absent[0]); i++)
+        if (exists_u(u,absent[i])) {printf("exists_u finds %s\n", absent[i]); failures++;}
+    if (!is_dir_u(u,"etc") || !is_file_u(u,"usr") || !is_symlink_u(u,"link") || is_dir_u(u,"usr")) {printf("is_*_u differ\n"); failures++;}
+    char *reads[][2] = {{"etc/a.conf", "a1"}, {"link", "a1"}, {"etc/c.conf", "c2"}, {"usr", "file"}};
+    for (int i = 0; i < 4; i++) {
+        uint8_t data[16];
+        size_t len = sizeof(data);
+        if (read_file_u(u,reads[i][0],0,data,&len) != 0 || len != strlen(reads[i][1]) || memcmp(data,reads[i][1],len) != 0)
+            {printf("read_file_u differs on %s\n", reads[i][0]); failures++;}
+    }
+    uint8_t data[16];
+    size_t len = sizeof(data);
+    if (read_file_u(u,"etc/b.conf",0,data,&len) != -1) {printf("read_file_u reads a whiteout\n"); failures++;}
+    char names[8][101];
+    char *entries[8];
+    for (int i = 0; i < 8; i++)
+        entries[i] = names[i];
+    size_t no_entries = 8;
+    if (!list_u(u,"etc/",entries,&no_entries) || no_entries != 2 || strcmp(names[0],"etc/c.conf") != 0 || strcmp(names[1],"etc/a.conf") != 0)
+        {printf("list_u differs on etc/\n"); failures++;}
+    no_entries = 8;
+    if (!list_u(u,"opt",entries,&no_entries) || no_entries != 1 || strcmp(names[0],"opt/new") != 0) {printf("list_u differs on opt\n"); failures++;}
+    no_entries = 8;
+    if (!list_u(u,"",entries,&no_entries) || no_entries != 4) {printf("list_u returned %zu top entries\n", no_entries); failures++;}
+    tar_union_close(u);
+    for (int i = 0; i < 3; i++)
+        close(fds[i]);
+    return failures;
+}
+
+int check_async(void) {
+    char path[] = "/tmp/lib_tar_testsXXXXXX";
+    int fd = mkstemp(path);
+    int failures = 0;
+    if (fd == -1) {
+        perror("mkstemp");
+        return 1;
+    }
+    unlink(path);
+    /* more members than io_uring takes at once */
+    enum { NB = 600 };
+    char name[32];
+    uint8_t data[700];
+    off_t off = 0;
+    for (int i = 0; i < NB; i++) {
+        snprintf(name, sizeof(name), "m/%03d", i);
+        memset(data, i, sizeof(data));
+        append_entry(fd,&off,REGTYPE,name,NULL,data,i + 100);
+    }
+    if (ftruncate(fd,off + 1024) < 0)
+        perror("ftruncate");
+
+    for (int mapped = 0; mapped < 2; mapped++) {
+        tar_archive_t *archive = mapped ? tar_open_mmap(fd) : tar_open(fd);
+        if (archive == NULL) {
+            printf("tar_open failed\n");
+            close(fd);
+            return failures + 1;
+        }
+        uint8_t *bufs = malloc(NB * sizeof(data));
+        int seen[NB + 2] = {0};
+        for (int i = 0; i < NB; i++) {
+            snprintf(name, sizeof(name), "m/%03d", i);
+            /* the odd members are read in part */
+            if (tar_read_submit(archive,name,i % 2 ? 10 : 0,bufs + i * sizeof(data),i % 2 ? 50 : sizeof(data),(void *) (intptr_t) i) != 0)
+                {printf("tar_read_submit failed on %s\n", name); failures++;}
+        }
+        tar_read_submit(archive,"m/missing",0,bufs,10,(void *) (intptr_t) NB);
+        tar_read_submit(archive,"m/001",1000,bufs,10,(void *) (intptr_t) (NB + 1));
+        tar_read_completion_t done[64];
+        /* a poll first, which hands the reads over without waiting */
+        int nb = tar_read_poll(archive,done,64);
+        while (nb >= 0) {
+            for (int c = 0; c < nb; c++) {
+                int i = (intptr_t) done[c].user_data;
+                seen[i]++;
+                if (i == NB ? done[c].ret != -1 : i == NB + 1 ? done[c].ret != -2 : 0)
+                    {printf("tar_read_wait gave %zd on a bad read\n", done[c].ret); failures++;}
+                if (i >= NB)
+                    continue;
+                size_t want = i % 2 ? 50 : i + 100;
+                ssize_t left = i % 2 ? i + 100 - 10 - 50 : 0;
+                uint8_t *got = bufs + i * sizeof(data);
+                if (done[c].ret != left || done[c].len != want || got[0] != (uint8_t) i || got[want - 1] != (uint8_t) i)
+                    {printf("tar_read_wait differs on member %d\n", i); failures++;}
+            }
+            nb = tar_read_wait(archive,done,64);
+            if (nb == 0)
+                break;
+        }
+        if (nb < 0) {printf("tar_read_wait failed\n"); failures++;}
+        for (int i = 0; i < NB + 2; i++)
+            if (seen[i] != 1) {printf("read %d completed %d times\n", i, seen[i]); failures++; break;}
+
+        /* reads still in flight are waited for on close */
+        tar_read_submit(archive,"m/599",0,bufs,sizeof(data),NULL);
+        tar_close(archive);
+        free(bufs);
+    }
+    close(fd);
+    return failures;
+}
+
+int check_entries(void) {
+    char path[] = "/tmp/lib_tar_testsXXXXXX";
+    int fd = mkstemp(path);
+    int failures = 0;
+    if (fd == -1) {
+        perror("mkstemp");
+        return 1;
+    }
+    unlink(path);
+    off_t off = 0;
+    append_entry(fd,&off,DIRTYPE,"d/",NULL,NULL,0);
+    append_entry(fd,&off,REGTYPE,"d/a.txt",NULL,"alpha",5);
+    append_entry(fd,&off,SYMTYPE,"d/l",NULL,NULL,0);
+    if (ftruncate(fd,off + 1024) < 0)
+        perror("ftruncate");
+
+    for (int mapped = 0; mapped < 2; mapped++) {
+        tar_archive_t *archive = mapped ? tar_open_mmap(fd) : tar_open(fd);
+        if (archive == NULL) {
+            printf("tar_open failed\n");
+            close(fd);
+            return failures + 1;
+        }
+        tar_entry_t entry;
+        const uint8_t *data;
+        size_t len;
+        if (tar_entry_count(archive) != 3) {printf("tar_entry_count returned %zu\n", tar_entry_count(archive)); failures++;}
+        if (tar_entry_at(archive,1,&entry) != 1 || strcmp(entry.name,"d/a.txt") != 0 || entry.typeflag != REGTYPE
+            || entry.size != 5 || entry.data_offset != 1024)
+            {printf("tar_entry_at differs on a file\n"); failures++;}
+        if (tar_entry_at(archive,0,&entry) != 1 || strcmp(entry.name,"d/") != 0 || entry.typeflag != DIRTYPE)
+            {printf("tar_entry_at differs on a directory\n"); failures++;}
+        if (tar_entry_at(archive,3,&entry) != 0) {printf("tar_entry_at found an entry past the end\n"); failures++;}
+        if (tar_map_entry(archive,1,&data,&len) != 0 || len != 5 || memcmp(data,"alpha",5) != 0)
+            {printf("tar_map_entry differs on a file\n"); failures++;}
+        if (tar_map_entry(archive,0,&data,&len) != -1 || tar_map_entry(archive,2,&data,&len) != -1 || tar_map_entry(archive,3,&data,&len) != -1)
+            {printf("tar_map_entry mapped something else than a file\n"); failures++;}
+        uint64_t data_offset, size;
+        if (tar_locate(archive,"d/a.txt",&data_offset,&size) != 0 || data_offset != 1024 || size != 5)
+            {printf("tar_locate differs on a file\n"); failures++;}
+        if (tar_locate(archive,"d/",&data_offset,&size) != -1) {printf("tar_locate located a directory\n"); failures++;}
+        tar_close(archive);
+    }
+    close(fd);
+    return failures;
+}
+
+int collect_digest(const tar_manifest_entry_t *entry, void *arg) {
+    uint64_t *digests = arg;
+    if (strcmp(entry->path, "big.bin") == 0)
+        digests[0] = entry->digest;
+    else if (strcmp(entry->path, "nine") == 0)
+        digests[1] = entry->digest;
+    return 0;
+}
+
+void count_verify(const char *path, int what, void *arg) {
+    int *counts = arg;
+    counts[what]++;
+}
+
+int check_manifest(void) {
+    char path[] = "/tmp/lib_tar_testsXXXXXX";
+    int fd = mkstemp(path);
+    char mpath[] = "/tmp/lib_tar_testsXXXXXX";
+    int mfd = mkstemp(mpath);
+    int failures = 0;
+    if (fd == -1 || mfd == -1) {
+        perror("mkstemp");
+        return 1;
+    }
+    unlink(path);
+    unlink(mpath);
+    size_t size = 600000;
+    uint8_t *big = malloc(size);
+    for (size_t i = 0; i < size; i++)
+        big[i] = i * 13 + i / 509;
+    off_t off = 0;
+    append_entry(fd,&off,REGTYPE,"nine",NULL,"123456789",9);
+    append_entry(fd,&off,DIRTYPE,"dir/",NULL,NULL,0);
+    append_entry(fd,&off,REGTYPE,"dir/spam",NULL,"Nobody inspects the spammish repetition",39);
+    append_entry(fd,&off,SYMTYPE,"dir/link",NULL,NULL,0);
+    append_entry(fd,&off,REGTYPE,"big.bin",NULL,big,size);
+    append_entry(fd,&off,REGTYPE,"nine",NULL,"123456789",9);
+    if (ftruncate(fd,off + 1024) < 0)
+        perror("ftruncate");
+
+    /* the digests are the same whether the data is read or mapped */
+    uint64_t digests[2][2] = {{0}};
+    for (int mapped = 0; mapped < 2; mapped++) {
+        tar_archive_t *archive = mapped ? tar_open_mmap(fd) : tar_open(fd);
+        if (tar_manifest(archive,TAR_HASH_CRC32C,mapped ? 1 : 3,collect_digest,digests[mapped]) != 4)
+            {printf("tar_manifest did not hash 4 files\n"); failures++;}
+        tar_close(archive);
+    }
+    if (digests[0][1] != 0xE3069283 || digests[0][0] != digests[1][0])
+        {printf("tar_manifest gave CRC-32C %08llx\n", (unsigned long long) digests[0][1]); failures++;}
+
+    tar_archive_t *archive = tar_open(fd);
+    if (tar_manifest(archive,0,1,collect_digest,digests[0]) != -1) {printf("tar_manifest took an unknown algorithm\n"); failures++;}
+    if (tar_manifest_write(archive,TAR_HASH_XXH64,2,mfd) != 4) {printf("tar_manifest_write did not write 4 files\n"); failures++;}
+    char text[512] = {0};
+    pread(mfd,text,sizeof(text) - 1,0);
+    if (strstr(text,"lib_tar manifest xxh64\n") != text || strstr(text,"fbcea83c8a378bf1 39 2048 dir/spam\n") == NULL)
+        {printf("tar_manifest_write wrote:\n%s", text); failures++;}
+    lseek(mfd,0,SEEK_SET);
+    if (tar_manifest_verify(archive,mfd,2,NULL,NULL) != 0) {printf("tar_manifest_verify differs on the same archive\n"); failures++;}
+    tar_close(archive);
+
+    /* change a byte of big.bin and drop the second copy of nine */
+    pwrite(fd,"!",1,3584 + 300000);
+    if (ftruncate(fd,3584 + (size + 511) / 512 * 512) < 0)
+        perror("ftruncate");
+    archive = tar_open(fd);
+    int counts[4] = {0};
+    lseek(mfd,0,SEEK_SET);
+    if (tar_manifest_verify(archive,mfd,0,count_verify,counts) != 2 || counts[TAR_VERIFY_CHANGED] != 1 || counts[TAR_VERIFY_MISSING] != 1)
+        {printf("tar_manifest_verify found %d changed %d missing\n", counts[TAR_VERIFY_CHANGED], counts[TAR_VERIFY_MISSING]); failures++;}
+    if (ftruncate(mfd,10) < 0)
+        perror("ftruncate");
+    lseek(mfd,0,SEEK_SET);
+    if (tar_manifest_verify(archive,mfd,1,NULL,NULL) != -1) {printf("tar_manifest_verify took a cut manifest\n"); failures++;}
+    tar_close(archive);
+    free(big);
+    close(mfd);
+    close(fd);
+    return failures;
+}
+
 int main(int argc, char **argv) {
     if (argc < 3) {
         printf("Usage: %s tar_file fichier_existe\n", argv[0]);
@@ -50,6 +1038,7 @@ char* string;
     }
     printf("\n%s\n", "------TEST CHECK ARCHIVE -----");
     int ret = check_archive(fd);
+    int ret_check = ret;
     printf("check_archive returned %d\n", ret);
 
     printf("\n------TEST EXISTS fichier : %s-----\n",argv[2]);
@@ -85,12 +1074,13 @@ char* string;
     printf("is_symlink returned : %s\n", string);
 
     printf("\n-------TEST LIST : %s-----\n",argv[2]);
-    int r = 10; //number of entries in entries
+    size_t r = 10; //number of entries in entries
     int c = 100;
     char **entries = (char **)malloc(r * sizeof(char *));
     for (int i=0; i<r; i++)
         entries[i] = (char *)malloc(c * sizeof(char));
-    ret = list(fd,argv[2],entries,(size_t *) &r);
+    ret = list(fd,argv[2],entries,&r);
+    int ret_list = ret;
     printf("list returned %d\n", ret);
     printf("\n%s", "Entries \n");
     for(int i=0; i<r;i++){
@@ -98,11 +1088,263 @@ char* string;
     }
 
     printf("\n-------TEST READ FILE : %s-----\n",argv[2]);
-    int len = 10000;
+    size_t len = 10000;
     uint8_t* dest = (uint8_t*) malloc(len * sizeof(char *));
-    ret = read_file(fd,argv[2],0,dest,(size_t *) &len);
+    ret = read_file(fd,argv[2],0,dest,&len);
     printf("read_file returned %d\n", ret);
     printf("dest = %s\n",dest);
+
+    printf("\n-------TEST HANDLE : %s-----\n",argv[2]);
+    int failures = 0;
+    tar_archive_t *archive = tar_open(fd);
+    if (archive == NULL) {
+        perror("tar_open");
+        return -1;
+    }
+    if (check_archive_h(archive) != check_archive(fd)) {printf("check_archive_h differs\n"); failures++;}
+    if (!exists_h(archive,argv[2]) != !exists(fd,argv[2])) {printf("exists_h differs\n"); failures++;}
+    if (!is_dir_h(archive,argv[2]) != !is_dir(fd,argv[2])) {printf("is_dir_h differs\n"); failures++;}
+    if (!is_file_h(archive,argv[2]) != !is_file(fd,argv[2])) {printf("is_file_h differs\n"); failures++;}
+    if (!is_symlink_h(archive,argv[2]) != !is_symlink(fd,argv[2])) {printf("is_symlink_h differs\n"); failures++;}
+    size_t rh = 10;
+    char **entriesh = (char **)malloc(rh * sizeof(char *));
+    for (int i=0; i<rh; i++)
+        entriesh[i] = (char *)malloc(c * sizeof(char));
+    if (!list_h(archive,argv[2],entriesh,&rh) != !ret_list || rh != r) {printf("list_h differs\n"); failures++;}
+    for (int i=0; i<rh && i<r; i++)
+        if (strcmp(entries[i],entriesh[i]) != 0) {printf("list_h differs at %d\n",i); failures++;}
+    size_t lenh = 10000;
+    uint8_t* desth = (uint8_t*) malloc(lenh);
+    if (read_file_h(archive,argv[2],0,desth,&lenh) != ret || (ret >= 0 && (lenh != len || memcmp(dest,desth,len) != 0))) {printf("read_file_h differs\n"); failures++;}
+    tar_list_cursor_t cursor;
+    const char *page[3];
+    size_t nb_listed = 0;
+    if (!list_begin(archive,argv[2],&cursor) != !ret_list) {printf("list_begin differs\n"); failures++;}
+    for (size_t nb_page; ret_list && (nb_page = list_next_page(&cursor,page,3)) > 0; nb_listed += nb_page)
+        for (size_t i = 0; i < nb_page; i++)
+            if (nb_listed + i >= r || strcmp(page[i],entries[nb_listed + i]) != 0) {printf("list_next_page differs\n"); failures++;}
+    if (ret_list && nb_listed != r) {printf("list_next_page differs\n"); failures++;}
+    tar_close(archive);
+
+    archive = tar_open_mmap(fd);
+    const uint8_t *mapped;
+    size_t lenm;
+    if (archive == NULL) {
+        perror("tar_open_mmap");
+        return -1;
+    }
+    if ((tar_map_file(archive,argv[2],&mapped,&lenm) == 0) != (ret == 0) || (ret == 0 && (lenm != len || memcmp(dest,mapped,len) != 0))) {printf("tar_map_file differs\n"); failures++;}
+    tar_close(archive);
+
+    char idx_path[] = "/tmp/lib_tar_testsXXXXXX";
+    close(mkstemp(idx_path));
+    archive = tar_open(fd);
+    if (tar_index_write(archive,idx_path) != 0) {perror("tar_index_write"); failures++;}
+    tar_close(archive);
+    for (int i = 0; i < 3; i++) {
+        archive = tar_open_index(fd,idx_path);
+        if (archive == NULL) {
+            perror("tar_open_index");
+            return -1;
+        }
+        size_t ri = 10;
+        if (check_archive_h(archive) != ret_check || !exists_h(archive,argv[2]) != !exists(fd,argv[2])
+            || !is_dir_h(archive,argv[2]) != !is_dir(fd,argv[2]) || !list_h(archive,argv[2],entriesh,&ri) != !ret_list || ri != r) {printf("tar_open_index differs\n"); failures++;}
+        tar_close(archive);
+        /* a damaged index is rebuilt, whether its header or its body is hit */
+        int idx_fd = open(idx_path,O_RDWR);
+        if (i == 0) {
+            /* every hash slot, at nb_slots and slots_offset in the header, sent out of range */
+            uint64_t nb_slots = 0, slots_offset = 0;
+            uint32_t bad = 0x7fffffff;
+            pread(idx_fd,&nb_slots,8,80);
+            pread(idx_fd,&slots_offset,8,88);
+            for (uint64_t s = 0; s < nb_slots; s++)
+                pwrite(idx_fd,&bad,4,slots_offset + s * 4);
+        } else
+            pwrite(idx_fd,"garbage",7,0);
+        close(idx_fd);
+    }
+    unlink(idx_path);
+    printf("handle returned %d differences\n", failures);
+
+    printf("\n-------TEST CHECKSUM-----\n");
+    int checksum_failures = 0;
+    const char *kernels[] = {"scalar", "sse2", "avx2"};
+    for (int k = 0; k < 3; k++) {
+        if (tar_checksum_kernel(kernels[k]) != 0)
+            continue;
+        if (check_archive(fd) != ret_check) {printf("check_archive differs with %s\n", kernels[k]); checksum_failures++;}
+        tar_header_t block;
+        for (int i = 0; i < 512; i++)
+            ((uint8_t *) &block)[i] = i * 37;
+        long unsigned_sum = 0;
+        for (int i = 0; i < 512; i++)
+            unsigned_sum += (i >= 148 && i < 156) ? ' ' : ((uint8_t *) &block)[i];
+        if (tar_checksum(&block) != unsigned_sum) {printf("tar_checksum differs with %s\n", kernels[k]); checksum_failures++;}
+    }
+    tar_checksum_kernel(NULL);
+    srand(42);
+    for (int i = 0; i < 10000; i++) {
+        char field[12];
+        unsigned long value = ((unsigned long) rand() << 2) % 077777777777;
+        snprintf(field, sizeof(field), i % 2 ? "%011lo" : "%7lo", value);
+        if (tar_parse_octal(field, sizeof(field)) != strtol(field, NULL, 8)) {printf("tar_parse_octal differs on %s\n", field); checksum_failures++;}
+    }
+    printf("checksum returned %d differences\n", checksum_failures);
+    failures += checksum_failures;
+
+    printf("\n-------TEST PARALLEL CHECK-----\n");
+    int parallel_failures = 0;
+    for (int n = 1; n <= 4; n++)
+        if (check_archive_parallel(fd,n) != ret_check) {printf("check_archive_parallel differs with %d threads\n", n); parallel_failures++;}
+    parallel_failures += corrupt_and_check(fd);
+    printf("parallel check returned %d differences\n", parallel_failures);
+    failures += parallel_failures;
+
+    printf("\n-------TEST STAT BATCH : %s-----\n",argv[2]);
+    char *batch[] = {argv[2], "no/such/entry", argv[2], "dirarchive/testf1.txt"};
+    tar_stat_t stats[4];
+    ssize_t nb_found = tar_stat_batch(fd,batch,4,stats);
+    int batch_failures = 0;
+    for (int i = 0; i < 4; i++) {
+        if (!stats[i].exists != !exists(fd,batch[i]) || (stats[i].exists && (stats[i].typeflag == DIRTYPE) != !!is_dir(fd,batch[i])))
+            {printf("tar_stat_batch differs on %s\n", batch[i]); batch_failures++;}
+        nb_found -= stats[i].exists != 0;
+    }
+    if (nb_found != 0) {printf("tar_stat_batch count differs\n"); batch_failures++;}
+    printf("stat batch returned %d differences\n", batch_failures);
+    failures += batch_failures;
+
+    printf("\n-------TEST ITERATOR-----\n");
+    int iter_failures = iterate_and_compare(fd,fd,0,ret_check) + iterate_and_compare(fd,fd,1024,ret_check);
+    int fds[2];
+    pthread_t feeder;
+    struct feed feed = {fd, -1};
+    if (pipe(fds) == 0 && (feed.out = fds[1]) >= 0 && pthread_create(&feeder,NULL,feed_pipe,&feed) == 0) {
+        iter_failures += iterate_and_compare(fd,fds[0],512,ret_check);
+        close(fds[0]);
+        pthread_join(feeder,NULL);
+    }
+    printf("iterator returned %d differences\n", iter_failures);
+    failures += iter_failures;
+
+    printf("\n-------TEST COMPRESSED : %s-----\n",argv[2]);
+    int gz_failures = 0;
+    int gz = gzip_copy(fd);
+    struct answers plain, decoded;
+    memset(&plain, 0, sizeof(plain));
+    memset(&decoded, 0, sizeof(decoded));
+    collect_answers(fd,argv[2],&plain);
+    collect_answers(gz,argv[2],&decoded);
+    if (!same_answers(&plain,&decoded)) {printf("answers differ on the gzip archive\n"); gz_failures++;}
+    if (check_archive_parallel(gz,2) != plain.check) {printf("check_archive_parallel differs on the gzip archive\n"); gz_failures++;}
+    gz_failures += iterate_and_compare(fd,gz,0,plain.check);
+    tar_archive_t *gz_archives[] = {tar_open(gz), tar_open_mmap(gz)};
+    for (int i = 0; i < 2; i++) {
+        size_t gz_len = sizeof(decoded.data);
+        const uint8_t *gz_mapped;
+        if (gz_archives[i] == NULL || check_archive_h(gz_archives[i]) != plain.check) {printf("handle %d differs on the gzip archive\n", i); gz_failures++; continue;}
+        if (read_file_h(gz_archives[i],argv[2],0,decoded.data,&gz_len) != plain.read
+            || (plain.read >= 0 && (gz_len != plain.len || memcmp(decoded.data,plain.data,gz_len) != 0))) {printf("read_file_h %d differs on the gzip archive\n", i); gz_failures++;}
+        if ((tar_map_file(gz_archives[i],argv[2],&gz_mapped,&gz_len) == 0) != (plain.read == 0)
+            || (plain.read == 0 && memcmp(gz_mapped,plain.data,gz_len) != 0)) {printf("tar_map_file %d differs on the gzip archive\n", i); gz_failures++;}
+        tar_close(gz_archives[i]);
+    }
+    close(gz);
+    printf("compressed returned %d differences\n", gz_failures);
+    failures += gz_failures;
+
+    printf("\n-------TEST SEND FILE : %s-----\n",argv[2]);
+    int send_failures = 0;
+    tar_archive_t *send_archives[] = {tar_open(fd), tar_open_mmap(fd)};
+    for (int i = 0; i < 2; i++) {
+        send_failures += send_and_compare(send_archives[i],fd,argv[2]) + send_and_compare(send_archives[i],fd,"dirarchive/testf1.txt");
+        tar_close(send_archives[i]);
+    }
+    gz = gzip_copy(fd);
+    tar_archive_t *gz_archive = tar_open(gz);
+    send_failures += send_and_compare(gz_archive,fd,"dirarchive/testf1.txt");
+    tar_close(gz_archive);
+    close(gz);
+    printf("send file returned %d differences\n", send_failures);
+    failures += send_failures;
+
+    printf("\n-------TEST LONG NAMES-----\n");
+    int long_failures = check_long_names();
+    printf("long names returned %d differences\n", long_failures);
+    failures += long_failures;
+
+    printf("\n-------TEST WRITER-----\n");
+    int writer_failures = check_writer(fd);
+    printf("writer returned %d differences\n", writer_failures);
+    failures += writer_failures;
+
+    printf("\n-------TEST CACHE-----\n");
+    int cache_failures = check_cache();
+    printf("cache returned %d differences\n", cache_failures);
+    failures += cache_failures;
+
+    printf("\n-------TEST FIND-----\n");
+    int find_failures = check_find();
+    printf("find returned %d differences\n", find_failures);
+    failures += find_failures;
+
+    printf("\n-------TEST EXTRACT-----\n");
+    int extract_failures = check_extract(fd);
+    printf("extract returned %d differences\n", extract_failures);
+    failures += extract_failures;
+
+    printf("\n-------TEST RESUME-----\n");
+    int resume_failures = check_resume();
+    printf("resume returned %d differences\n", resume_failures);
+    failures += resume_failures;
+
+    printf("\n-------TEST UNION-----\n");
+    int union_failures = check_union();
+    printf("union returned %d differences\n", union_failures);
+    failures += union_failures;
+
+    printf("\n-------TEST ASYNC-----\n");
+    int async_failures = check_async();
+    printf("async returned %d differences\n", async_failures);
+    failures += async_failures;
+
+    printf("\n-------TEST ENTRIES-----\n");
+    int entries_failures = check_entries();
+    printf("entries returned %d differences\n", entries_failures);
+    failures += entries_failures;
+
+    printf("\n-------TEST MANIFEST-----\n");
+    int manifest_failures = check_manifest();
+    printf("manifest returned %d differences\n", manifest_failures);
+    failures += manifest_failures;
+
+    printf("\n-------TEST STATS : %s-----\n",argv[2]);
+    int stats_failures = check_stats(fd,argv[2]);
+    printf("stats returned %d differences\n", stats_failures);
+    failures += stats_failures;
+
+    printf("\n-------TEST THREADS : %s-----\n",argv[2]);
+    struct answers expected;
+    memset(&expected, 0, sizeof(expected));
+    lseek(fd,42,SEEK_SET);
+    collect_answers(fd,argv[2],&expected);
+    pthread_t threads[NB_THREADS];
+    struct stress stress[NB_THREADS];
+    for (int i = 0; i < NB_THREADS; i++) {
+        stress[i] = (struct stress) {fd, argv[2], &expected, 0};
+        pthread_create(&threads[i],NULL,stress_thread,&stress[i]);
+    }
+    int stress_failures = 0;
+    for (int i = 0; i < NB_THREADS; i++) {
+        pthread_join(threads[i],NULL);
+        stress_failures += stress[i].failures;
+    }
+    if (lseek(fd,0,SEEK_CUR) != 42) {printf("file offset moved\n"); stress_failures++;}
+    printf("threads returned %d differences\n", stress_failures);
+    failures += stress_failures;
+
     close(fd);
-    return 0;
+    return failures;
 }
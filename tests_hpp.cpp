@@ -0,0 +1,75 @@
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "lib_tar.hpp"
+
+/* Walks an archive through lib_tar.hpp, built once as C++17 and once as C++20. */
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        printf("Usage: %s tar_file\n", argv[0]);
+        return -1;
+    }
+    int fd = open(argv[1], O_RDONLY);
+    if (fd == -1) {
+        perror("open(tar_file)");
+        return -1;
+    }
+    printf("\n-------TEST HPP (C++ %ld)-----\n", (long) __cplusplus);
+    int failures = 0;
+    tar::archive buffered = tar::archive::open(fd);
+    tar::archive mapped = tar::archive::open_mmap(fd);
+    if (buffered.in_memory() || !mapped.in_memory()) {printf("in_memory differs\n"); failures++;}
+
+    tar::entry_range entries = buffered.entries();
+    std::size_t count = 0, nb_files = 0;
+    for (tar::entry e : entries) {
+        if (e.index() != count || e.name().empty() || e.name().data()[e.name().size()] != '\0') {printf("entry %zu differs\n", count); failures++;}
+        count++;
+        if (!e.is_file())
+            continue;
+        nb_files++;
+        /* data() only on the archive in memory, read() on both */
+        std::vector<std::uint8_t> buf(e.size() + 1);
+        tar::read_result got = buffered.read(e.name().data(), buf);
+        tar::bytes data = mapped.entries()[e.index()].data();
+        if (got.data.size() != e.size() || got.remaining != 0 || data.size() != e.size()
+            || (e.size() > 0 && memcmp(got.data.data(), data.data(), e.size()) != 0)) {printf("data of %s differs\n", e.name().data()); failures++;}
+        try {
+            e.data();
+            printf("entry::data on a buffered archive\n"); failures++;
+        } catch (const std::logic_error &) {
+        }
+        try {
+            buffered.data(e.name().data());
+            printf("archive::data on a buffered archive\n"); failures++;
+        } catch (const std::logic_error &) {
+        }
+    }
+    if (count != tar_entry_count(buffered.get()) || count != entries.size() || nb_files == 0) {printf("entries differ\n"); failures++;}
+    try {
+        entries[entries.size()];
+        printf("entry past the end\n"); failures++;
+    } catch (const std::out_of_range &) {
+    }
+    try {
+        buffered.read("no/such/file", tar::span<std::uint8_t>());
+        printf("read of a missing file\n"); failures++;
+    } catch (const tar::error &e) {
+        if (e.code() != -1) {printf("read of a missing file returned %d\n", e.code()); failures++;}
+    }
+    for (tar::entry dir : mapped.entries()) {
+        if (!dir.is_dir())
+            continue;
+        tar::list_range list = mapped.list(dir.name().data());
+        if (!list) {printf("directory %s not listed\n", dir.name().data()); failures++;}
+        for (std::string_view name : list)
+            if (!mapped.exists(name.data()) || name.substr(0, dir.name().size()) != dir.name()) {printf("listed %s differs\n", name.data()); failures++;}
+    }
+
+    printf("hpp returned %d differences\n", failures);
+    close(fd);
+    return failures;
+}